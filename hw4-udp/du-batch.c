@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "du-batch.h"
+
+//One file or directory the client is about to send
+typedef struct batch_entry {
+    char            *path;              //relative to the root
+    uint64_t        size;
+    uint32_t        mode;
+    bool            dir;
+} batch_entry;
+
+typedef struct batch_list {
+    batch_entry     *entries;
+    int             count;
+    int             cap;
+    ftp_manifest    manifest;
+} batch_list;
+
+static int list_add(batch_list *l, const char *rel, struct stat *st){
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        batch_entry *e = realloc(l->entries, cap * sizeof(batch_entry));
+        if (e == NULL)
+            return DP_ERROR_GENERAL;
+        l->entries = e;
+        l->cap = cap;
+    }
+    batch_entry *e = &l->entries[l->count];
+    if ((e->path = strdup(rel)) == NULL)
+        return DP_ERROR_GENERAL;
+    e->dir = S_ISDIR(st->st_mode);
+    e->size = e->dir ? 0 : st->st_size;
+    e->mode = st->st_mode & 0777;
+    l->count++;
+    if (e->dir) {
+        l->manifest.dirs++;
+    } else {
+        l->manifest.files++;
+        l->manifest.total_bytes += e->size;
+    }
+    return DP_NO_ERROR;
+}
+
+//Adds root/rel, and everything under it if it is a directory
+static int list_walk(batch_list *l, const char *root, const char *rel){
+    char full[FTP_PATH_SZ + FNAME_SZ], sub[FTP_PATH_SZ];
+    struct stat st;
+    int rc;
+
+    snprintf(full, sizeof(full), "%s/%s", root, rel);
+    if (lstat(full, &st) < 0) {
+        printf("ERROR:  Cannot open file %s\n", full);
+        return DP_ERROR_GENERAL;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        printf("Batch: skipping %s, not a file or directory\n", full);
+        return DP_NO_ERROR;
+    }
+    if ((rc = list_add(l, rel, &st)) < 0 || !S_ISDIR(st.st_mode))
+        return rc;
+
+    DIR *d = opendir(full);
+    if (d == NULL) {
+        printf("ERROR:  Cannot open directory %s\n", full);
+        return DP_ERROR_GENERAL;
+    }
+    struct dirent *de;
+    rc = DP_NO_ERROR;
+    while (rc == DP_NO_ERROR && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (snprintf(sub, sizeof(sub), "%s/%s", rel, de->d_name) >= sizeof(sub)) {
+            printf("ERROR: path too long under %s\n", full);
+            rc = DP_ERROR_GENERAL;
+            break;
+        }
+        rc = list_walk(l, root, sub);
+    }
+    closedir(d);
+    return rc;
+}
+
+static void list_free(batch_list *l){
+    for (int i = 0; i < l->count; i++)
+        free(l->entries[i].path);
+    free(l->entries);
+}
+
+//Sends a PDU whose payload is already in place after the fat
+static int send_pdu(dp_connp dpc, char *msg, FILE_MSG_TYPE fat, int payloadLen){
+    ((File_Transfer_PDU *)msg)->fat = fat;
+    int rc = dpsend(dpc, msg, sizeof(File_Transfer_PDU) + payloadLen);
+    return rc < 0 ? rc : DP_NO_ERROR;
+}
+
+static int send_file(dp_connp dpc, char *msg, const char *root, batch_entry *e,
+                     dp_progress *p){
+    char full[FTP_PATH_SZ + FNAME_SZ];
+    File_Transfer_PDU *pdu = (File_Transfer_PDU *)msg;
+    ftp_file_create fc = { .size = e->size, .mode = e->mode,
+                           .flags = e->dir ? FTP_ENTRY_DIR : 0 };
+    int pathLen = strlen(e->path) + 1;
+    int fd = -1, n, rc;
+
+    if (!e->dir) {
+        snprintf(full, sizeof(full), "%s/%s", root, e->path);
+        if ((fd = open(full, O_RDONLY)) < 0) {
+            printf("ERROR:  Cannot open file %s\n", full);
+            return DP_ERROR_GENERAL;
+        }
+    }
+    memcpy(pdu->payload, &fc, sizeof(fc));
+    memcpy(pdu->payload + sizeof(fc), e->path, pathLen);
+    if ((rc = send_pdu(dpc, msg, FILE_CREATE, sizeof(fc) + pathLen)) < 0 || e->dir)
+        goto done;
+
+    ftp_file_close fcl = { .size = 0 };
+    int chunkSz = FTP_BATCH_MSG_SZ - sizeof(File_Transfer_PDU);
+    while ((n = read(fd, pdu->payload, chunkSz)) > 0) {
+        if ((rc = send_pdu(dpc, msg, DATA, n)) < 0)
+            goto done;
+        fcl.size += n;
+        dpprogress_add(p, n);
+    }
+    if (n < 0) {
+        perror("batch: read failed");
+        rc = DP_ERROR_GENERAL;
+        goto done;
+    }
+    memcpy(pdu->payload, &fcl, sizeof(fcl));
+    rc = send_pdu(dpc, msg, FILE_CLOSE, sizeof(fcl));
+
+done:
+    if (fd >= 0)
+        close(fd);
+    return rc;
+}
+
+/*
+ *  Client side.  Walks every name under root, sends the manifest and then
+ *  each entry, and waits for the server's tally.  The caller still owns
+ *  and disconnects dpc.
+ */
+int dpbatch_send(dp_connp dpc, const char *root, char *const names[], int count,
+                 dp_progress *p){
+    static char msg[FTP_BATCH_MSG_SZ];
+    File_Transfer_PDU *pdu = (File_Transfer_PDU *)msg;
+    batch_list l = {0};
+    ftp_session_result res;
+    int rc = DP_NO_ERROR;
+
+    for (int i = 0; i < count && rc == DP_NO_ERROR; i++)
+        rc = list_walk(&l, root, names[i]);
+    if (rc != DP_NO_ERROR)
+        goto done;
+    dpinfo("Batch: sending %u files and %u directories, %llu bytes\n", l.manifest.files,
+        l.manifest.dirs, (unsigned long long)l.manifest.total_bytes);
+    if (p != NULL)
+        p->total = l.manifest.total_bytes;
+
+    memcpy(pdu->payload, &l.manifest, sizeof(l.manifest));
+    if ((rc = send_pdu(dpc, msg, MANIFEST, sizeof(l.manifest))) < 0)
+        goto done;
+    for (int i = 0; i < l.count; i++)
+        if ((rc = send_file(dpc, msg, root, &l.entries[i], p)) < 0)
+            goto done;
+    if ((rc = send_pdu(dpc, msg, SESSION_END, 0)) < 0)
+        goto done;
+
+    if ((rc = dprecv(dpc, &res, sizeof(res))) != sizeof(res)) {
+        rc = rc < 0 ? rc : DP_ERROR_PROTOCOL;
+        goto done;
+    }
+    dpinfo("Batch: server wrote %u files and %u directories, %llu bytes, %u errors\n",
+        res.files, res.dirs, (unsigned long long)res.bytes, res.errors);
+    rc = res.errors == 0 && res.files == l.manifest.files ? DP_NO_ERROR : DP_ERROR_GENERAL;
+
+done:
+    list_free(&l);
+    return rc;
+}
+
+//Only plain relative paths, nothing that climbs out of the root
+bool dpbatch_path_ok(const char *p, int len){
+    if (len <= 0 || len >= FTP_PATH_SZ || p[len - 1] != '\0' || p[0] == '/' || p[0] == '\0')
+        return false;
+    for (const char *c = p; c != NULL; c = strchr(c, '/')) {
+        if (*c == '/')
+            c++;
+        if (strncmp(c, "..", 2) == 0 && (c[2] == '/' || c[2] == '\0'))
+            return false;
+    }
+    return true;
+}
+
+//mkdir -p of everything before the last '/'
+void dpbatch_make_parents(char *full){
+    for (char *c = strchr(full + 1, '/'); c != NULL; c = strchr(c + 1, '/')) {
+        *c = '\0';
+        mkdir(full, 0755);
+        *c = '/';
+    }
+}
+
+/*
+ *  Server side.  Recreates the batch under root and runs until the client
+ *  closes the connection, which also frees dpc.  buff must hold
+ *  FTP_BATCH_MSG_SZ, so a server running several sessions gives each one
+ *  its own.  Files go through the write engine (see du-write.h) with
+ *  their announced size, so a file only shows up once it is complete.  An
+ *  entry the server cannot write is dropped and counted, the rest of the
+ *  batch still goes in.
+ */
+int dpbatch_recv(dp_connp dpc, const char *root, char *buff, int buffSz,
+                 const dp_write_cfg *wc, dp_progress *p){
+    char full[FTP_PATH_SZ + FNAME_SZ];
+    File_Transfer_PDU *pdu = (File_Transfer_PDU *)buff;
+    ftp_manifest man = {0};
+    ftp_session_result res = {0};
+    bool haveManifest = false, inFile = false, ended = false;
+    uint64_t written = 0;
+    dp_writer *w = NULL;
+    int rc;
+
+    while ((rc = dprecv(dpc, buff, buffSz)) >= 0) {
+        int len = rc - (int)sizeof(File_Transfer_PDU);
+        if (len < 0 || (!haveManifest && pdu->fat != MANIFEST)) {
+            rc = DP_ERROR_PROTOCOL;
+            break;
+        }
+
+        if (pdu->fat == MANIFEST && len == sizeof(man)) {
+            memcpy(&man, pdu->payload, sizeof(man));
+            haveManifest = true;
+            dpinfo("Batch: receiving %u files and %u directories, %llu bytes\n", man.files,
+                man.dirs, (unsigned long long)man.total_bytes);
+            if (p != NULL)
+                p->total = man.total_bytes;
+        } else if (pdu->fat == FILE_CREATE && !inFile && len > sizeof(ftp_file_create)) {
+            ftp_file_create fc;
+            memcpy(&fc, pdu->payload, sizeof(fc));
+            char *path = pdu->payload + sizeof(fc);
+            if (!dpbatch_path_ok(path, len - sizeof(fc))) {
+                printf("ERROR: batch path rejected\n");
+                res.errors++;
+                inFile = !(fc.flags & FTP_ENTRY_DIR);
+                continue;
+            }
+            snprintf(full, sizeof(full), "%s/%s", root, path);
+            dpbatch_make_parents(full);
+            if (fc.flags & FTP_ENTRY_DIR) {
+                if (mkdir(full, fc.mode | 0700) == 0 || errno == EEXIST)
+                    res.dirs++;
+                else
+                    res.errors++;
+                continue;
+            }
+            inFile = true;
+            written = 0;
+            w = dpwriter_open(full, (fc.mode & 0777) | 0600, fc.size, wc);
+            if (w == NULL)
+                res.errors++;
+        } else if (pdu->fat == DATA && inFile) {
+            //data for a dropped file is just read off the wire
+            if (w != NULL && dpwriter_write(w, pdu->payload, len) < 0) {
+                dpwriter_abort(w);
+                w = NULL;
+                res.errors++;
+            }
+            written += len;
+            dpprogress_add(p, len);
+        } else if (pdu->fat == FILE_CLOSE && inFile && len == sizeof(ftp_file_close)) {
+            ftp_file_close fcl;
+            memcpy(&fcl, pdu->payload, sizeof(fcl));
+            if (w != NULL) {
+                if (fcl.size != written) {
+                    dpwriter_abort(w);
+                    res.errors++;
+                } else if (dpwriter_commit(w, NULL) == DP_NO_ERROR) {
+                    res.files++;
+                    res.bytes += written;
+                } else {
+                    res.errors++;
+                }
+            }
+            w = NULL;
+            inFile = false;
+        } else if (pdu->fat == SESSION_END && !inFile) {
+            ended = true;
+            if ((rc = dpsend(dpc, &res, sizeof(res))) < 0)
+                break;
+        } else {
+            printf("ERROR: unexpected batch message %d\n", pdu->fat);
+            rc = DP_ERROR_PROTOCOL;
+            break;
+        }
+    }
+    dpwriter_abort(w);
+
+    if (rc == DP_CONNECTION_CLOSED && !ended)
+        printf("ERROR: client closed before the end of the batch\n");
+    dpinfo("Batch: wrote %u of %u files and %u of %u directories, %llu bytes, %u errors\n",
+        res.files, man.files, res.dirs, man.dirs, (unsigned long long)res.bytes, res.errors);
+    return rc;
+}
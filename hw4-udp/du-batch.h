@@ -0,0 +1,21 @@
+#pragma once
+
+#include "du-proto.h"
+#include "du-ftp.h"
+#include "du-write.h"
+#include "du-progress.h"
+
+/*
+ *  Batch sessions for du-ftp, see the File_Transfer_PDU notes in du-ftp.h.
+ *  The client sends each name (a file or a whole directory tree under
+ *  root) and the server recreates them under its own root, so connection
+ *  setup and teardown are paid once for the whole batch.
+ */
+#define FTP_BATCH_MSG_SZ    XFER_BUFF_SZ    //largest PDU either side sends
+
+int dpbatch_send(dp_connp dpc, const char *root, char *const names[], int count,
+                 dp_progress *p);
+int dpbatch_recv(dp_connp dpc, const char *root, char *buff, int buffSz,
+                 const dp_write_cfg *wc, dp_progress *p);
+bool dpbatch_path_ok(const char *p, int len);     //len counts the NUL
+void dpbatch_make_parents(char *full);
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "du-cache.h"
+
+struct dp_cache_ent {
+    char            *path;
+    dev_t           dev;                //what the file was when read
+    ino_t           ino;
+    struct timespec mtime;
+    char            *data;              //NULL for an empty file
+    uint64_t        size;
+    int             refs;               //users, plus one while cached
+    dp_cache_ent    *hnext;             //bucket chain
+    dp_cache_ent    *prev;              //LRU list, most recent first
+    dp_cache_ent    *next;
+};
+
+struct dp_cache {
+    pthread_mutex_t lock;
+    size_t          maxBytes;
+    dp_cache_ent    *buckets[DP_CACHE_BUCKETS];
+    dp_cache_ent    *head;
+    dp_cache_ent    *tail;
+    dp_cache_stats  stats;
+};
+
+static unsigned bucket_of(const char *path){
+    uint32_t h = 2166136261u;           //FNV-1a
+
+    for (; *path; path++)
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    return h % DP_CACHE_BUCKETS;
+}
+
+static bool ent_current(dp_cache_ent *e, const struct stat *st){
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void ent_release(dp_cache_ent *e){
+    if (--e->refs > 0)
+        return;
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+static void lru_unlink(dp_cache *c, dp_cache_ent *e){
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(dp_cache *c, dp_cache_ent *e){
+    e->next = c->head;
+    if (c->head != NULL)
+        c->head->prev = e;
+    c->head = e;
+    if (c->tail == NULL)
+        c->tail = e;
+}
+
+//Takes e out of the cache, users keep their copy until they put it
+static void cache_drop(dp_cache *c, dp_cache_ent *e){
+    for (dp_cache_ent **p = &c->buckets[bucket_of(e->path)]; *p != NULL; p = &(*p)->hnext)
+        if (*p == e) {
+            *p = e->hnext;
+            break;
+        }
+    lru_unlink(c, e);
+    c->stats.bytes -= e->size;
+    c->stats.entries--;
+    ent_release(e);
+}
+
+static dp_cache_ent *cache_find(dp_cache *c, const char *path){
+    for (dp_cache_ent *e = c->buckets[bucket_of(path)]; e != NULL; e = e->hnext)
+        if (strcmp(e->path, path) == 0)
+            return e;
+    return NULL;
+}
+
+dp_cache *dpcache_new(size_t maxBytes){
+    dp_cache *c = calloc(1, sizeof(dp_cache));
+
+    if (c == NULL)
+        return NULL;
+    pthread_mutex_init(&c->lock, NULL);
+    c->maxBytes = maxBytes;
+    return c;
+}
+
+//A new entry with all of fd in it, NULL if it came up short
+static dp_cache_ent *read_file(const char *path, int fd, const struct stat *st){
+    dp_cache_ent *e = calloc(1, sizeof(dp_cache_ent));
+
+    if (e == NULL || (e->path = strdup(path)) == NULL)
+        goto fail;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->size = st->st_size;
+    e->refs = 1;
+    if (e->size > 0 && (e->data = malloc(e->size)) == NULL)
+        goto fail;
+    for (uint64_t off = 0; off < e->size; ) {
+        ssize_t n = pread(fd, e->data + off, e->size - off, off);
+        if (n <= 0)
+            goto fail;                  //shrank under us
+        off += n;
+    }
+    return e;
+
+fail:
+    if (e != NULL) {
+        free(e->data);
+        free(e->path);
+    }
+    free(e);
+    return NULL;
+}
+
+//fd and st are the caller's open copy of path
+dp_cache_ent *dpcache_get(dp_cache *c, const char *path, int fd, const struct stat *st,
+                          const void **data){
+    pthread_mutex_lock(&c->lock);
+    dp_cache_ent *e = cache_find(c, path);
+    if (e != NULL && ent_current(e, st)) {
+        c->stats.hits++;
+        lru_unlink(c, e);
+        lru_push(c, e);
+        e->refs++;
+        pthread_mutex_unlock(&c->lock);
+        *data = e->data;
+        return e;
+    }
+    if (e != NULL)
+        cache_drop(c, e);               //changed on disk
+    c->stats.misses++;
+    pthread_mutex_unlock(&c->lock);
+
+    //read outside the lock, hits on other files go on meanwhile
+    if ((uint64_t)st->st_size > c->maxBytes || (e = read_file(path, fd, st)) == NULL)
+        return NULL;
+    *data = e->data;
+
+    pthread_mutex_lock(&c->lock);
+    dp_cache_ent *old = cache_find(c, path);
+    if (old != NULL)
+        cache_drop(c, old);             //someone read it at the same time
+    unsigned b = bucket_of(path);
+    e->hnext = c->buckets[b];
+    c->buckets[b] = e;
+    lru_push(c, e);
+    e->refs++;
+    c->stats.bytes += e->size;
+    c->stats.entries++;
+    while (c->stats.bytes > c->maxBytes && c->tail != e) {
+        cache_drop(c, c->tail);
+        c->stats.evictions++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+void dpcache_put(dp_cache *c, dp_cache_ent *e){
+    if (e == NULL)
+        return;
+    pthread_mutex_lock(&c->lock);
+    ent_release(e);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void dpcache_stats(dp_cache *c, dp_cache_stats *out){
+    pthread_mutex_lock(&c->lock);
+    *out = c->stats;
+    pthread_mutex_unlock(&c->lock);
+}
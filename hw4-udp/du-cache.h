@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ *  Server side content cache for pull (-F) sessions.  A file is read into
+ *  memory once and stays there while it is among the most recently served
+ *  ones that fit in maxBytes, so a hot artifact fetched by many clients
+ *  is sent from memory instead of being read from disk again.  Every
+ *  lookup checks the file the caller has open against the copy and one
+ *  that changed on disk (size, mtime or inode) is read again.
+ *
+ *  The copy is private, not an mmap() of the file, so another transfer
+ *  truncating the file in place cannot fault a session sending it.
+ *
+ *  dpcache_get() hands back a reference; the data stays valid until
+ *  dpcache_put(), even if the entry is evicted or replaced meanwhile.
+ *  It returns NULL for a file bigger than the whole cache or one that
+ *  could not be read in full, the caller streams those from its fd.
+ *  Safe to share between threads.
+ */
+#define DP_CACHE_BUCKETS    256
+
+typedef struct dp_cache dp_cache;
+typedef struct dp_cache_ent dp_cache_ent;
+
+typedef struct dp_cache_stats {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
+    uint64_t    bytes;                  //held by cached entries now
+    uint64_t    entries;
+} dp_cache_stats;
+
+dp_cache *dpcache_new(size_t maxBytes);
+dp_cache_ent *dpcache_get(dp_cache *c, const char *path, int fd, const struct stat *st,
+                          const void **data);
+void dpcache_put(dp_cache *c, dp_cache_ent *e);
+void dpcache_stats(dp_cache *c, dp_cache_stats *out);
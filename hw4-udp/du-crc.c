@@ -0,0 +1,83 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "du-crc.h"
+
+#define CRC32C_POLY     0x82f63b78      //reflected Castagnoli
+
+static uint32_t crcTable[8][256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+static int haveHw;
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len){
+    uint64_t c = crc;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+static void crc_init(void){
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+        crcTable[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crcTable[t][i] = (crcTable[t - 1][i] >> 8) ^ crcTable[0][crcTable[t - 1][i] & 0xff];
+#if defined(__x86_64__)
+    haveHw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+//slicing-by-8, little endian only like the rest of du-proto
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len){
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+              crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff] ^
+              crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = (crc >> 8) ^ crcTable[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+uint32_t dpcrc32c(uint32_t crc, const void *data, size_t len){
+    pthread_once(&crcOnce, crc_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (haveHw)
+        return ~crc_hw(crc, data, len);
+#endif
+    return ~crc_sw(crc, data, len);
+}
+
+const char *dpcrc32c_impl(void){
+    pthread_once(&crcOnce, crc_init);
+    return haveHw ? "sse4.2" : "table";
+}
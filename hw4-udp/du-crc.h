@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *  CRC32C (Castagnoli), the polynomial SSE4.2 has an instruction for.  On
+ *  CPUs that have it the CRC runs 8 bytes per instruction, elsewhere a
+ *  slicing-by-8 table version is used; both give the same value.
+ *
+ *  crc is the running value, start with DP_CRC32C_INIT and pass the
+ *  result of one call into the next to hash a stream piece by piece.
+ */
+#define DP_CRC32C_INIT      0
+
+uint32_t dpcrc32c(uint32_t crc, const void *data, size_t len);
+const char *dpcrc32c_impl(void);
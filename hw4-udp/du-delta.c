@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "du-delta.h"
+#include "du-resume.h"
+
+//rsync's weak checksum, a in the low 16 bits and b in the high 16
+static uint32_t weak_sum(const unsigned char *p, int len, uint32_t *a, uint32_t *b){
+    uint32_t sa = 0, sb = 0;
+
+    for (int i = 0; i < len; i++) {
+        sa += p[i];
+        sb += (uint32_t)(len - i) * p[i];
+    }
+    *a = sa & 0xffff;
+    *b = sb & 0xffff;
+    return *a | (*b << 16);
+}
+
+/*
+ *  Open addressed table from weak checksum to old block, the same weak sum
+ *  can show up for several blocks so a lookup walks every one of them.
+ */
+typedef struct sig_table {
+    int32_t         *slots;             //block index, -1 = empty
+    uint32_t        mask;
+    dp_delta_sig    *sigs;
+} sig_table;
+
+static uint32_t sig_slot(uint32_t weak, uint32_t mask){
+    return (weak * 2654435761u) & mask;
+}
+
+static int sig_table_init(sig_table *t, dp_delta_sig *sigs, uint32_t count){
+    uint32_t sz = 16;
+
+    while (sz < count * 2)
+        sz <<= 1;
+    t->slots = malloc(sz * sizeof(int32_t));
+    if (t->slots == NULL)
+        return DP_ERROR_GENERAL;
+    memset(t->slots, 0xff, sz * sizeof(int32_t));
+    t->mask = sz - 1;
+    t->sigs = sigs;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t s = sig_slot(sigs[i].weak, t->mask);
+        while (t->slots[s] >= 0)
+            s = (s + 1) & t->mask;
+        t->slots[s] = i;
+    }
+    return DP_NO_ERROR;
+}
+
+//old block with this content, or -1
+static int sig_lookup(sig_table *t, uint32_t weak, const unsigned char *p){
+    bool haveStrong = false;
+    uint64_t strong = 0;
+
+    for (uint32_t s = sig_slot(weak, t->mask); t->slots[s] >= 0; s = (s + 1) & t->mask) {
+        dp_delta_sig *sig = &t->sigs[t->slots[s]];
+        if (sig->weak != weak)
+            continue;
+        if (!haveStrong) {
+            strong = dpresume_hash(p, DP_DELTA_BLOCK_SZ);
+            haveStrong = true;
+        }
+        if (sig->strong == strong)
+            return t->slots[s];
+    }
+    return -1;
+}
+
+//Client side op buffer, sent as one du-proto message when full
+typedef struct op_buff {
+    dp_connp        dpc;
+    char            buff[DP_DELTA_MSG_SZ];
+    int             len;
+    int             lastCopy;           //offset of a COPY op that can grow, -1 = none
+    uint64_t        literalBytes;
+    uint64_t        copiedBlocks;
+    dp_progress     *p;                 //file bytes covered by the ops so far
+} op_buff;
+
+static int ops_flush(op_buff *ob){
+    int rc = DP_NO_ERROR;
+
+    if (ob->len > 0)
+        rc = dpsend(ob->dpc, ob->buff, ob->len);
+    ob->len = 0;
+    ob->lastCopy = -1;
+    return rc < 0 ? rc : DP_NO_ERROR;
+}
+
+static int ops_add(op_buff *ob, uint32_t kind, uint32_t len, uint64_t arg,
+                    const void *data, int dataLen){
+    int rc;
+
+    if (ob->len + sizeof(dp_delta_op) + dataLen > DP_DELTA_MSG_SZ &&
+        (rc = ops_flush(ob)) < 0)
+        return rc;
+    dp_delta_op op = { .kind = kind, .len = len, .arg = arg };
+    memcpy(ob->buff + ob->len, &op, sizeof(op));
+    ob->len += sizeof(op);
+    if (dataLen > 0) {
+        memcpy(ob->buff + ob->len, data, dataLen);
+        ob->len += dataLen;
+    }
+    return DP_NO_ERROR;
+}
+
+static int ops_literal(op_buff *ob, const unsigned char *p, uint64_t len){
+    int maxLit = DP_DELTA_MSG_SZ - sizeof(dp_delta_op);
+    int rc;
+
+    ob->literalBytes += len;
+    while (len > 0) {
+        int n = len < maxLit ? len : maxLit;
+        if ((rc = ops_add(ob, DP_DELTA_LITERAL, n, 0, p, n)) < 0)
+            return rc;
+        ob->lastCopy = -1;
+        dpprogress_add(ob->p, n);
+        p += n;
+        len -= n;
+    }
+    return DP_NO_ERROR;
+}
+
+static int ops_copy(op_buff *ob, uint32_t block){
+    int rc;
+
+    ob->copiedBlocks++;
+    dpprogress_add(ob->p, DP_DELTA_BLOCK_SZ);
+    //runs of consecutive old blocks become one op
+    if (ob->lastCopy >= 0) {
+        dp_delta_op *op = (dp_delta_op *)(ob->buff + ob->lastCopy);
+        if (op->arg + op->len == block) {
+            op->len++;
+            return DP_NO_ERROR;
+        }
+    }
+    if ((rc = ops_add(ob, DP_DELTA_COPY, 1, block, NULL, 0)) < 0)
+        return rc;
+    ob->lastCopy = ob->len - sizeof(dp_delta_op);
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Client side.  Gets the signature of the server's copy, then walks the
+ *  new file sending copy ops for blocks the server has and literals for
+ *  the rest.  The caller still owns and disconnects dpc.
+ */
+int dpdelta_send(dp_connp dpc, const char *path, dp_progress *p){
+    static op_buff ob;
+    struct stat st;
+    dp_delta_req req;
+    dp_delta_sig_hdr hdr;
+    dp_delta_sig *sigs = NULL;
+    sig_table tbl = {0};
+    unsigned char *map = NULL;
+    int rc = DP_ERROR_GENERAL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("ERROR:  Cannot open file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return DP_ERROR_GENERAL;
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("delta: mmap failed");
+            close(fd);
+            return DP_ERROR_GENERAL;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    req.file_size = st.st_size;
+    if ((rc = dpsend(dpc, &req, sizeof(req))) < 0)
+        goto done;
+    if ((rc = dprecv(dpc, &hdr, sizeof(hdr))) != sizeof(hdr) ||
+        hdr.block_sz != DP_DELTA_BLOCK_SZ) {
+        rc = rc < 0 ? rc : DP_ERROR_PROTOCOL;
+        goto done;
+    }
+    uint64_t sigSz = (uint64_t)hdr.block_count * sizeof(dp_delta_sig);
+    sigs = malloc(sigSz + 1);
+    if (sigs == NULL) {
+        rc = DP_ERROR_GENERAL;
+        goto done;
+    }
+    if (sigSz > 0 && (rc = dprecv(dpc, sigs, sigSz)) != sigSz) {
+        rc = rc < 0 ? rc : DP_ERROR_PROTOCOL;
+        goto done;
+    }
+    if (sig_table_init(&tbl, sigs, hdr.block_count) < 0) {
+        rc = DP_ERROR_GENERAL;
+        goto done;
+    }
+
+    ob.dpc = dpc;
+    ob.len = 0;
+    ob.lastCopy = -1;
+    ob.literalBytes = ob.copiedBlocks = 0;
+    ob.p = p;
+
+    uint64_t n = st.st_size, pos = 0, litStart = 0;
+    uint32_t a = 0, b = 0;
+    bool haveSum = false;
+    rc = DP_NO_ERROR;
+    while (hdr.block_count > 0 && pos + DP_DELTA_BLOCK_SZ <= n && rc == DP_NO_ERROR) {
+        if (!haveSum) {
+            weak_sum(map + pos, DP_DELTA_BLOCK_SZ, &a, &b);
+            haveSum = true;
+        }
+        int blk = sig_lookup(&tbl, a | (b << 16), map + pos);
+        if (blk >= 0) {
+            if ((rc = ops_literal(&ob, map + litStart, pos - litStart)) < 0 ||
+                (rc = ops_copy(&ob, blk)) < 0)
+                break;
+            pos += DP_DELTA_BLOCK_SZ;
+            litStart = pos;
+            haveSum = false;
+            continue;
+        }
+        //slide the window one byte
+        if (pos + DP_DELTA_BLOCK_SZ < n) {
+            uint32_t out = map[pos], in = map[pos + DP_DELTA_BLOCK_SZ];
+            a = (a - out + in) & 0xffff;
+            b = (b - DP_DELTA_BLOCK_SZ * out + a) & 0xffff;
+        }
+        pos++;
+    }
+    if (rc == DP_NO_ERROR)
+        rc = ops_literal(&ob, map + litStart, n - litStart);
+    if (rc == DP_NO_ERROR)
+        rc = ops_add(&ob, DP_DELTA_END, 0, dpresume_hash(map, n), NULL, 0);
+    if (rc == DP_NO_ERROR)
+        rc = ops_flush(&ob);
+    if (rc == DP_NO_ERROR)
+        dpinfo("Delta: %llu literal bytes, %llu of %u old blocks reused (%llu bytes)\n",
+            (unsigned long long)ob.literalBytes, (unsigned long long)ob.copiedBlocks,
+            hdr.block_count, (unsigned long long)ob.copiedBlocks * DP_DELTA_BLOCK_SZ);
+
+done:
+    free(tbl.slots);
+    free(sigs);
+    if (map != NULL)
+        munmap(map, st.st_size);
+    return rc;
+}
+
+//Signature of the old file, NULL count 0 when there is none
+static dp_delta_sig *old_signature(int oldFd, uint32_t *count){
+    static unsigned char blk[DP_DELTA_BLOCK_SZ];
+    struct stat st;
+    uint32_t a, b;
+
+    *count = 0;
+    if (oldFd < 0 || fstat(oldFd, &st) < 0)
+        return NULL;
+    *count = st.st_size / DP_DELTA_BLOCK_SZ;
+    dp_delta_sig *sigs = calloc(*count + 1, sizeof(dp_delta_sig));
+    if (sigs == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    for (uint32_t i = 0; i < *count; i++) {
+        if (pread(oldFd, blk, DP_DELTA_BLOCK_SZ, (off_t)i * DP_DELTA_BLOCK_SZ)
+                != DP_DELTA_BLOCK_SZ) {
+            *count = i;
+            break;
+        }
+        sigs[i].weak = weak_sum(blk, DP_DELTA_BLOCK_SZ, &a, &b);
+        sigs[i].strong = dpresume_hash(blk, DP_DELTA_BLOCK_SZ);
+    }
+    return sigs;
+}
+
+/*
+ *  Server side.  Runs until the client closes the connection, which also
+ *  frees dpc.  The old file is only replaced if the new one came out
+ *  exactly as the client has it.
+ */
+int dpdelta_recv(dp_connp dpc, const char *path, dp_progress *p){
+    static char buff[DP_DELTA_MSG_SZ];
+    static unsigned char blk[DP_DELTA_BLOCK_SZ];
+    char tmpPath[256];
+    dp_delta_req req;
+    dp_delta_sig_hdr hdr;
+    uint64_t written = 0, h = DP_RESUME_HASH_INIT;
+    bool ended = false, ok = false;
+    int rc;
+
+    if ((rc = dprecv(dpc, &req, sizeof(req))) != sizeof(req))
+        return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+
+    int oldFd = open(path, O_RDONLY);
+    dp_delta_sig *sigs = old_signature(oldFd, &hdr.block_count);
+    hdr.block_sz = DP_DELTA_BLOCK_SZ;
+    dpinfo("Delta: old copy has %u blocks, new file is %llu bytes\n", hdr.block_count,
+        (unsigned long long)req.file_size);
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s%s", path, DP_DELTA_SUFFIX);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("ERROR:  Cannot open file %s\n", tmpPath);
+        rc = DP_ERROR_GENERAL;
+        goto done;
+    }
+
+    if ((rc = dpsend(dpc, &hdr, sizeof(hdr))) < 0)
+        goto done;
+    if (hdr.block_count > 0 &&
+        (rc = dpsend(dpc, sigs, hdr.block_count * sizeof(dp_delta_sig))) < 0)
+        goto done;
+
+    while ((rc = dprecv(dpc, buff, sizeof(buff))) >= 0) {
+        int off = 0;
+        while (off + (int)sizeof(dp_delta_op) <= rc && !ended) {
+            dp_delta_op op;
+            memcpy(&op, buff + off, sizeof(op));
+            off += sizeof(op);
+
+            if (op.kind == DP_DELTA_LITERAL && op.len <= rc - off) {
+                if (write(fd, buff + off, op.len) != op.len)
+                    goto writefail;
+                h = dpresume_hash_update(h, buff + off, op.len);
+                written += op.len;
+                dpprogress_add(p, op.len);
+                off += op.len;
+            } else if (op.kind == DP_DELTA_COPY && op.arg + op.len <= hdr.block_count) {
+                for (uint32_t i = 0; i < op.len; i++) {
+                    off_t at = (off_t)(op.arg + i) * DP_DELTA_BLOCK_SZ;
+                    if (pread(oldFd, blk, DP_DELTA_BLOCK_SZ, at) != DP_DELTA_BLOCK_SZ ||
+                        write(fd, blk, DP_DELTA_BLOCK_SZ) != DP_DELTA_BLOCK_SZ)
+                        goto writefail;
+                    h = dpresume_hash_update(h, blk, DP_DELTA_BLOCK_SZ);
+                    written += DP_DELTA_BLOCK_SZ;
+                    dpprogress_add(p, DP_DELTA_BLOCK_SZ);
+                }
+            } else if (op.kind == DP_DELTA_END) {
+                ended = true;
+                ok = op.arg == h && written == req.file_size;
+            } else {
+                printf("ERROR: bad delta op %u\n", op.kind);
+                rc = DP_ERROR_PROTOCOL;
+                goto done;
+            }
+        }
+    }
+    if (rc != DP_CONNECTION_CLOSED)
+        goto done;
+
+    if (ok && fsync(fd) == 0 && rename(tmpPath, path) == 0) {
+        dpinfo("Delta: rebuilt %s, %llu bytes\n", path, (unsigned long long)written);
+    } else {
+        printf("ERROR: delta result for %s did not check out, old copy kept\n", path);
+        unlink(tmpPath);
+    }
+    goto done;
+
+writefail:
+    perror("delta: rebuilding file failed");
+    rc = DP_ERROR_GENERAL;
+done:
+    if (rc != DP_CONNECTION_CLOSED && fd >= 0)
+        unlink(tmpPath);
+    if (fd >= 0)
+        close(fd);
+    if (oldFd >= 0)
+        close(oldFd);
+    free(sigs);
+    return rc;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "du-proto.h"
+#include "du-progress.h"
+
+/*
+ *  rsync style delta transfers for du-ftp.  The server already has an old
+ *  copy of the file and sends a signature of it: for every full
+ *  DP_DELTA_BLOCK_SZ block a weak rolling checksum and a strong hash.  The
+ *  client rolls the weak checksum over its new file a byte at a time,
+ *  confirms hits with the strong hash, and sends back a list of ops: copy
+ *  these old blocks, or here are literal bytes.  The server builds the new
+ *  file next to the old one and renames it into place once the whole file
+ *  hash checks out, so bytes on the wire follow the size of the change.
+ *
+ *  Exchange, all over one du-proto connection:
+ *      client -> dp_delta_req
+ *      server -> dp_delta_sig_hdr, then block_count dp_delta_sig
+ *      client -> op messages, each a run of dp_delta_op (+ literal bytes)
+ *                ending with a DP_DELTA_END op
+ *      client closes the connection
+ */
+#define DP_DELTA_BLOCK_SZ       2048
+#define DP_DELTA_MSG_SZ         (60 * 1024)     //ops are packed up to this
+#define DP_DELTA_SUFFIX         ".dpdelta"
+
+typedef struct dp_delta_req {
+    uint64_t    file_size;              //size of the new file
+} dp_delta_req;
+
+typedef struct dp_delta_sig_hdr {
+    uint32_t    block_sz;
+    uint32_t    block_count;            //full blocks of the old file
+} dp_delta_sig_hdr;
+
+typedef struct dp_delta_sig {
+    uint32_t    weak;                   //rolling checksum
+    uint32_t    pad;
+    uint64_t    strong;
+} dp_delta_sig;
+
+#define DP_DELTA_LITERAL    1           //len bytes follow the op
+#define DP_DELTA_COPY       2           //len old blocks starting at block arg
+#define DP_DELTA_END        3           //arg is the hash of the whole new file
+
+typedef struct dp_delta_op {
+    uint32_t    kind;
+    uint32_t    len;
+    uint64_t    arg;
+} dp_delta_op;
+
+int dpdelta_send(dp_connp dpc, const char *path, dp_progress *p);
+int dpdelta_recv(dp_connp dpc, const char *path, dp_progress *p);
@@ -4,15 +4,42 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "du-ftp.h"
 #include "du-proto.h"
+#include "du-uring.h"
+#include "du-pcap.h"
+#include "du-stripe.h"
+#include "du-resume.h"
+#include "du-delta.h"
+#include "du-lz.h"
+#include "du-batch.h"
+#include "du-pool.h"
+#include "du-pipe.h"
+#include "du-write.h"
+#include "du-progress.h"
+#include "du-rate.h"
+#include "du-sparse.h"
+#include "du-pull.h"
 
 
 #define BUFF_SZ 512
 static char sbuffer[BUFF_SZ];
-static char rbuffer[BUFF_SZ];
+static char rbuffer[XFER_BUFF_SZ];
 static char full_file_path[FNAME_SZ];
+static dp_write_cfg write_cfg;         //receiver write engine, from -D and -O
+static dp_progress progress;           //of the current transfer, see du-progress.h
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;  //for -P threads
+static bool quiet_mode;                //-q
+static const char *summary_path;       //-j, NULL for none
+static dp_sched *rate_sched;           //-G, NULL for none
+static dp_flow *xfer_flow;             //this run's transfer unless pooled, NULL if no cap
+static dp_cache *pull_cache;           //server side of -F, shared by pooled sessions
 
 /*
  *  Helper function that processes the command line arguements.  Highlights
@@ -34,8 +61,33 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     cfg->port_number = DEF_PORT_NO;
     strcpy(cfg->file_name, PROG_DEF_FNAME);
     strcpy(cfg->svr_ip_addr, PROG_DEF_SVR_ADDR);
+    cfg->unix_path[0] = '\0';
+    cfg->io_engine = IO_ENGINE_SOCKET;
+    cfg->pcap_file[0] = '\0';
+    cfg->busy_poll_us = 0;
+    cfg->subflows = 1;
+    cfg->ranges = 1;
+    cfg->use_mmap = false;
+    cfg->resume = false;
+    cfg->delta = false;
+    cfg->compress = false;
+    cfg->batch = false;
+    cfg->sparse = false;
+    cfg->pull = false;
+    cfg->cache_mb = DEF_CACHE_MB;
+    cfg->workers = 0;
+    cfg->max_sessions = 0;
+    cfg->mem_limit_kb = 0;
+    cfg->pipe_depth = DEF_PIPE_DEPTH;
+    cfg->durability = DP_DURABLE_NONE;
+    cfg->direct_io = false;
+    cfg->quiet = false;
+    cfg->json_file[0] = '\0';
+    cfg->rate_limit = 0;
+    cfg->shared_rate = 0;
+    cfg->traffic_class = DP_CLASS_INTERACTIVE;
     
-    while ((option = getopt(argc, argv, ":p:f:a:csh")) != -1){
+    while ((option = getopt(argc, argv, ":p:f:a:u:w:b:S:P:W:n:M:B:D:j:L:G:C:K:mrdztHFOqiIcsh")) != -1){
         switch(option) {
             case 'p':
                 strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
@@ -47,6 +99,114 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
             case 'a':
                 strncpy(cfg->svr_ip_addr, optarg, sizeof(cfg->svr_ip_addr));
                 break;
+            case 'u':
+                strncpy(cfg->unix_path, optarg, sizeof(cfg->unix_path) - 1);
+                break;
+            case 'w':
+                strncpy(cfg->pcap_file, optarg, sizeof(cfg->pcap_file) - 1);
+                break;
+            case 'b':
+                cfg->busy_poll_us = atoi(optarg);
+                break;
+            case 'S':
+                cfg->subflows = atoi(optarg);
+                if (cfg->subflows < 1 || cfg->subflows > DP_STRIPE_MAX_SUBFLOWS) {
+                    printf("ERROR: -S takes 1 to %d subflows\n", DP_STRIPE_MAX_SUBFLOWS);
+                    exit(-1);
+                }
+                break;
+            case 'P':
+                cfg->ranges = atoi(optarg);
+                if (cfg->ranges < 1 || cfg->ranges > MAX_RANGES) {
+                    printf("ERROR: -P takes 1 to %d ranges\n", MAX_RANGES);
+                    exit(-1);
+                }
+                break;
+            case 'W':
+                cfg->workers = atoi(optarg);
+                if (cfg->workers < 1 || cfg->workers > DP_POOL_MAX_WORKERS) {
+                    printf("ERROR: -W takes 1 to %d workers\n", DP_POOL_MAX_WORKERS);
+                    exit(-1);
+                }
+                break;
+            case 'n':
+                cfg->max_sessions = atoi(optarg);
+                break;
+            case 'M':
+                cfg->mem_limit_kb = atoi(optarg);
+                break;
+            case 'B':
+                cfg->pipe_depth = atoi(optarg);
+                if (cfg->pipe_depth < 1 || cfg->pipe_depth > DP_RING_MAX_SLOTS) {
+                    printf("ERROR: -B takes 1 to %d buffers\n", DP_RING_MAX_SLOTS);
+                    exit(-1);
+                }
+                break;
+            case 'D':
+                cfg->durability = dpwriter_parse_durability(optarg);
+                if (cfg->durability < 0) {
+                    printf("ERROR: -D takes none, close or periodic\n");
+                    exit(-1);
+                }
+                break;
+            case 'O':
+                cfg->direct_io = true;
+                break;
+            case 'j':
+                strncpy(cfg->json_file, optarg, sizeof(cfg->json_file) - 1);
+                break;
+            case 'q':
+                cfg->quiet = true;
+                break;
+            case 'L':
+            case 'G':
+                if (dprate_parse(optarg, option == 'L' ? &cfg->rate_limit : 
+                                                         &cfg->shared_rate) < 0) {
+                    printf("ERROR: -%c takes bytes per second, K, M or G may follow\n", option);
+                    exit(-1);
+                }
+                break;
+            case 'C':
+                cfg->traffic_class = dprate_parse_class(optarg);
+                if (cfg->traffic_class < 0) {
+                    printf("ERROR: -C takes interactive or background\n");
+                    exit(-1);
+                }
+                break;
+            case 'K':
+                cfg->cache_mb = atoi(optarg);
+                if (cfg->cache_mb < 0) {
+                    printf("ERROR: -K takes the cache size in MB, 0 for none\n");
+                    exit(-1);
+                }
+                break;
+            case 'm':
+                cfg->use_mmap = true;
+                break;
+            case 'r':
+                cfg->resume = true;
+                break;
+            case 'd':
+                cfg->delta = true;
+                break;
+            case 'z':
+                cfg->compress = true;
+                break;
+            case 't':
+                cfg->batch = true;
+                break;
+            case 'H':
+                cfg->sparse = true;
+                break;
+            case 'F':
+                cfg->pull = true;
+                break;
+            case 'i':
+                cfg->io_engine = IO_ENGINE_URING;
+                break;
+            case 'I':
+                cfg->io_engine = IO_ENGINE_SQPOLL;
+                break;
             case 'c':
                 cfg->prog_mode = PROG_MD_CLI;
                 break;
@@ -54,11 +214,42 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
                 cfg->prog_mode = PROG_MD_SVR;
                 break;
             case 'h':
-                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-s] [-c] [-h]\n", argv[0]);
+                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-u sock_path] [-i|-I] [-w pcap_file] [-b spin_us] [-S subflows] [-P ranges] [-B buffers] [-D durability] [-O] [-q] [-j json_file] [-L rate] [-G rate] [-C class] [-m] [-r] [-d] [-z] [-t] [-H] [-F [-K cache_mb]] [-W workers [-n sessions] [-M mem_kb]] [-s] [-c] [-h] [more fnames with -t or -F]\n", argv[0]);
                 printf("WHERE:\n\t[-c] runs in client mode, [-s] runs in server mode; DEFAULT= client_mode\n");
                 printf("\t[-a svr_addr] specifies the servers IP address as a string; DEFAULT = %s\n", cfg->svr_ip_addr);
                 printf("\t[-p portnum] specifies the port number; DEFAULT = %d\n", cfg->port_number);
                 printf("\t[-f fname] specifies the filename to send or recv; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-u sock_path] use a unix domain socket at sock_path instead of UDP, same host only\n");
+                printf("\t[-i] use the io_uring I/O engine, [-I] io_uring with a kernel submission thread\n");
+                printf("\t[-w pcap_file] capture all du-proto datagrams to pcap_file, see du-proto.lua\n");
+                printf("\t[-b spin_us] busy poll for up to spin_us before blocking on a receive\n");
+                printf("\t[-S subflows] stripe over subflows UDP flows on ports portnum and up, both sides must match\n");
+                printf("\t[-B buffers] buffers between the disk and network threads, 1 = one thread; DEFAULT = %d\n", DEF_PIPE_DEPTH);
+                printf("\t[-D none|close|periodic] server syncs received files never, once at the end or every %d MB too\n", DP_WRITE_SYNC_EVERY >> 20);
+                printf("\t[-O] server writes received files with O_DIRECT where the file system allows\n");
+                printf("\t[-q] quiet, only errors; no progress lines, status lines, stats tables or PDU dumps\n");
+                printf("\t[-j json_file] write a JSON summary of the run to json_file, - for stdout\n");
+                printf("\t[-L rate] cap each transfer at rate bytes/s, K, M or G may follow\n");
+                printf("\t[-G rate] cap all transfers of this process together, split by class weight, see -C\n");
+                printf("\t[-C interactive|background] class of our transfers, the server learns the\n");
+                printf("\t     client's; under -G they share the cap 8:1, interactive to background;\n");
+                printf("\t     DEFAULT = interactive\n");
+                printf("\t[-m] client sends the file from an mmap() of it instead of fread() copies\n");
+                printf("\t[-r] resumable transfer, a rerun only sends what the server is missing; both sides\n");
+                printf("\t[-d] delta transfer against the server's existing copy, rsync style; both sides\n");
+                printf("\t[-z] compress the stream if the server agrees, skipped for data that does not shrink; both sides\n");
+                printf("\t[-t] batch session, the client sends fname and any more names given, files or whole\n");
+                printf("\t     directories, over one connection; the server keeps their paths under ./infile\n");
+                printf("\t[-H] sparse file, only the data extents are sent and the holes kept; both sides\n");
+                printf("\t[-F] pull, the client fetches fname and any more names given from the server's\n");
+                printf("\t     ./infile over one connection, each kept at its path under ./pulled; both sides,\n");
+                printf("\t     the server may use -W\n");
+                printf("\t[-K cache_mb] with -F, server keeps recently served files in up to cache_mb MB of memory; DEFAULT = %d\n", DEF_CACHE_MB);
+                printf("\t[-W workers] server keeps running and serves sessions on a pool of workers threads,\n");
+                printf("\t     session n goes to ./infile/fname.n (./infile/session-n/ with -t)\n");
+                printf("\t[-n sessions] with -W, most sessions running or queued, more are refused; DEFAULT = 4 per worker\n");
+                printf("\t[-M mem_kb] with -W, most session memory in KB, sessions past it are refused\n");
+                printf("\t[-P ranges] split the file in ranges sent at once on ports portnum and up, both sides must match\n");
                 printf("\t[-p] displays what you are looking at now - the help\n\n");
                 exit(0);
             case ':':
@@ -73,11 +264,88 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     return cfg->prog_mode;
 }
 
+//Switch to the io_uring engine if asked, silently staying on sockets if
+//the kernel cant do it
+static void setup_io_engine(dp_connp dpc, prog_config *cfg){
+    if (cfg->io_engine == IO_ENGINE_SOCKET)
+        return;
+    if (dpuringenable(dpc, cfg->io_engine == IO_ENGINE_SQPOLL ? DP_URING_SQPOLL : 0) 
+            == DP_NO_ERROR)
+        dpinfo("Using io_uring I/O engine\n");
+    else
+        dpinfo("io_uring not available, using sendto()/recvfrom()\n");
+}
+
+//Before the connect, the class goes out with it
+static void setup_rate(dp_connp dpc, prog_config *cfg){
+    dpc->trafficClass = cfg->traffic_class;
+    dpflow_attach(dpc, xfer_flow);
+}
+
+static void setup_busy_poll(dp_connp dpc, prog_config *cfg){
+    if (cfg->busy_poll_us <= 0)
+        return;
+    if (dpsetbusypoll(dpc, cfg->busy_poll_us) == DP_NO_ERROR)
+        dpinfo("Busy polling for up to %d us per receive\n", cfg->busy_poll_us);
+    else
+        dpinfo("Busy polling needs the socket I/O engine, blocking instead\n");
+}
+
+//CPU time used so far, to weigh busy polling against the latency it buys
+static void print_cpu_usage(void){
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return;
+    printf("CPU: user %.3f s, sys %.3f s\n",
+        ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+}
+
+//Everything that gets reported once a transfer is over
+static void print_run_stats(dp_stats *st){
+    dpprogress_end(&progress);
+    if (!quiet_mode) {
+        dpstats_print(st, stdout);
+        print_cpu_usage();
+    }
+    if (summary_path != NULL)
+        dpprogress_summary(&progress, summary_path, st);
+}
+
+//Clients close before reporting, so the summary has the verdict of the
+//close handshake's integrity check
+static void finish_client(dp_connp dpc){
+    dp_stats *stats = dpstats_detach(dpc);
+    dpdisconnect(dpc);
+    print_run_stats(stats);
+    free(stats);
+}
+
+static void print_rtt(dp_connp dpc){
+    if (quiet_mode)
+        return;
+    printf("RTT estimate: srtt %.1f us, rttvar %.1f us, rto %.1f us (%s rx timestamps)\n",
+        dpc->srttNs / 1e3, dpc->rttvarNs / 1e3, dprto(dpc) / 1e3,
+        dpc->rxStamps ? "kernel" : "user space");
+}
+
+static void print_write_stats(dp_write_stats *ws){
+    dpinfo("Write: %llu bytes in %llu writes, %llu preallocated, %llu syncs%s\n",
+        (unsigned long long)ws->bytes, (unsigned long long)ws->writes,
+        (unsigned long long)ws->preallocated, (unsigned long long)ws->syncs,
+        ws->direct ? ", O_DIRECT" : "");
+    if (ws->holes > 0)
+        dpinfo("Write: %llu bytes left as holes\n", (unsigned long long)ws->holes);
+}
+
 int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz){
     int rcvSz;
+    dp_stats *stats = dpstats_detach(dpc);
+    dp_write_stats ws;
 
-    FILE *f = fopen(full_file_path, "wb+");
-    if(f == NULL){
+    dp_writer *w = dpwriter_open(full_file_path, 0644, 0, &write_cfg);
+    if(w == NULL){
         printf("ERROR:  Cannot open file %s\n", full_file_path);
         exit(-1);
     }
@@ -91,15 +359,28 @@ int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_
         //receive request from client
         rcvSz = dprecv(dpc, rBuff, rbuff_sz);
         if (rcvSz == DP_CONNECTION_CLOSED){
-            fclose(f);
-            printf("Client closed connection\n");
+            dpinfo("Client closed connection\n");
+            if (stats->integrity == DP_INTEGRITY_MISMATCH) {
+                printf("ERROR: %s failed the integrity check, not kept\n", full_file_path);
+                dpwriter_abort(w);
+            } else if (dpwriter_commit(w, &ws) == DP_NO_ERROR)
+                print_write_stats(&ws);
+            else
+                printf("ERROR: could not finish %s\n", full_file_path);
+            print_run_stats(stats);
+            free(stats);
             return DP_CONNECTION_CLOSED;
         }
-        fwrite(rBuff, 1, rcvSz, f);
-        rcvSz = rcvSz > 50 ? 50 : rcvSz;    //Just print the first 50 characters max
-
-        printf("========================> \n%.*s\n========================> \n", 
-            rcvSz, (char *)rBuff);
+        if (rcvSz < 0){
+            printf("ERROR: dprecv failed with %d\n", rcvSz);
+            dpwriter_abort(w);
+            return rcvSz;
+        }
+        if (dpwriter_write(w, rBuff, rcvSz) < 0) {
+            dpwriter_abort(w);
+            return DP_ERROR_GENERAL;
+        }
+        dpprogress_add(&progress, rcvSz);
     }
 
 }
@@ -107,7 +388,8 @@ int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_
 
 
 void start_client(dp_connp dpc){
-    static char sBuff[5000];
+    static char sBuff[XFER_BUFF_SZ];
+    int chunkSz;
 
     if(!dpc->isConnected) {
         printf("Client not connected\n");
@@ -130,23 +412,848 @@ void start_client(dp_connp dpc){
     int dp_rc;
     int dp_err = 0;
 
-    while ((bytes = fread(sBuff, 1, sizeof(sBuff), f )) > 0){
+    //unix sockets carry much bigger datagrams, read a full one at a time
+    chunkSz = dpmaxpayload(dpc) > DEF_CHUNK_SZ ? dpmaxpayload(dpc) : DEF_CHUNK_SZ;
+    if (chunkSz > sizeof(sBuff))
+        chunkSz = sizeof(sBuff);
+
+    while ((bytes = fread(sBuff, 1, chunkSz, f )) > 0){
     
         dp_rc = dpsend(dpc, sBuff, bytes);
-        printf("Bytes Read: %d DP SEND BYTES: %d\n", bytes, dp_rc);
         if (dp_rc > 0){
             dpBytesSent += dp_rc;
+            dpprogress_add(&progress, dp_rc);
         } else{
             dp_err++;
         }
         
     }
 
-    printf("Summary: Bytes Sent: %d, Error Count: %d\n", dpBytesSent, dp_err);
-        
+    dpinfo("Summary: Bytes Sent: %d, Error Count: %d\n", dpBytesSent, dp_err);
+    print_rtt(dpc);
+    fclose(f);
+    finish_client(dpc);
+}
+
+/*
+ *  Pipelined versions of start_client() and server_loop().  The disk side
+ *  runs on its own thread and hands buffers to the network side through a
+ *  ring of cfg->pipe_depth of them (see du-pipe.h), so a slow read or
+ *  write overlaps with the network instead of adding to it.
+ */
+typedef struct pipe_job {
+    dp_ring     *ring;
+    FILE        *f;                     //reader side
+    dp_writer   *w;                     //writer side
+    int         chunkSz;
+    int         err;
+} pipe_job;
+
+static void *reader_stage(void *arg){
+    pipe_job *j = arg;
+    char *b;
+
+    while ((b = dpring_claim(j->ring)) != NULL) {
+        int n = fread(b, 1, j->chunkSz, j->f);
+        dpring_commit(j->ring, n);
+        if (n <= 0)
+            break;
+    }
+    return NULL;
+}
+
+static void *writer_stage(void *arg){
+    pipe_job *j = arg;
+    char *b;
+    int len;
+
+    while ((b = dpring_next(j->ring, &len)) != NULL && len > 0) {
+        if (dpwriter_write(j->w, b, len) < 0) {
+            j->err = DP_ERROR_GENERAL;
+            dpring_abort(j->ring);
+            break;
+        }
+        dpring_release(j->ring);
+    }
+    return NULL;
+}
+
+//Which side stalled the other tells where the bottleneck is
+static void print_pipe_stats(dp_ring *r, int depth, bool diskFirst){
+    dp_ring_stats rs;
+
+    dpring_stats(r, &rs);
+    uint64_t diskWaits = diskFirst ? rs.producerWaits : rs.consumerWaits;
+    uint64_t netWaits = diskFirst ? rs.consumerWaits : rs.producerWaits;
+    printf("Pipeline: %d buffers, %llu passed, disk waited on the network %llu times, "
+        "network waited on the disk %llu times\n", depth, (unsigned long long)rs.slotsPassed,
+        (unsigned long long)diskWaits, (unsigned long long)netWaits);
+}
+
+static void start_pipe_client(dp_connp dpc, prog_config *cfg){
+    pipe_job j = {0};
+    pthread_t tid;
+    char *b;
+    int len, dpBytesSent = 0, dp_err = 0;
+
+    j.f = fopen(full_file_path, "rb");
+    if(j.f == NULL){
+        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    j.chunkSz = dpmaxpayload(dpc) > DEF_CHUNK_SZ ? dpmaxpayload(dpc) : DEF_CHUNK_SZ;
+    if (j.chunkSz > XFER_BUFF_SZ)
+        j.chunkSz = XFER_BUFF_SZ;
+    j.ring = dpring_new(cfg->pipe_depth, j.chunkSz);
+    if (j.ring == NULL || pthread_create(&tid, NULL, reader_stage, &j) != 0) {
+        printf("ERROR: Cannot start the reader thread\n");
+        exit(-1);
+    }
+
+    while ((b = dpring_next(j.ring, &len)) != NULL && len > 0) {
+        int dp_rc = dpsend(dpc, b, len);
+        if (dp_rc > 0) {
+            dpBytesSent += dp_rc;
+            dpprogress_add(&progress, dp_rc);
+        } else
+            dp_err++;
+        dpring_release(j.ring);
+    }
+    pthread_join(tid, NULL);
+    if (ferror(j.f)) {
+        perror("pipeline: read failed");
+        dp_err++;
+    }
+    fclose(j.f);
+
+    if (!quiet_mode) {
+        printf("Summary: Bytes Sent: %d, Error Count: %d\n", dpBytesSent, dp_err);
+        print_pipe_stats(j.ring, cfg->pipe_depth, true);
+    }
+    dpring_free(j.ring);
+    print_rtt(dpc);
+    finish_client(dpc);
+}
+
+static void start_pipe_server(dp_connp dpc, prog_config *cfg){
+    dp_stats *stats = dpstats_detach(dpc);
+    pipe_job j = {0};
+    pthread_t tid;
+    char *b;
+    int rcvSz = DP_NO_ERROR;
+
+    j.w = dpwriter_open(full_file_path, 0644, 0, &write_cfg);
+    if(j.w == NULL){
+        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    j.ring = dpring_new(cfg->pipe_depth, XFER_BUFF_SZ);
+    if (j.ring == NULL || pthread_create(&tid, NULL, writer_stage, &j) != 0) {
+        printf("ERROR: Cannot start the writer thread\n");
+        exit(-1);
+    }
+
+    //receive straight into the ring, the writer thread drains it
+    while ((b = dpring_claim(j.ring)) != NULL) {
+        rcvSz = dprecv(dpc, b, XFER_BUFF_SZ);
+        if (rcvSz == 0)
+            continue;
+        dpring_commit(j.ring, rcvSz > 0 ? rcvSz : 0);
+        if (rcvSz < 0)
+            break;
+        dpprogress_add(&progress, rcvSz);
+    }
+    pthread_join(tid, NULL);
+
+    if (rcvSz == DP_CONNECTION_CLOSED && j.err == DP_NO_ERROR) {
+        dp_write_stats ws;
+        dpinfo("Client closed connection\n");
+        if (stats->integrity == DP_INTEGRITY_MISMATCH) {
+            printf("ERROR: %s failed the integrity check, not kept\n", full_file_path);
+            dpwriter_abort(j.w);
+        } else if (dpwriter_commit(j.w, &ws) == DP_NO_ERROR)
+            print_write_stats(&ws);
+        else
+            printf("ERROR: could not finish %s\n", full_file_path);
+    } else {
+        printf("ERROR: pipelined receive failed with %d\n", j.err ? j.err : rcvSz);
+        dpwriter_abort(j.w);
+    }
+    if (!quiet_mode)
+        print_pipe_stats(j.ring, cfg->pipe_depth, false);
+    dpring_free(j.ring);
+    print_run_stats(stats);
+    free(stats);
+}
+
+/*
+ *  Striped versions of the client and server, the file goes over
+ *  cfg->subflows connections at once (see du-stripe.h).
+ */
+static void start_stripe_client(prog_config *cfg){
+    static char sBuff[XFER_BUFF_SZ];
+    static dp_stats stats;
+    struct stat st;
+    int bytes, dpBytesSent = 0;
 
+    dp_stripe *s = dpstripe_client(cfg->svr_ip_addr, cfg->port_number, cfg->subflows);
+    if (s == NULL) {
+        printf("ERROR: Cannot create striped du-proto client\n");
+        exit(-1);
+    }
+    FILE *f = fopen(full_file_path, "rb");
+    if(f == NULL){
+        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    if (fstat(fileno(f), &st) == 0)
+        progress.total = st.st_size;
+    while ((bytes = fread(sBuff, 1, sizeof(sBuff), f)) > 0) {
+        //the subflow threads send for us, so the cap applies here
+        dpflow_acquire(xfer_flow, bytes);
+        int rc = dpstripe_send(s, sBuff, bytes);
+        if (rc < 0) {
+            printf("ERROR: dpstripe_send failed with %d\n", rc);
+            break;
+        }
+        dpBytesSent += rc;
+        dpprogress_add(&progress, rc);
+    }
     fclose(f);
+
+    int rc = dpstripe_close(s, &stats);
+    dpinfo("Summary: Bytes Sent: %d over %d subflows, rc %d\n", 
+        dpBytesSent, cfg->subflows, rc);
+    print_run_stats(&stats);
+}
+
+static void start_stripe_server(prog_config *cfg){
+    static dp_stats stats;
+    dp_write_stats ws;
+    bool writeFailed = false;
+    int rcvSz;
+
+    dp_stripe *s = dpstripe_server(cfg->port_number, cfg->subflows);
+    if (s == NULL) {
+        printf("ERROR: Cannot create striped du-proto server\n");
+        exit(-1);
+    }
+    dp_writer *w = dpwriter_open(full_file_path, 0644, 0, &write_cfg);
+    if (w == NULL)
+        exit(-1);
+    //after a failed write keep draining, so the client still gets to close
+    while ((rcvSz = dpstripe_recv(s, rbuffer, sizeof(rbuffer))) > 0) {
+        if (!writeFailed && dpwriter_write(w, rbuffer, rcvSz) < 0) {
+            printf("ERROR: write to %s failed, the rest is dropped\n", full_file_path);
+            writeFailed = true;
+        }
+        dpflow_acquire(xfer_flow, rcvSz);
+        dpprogress_add(&progress, rcvSz);
+    }
+    dpstripe_close(s, &stats);
+
+    if (rcvSz != DP_CONNECTION_CLOSED) {
+        printf("ERROR: dpstripe_recv failed with %d\n", rcvSz);
+        dpwriter_abort(w);
+    } else if (writeFailed) {
+        dpwriter_abort(w);
+    } else if (stats.integrity == DP_INTEGRITY_MISMATCH) {
+        printf("ERROR: %s failed the integrity check, not kept\n", full_file_path);
+        dpwriter_abort(w);
+    } else {
+        dpinfo("Client closed all %d subflows\n", cfg->subflows);
+        if (dpwriter_commit(w, &ws) == DP_NO_ERROR)
+            print_write_stats(&ws);
+        else
+            printf("ERROR: could not finish %s\n", full_file_path);
+    }
+    print_run_stats(&stats);
+}
+
+/*
+ *  Parallel ranges.  The file is cut into cfg->ranges contiguous pieces and
+ *  each one goes over its own connection and thread, connection i on port
+ *  port_number + i.  A connection starts with an ftp_range_hdr and the
+ *  server pwrite()s what follows at that offset, so the pieces can land in
+ *  any order.
+ */
+typedef struct range_job {
+    prog_config     *cfg;
+    int             idx;
+    int             fd;
+    uint64_t        offset;
+    uint64_t        length;
+    uint64_t        done;
+    dp_stats        *stats;
+    int             rc;
+} range_job;
+
+//Range threads share the one progress line
+static void range_progress(uint64_t bytes){
+    pthread_mutex_lock(&progress_lock);
+    dpprogress_add(&progress, bytes);
+    pthread_mutex_unlock(&progress_lock);
+}
+
+static void *range_client(void *arg){
+    static __thread char sBuff[XFER_BUFF_SZ];
+    range_job *job = arg;
+    ftp_range_hdr hdr = { .offset = job->offset, .length = job->length };
+
+    dp_connp dpc = dpClientInit(job->cfg->svr_ip_addr, job->cfg->port_number + job->idx);
+    if (dpc != NULL)
+        setup_rate(dpc, job->cfg);
+    if (dpc == NULL || dpconnect(dpc) < 0) {
+        printf("ERROR: range %d cannot connect to port %d\n", job->idx,
+            job->cfg->port_number + job->idx);
+        if (dpc != NULL)
+            dpclose(dpc);
+        job->rc = DP_ERROR_GENERAL;
+        return NULL;
+    }
+    job->stats = dpstats_detach(dpc);
+    if ((job->rc = dpsend(dpc, &hdr, sizeof(hdr))) < 0) {
+        dpclose(dpc);
+        return NULL;
+    }
+
+    int chunkSz = dpmaxpayload(dpc) > DEF_CHUNK_SZ ? dpmaxpayload(dpc) : DEF_CHUNK_SZ;
+    while (job->done < job->length) {
+        uint64_t left = job->length - job->done;
+        int n = pread(job->fd, sBuff, left < chunkSz ? left : chunkSz, 
+                    job->offset + job->done);
+        if (n <= 0) {
+            printf("ERROR: range %d read failed at %llu\n", job->idx,
+                (unsigned long long)(job->offset + job->done));
+            job->rc = DP_ERROR_GENERAL;
+            dpclose(dpc);
+            return NULL;
+        }
+        if ((job->rc = dpsend(dpc, sBuff, n)) < 0) {
+            dpclose(dpc);
+            return NULL;
+        }
+        job->done += n;
+        range_progress(n);
+    }
     dpdisconnect(dpc);
+    job->rc = DP_NO_ERROR;
+    return NULL;
+}
+
+static void *range_server(void *arg){
+    static __thread char rBuff[XFER_BUFF_SZ];
+    range_job *job = arg;
+    ftp_range_hdr hdr;
+    int rcvSz;
+
+    dp_connp dpc = dpServerInit(job->cfg->port_number + job->idx);
+    if (dpc != NULL)
+        setup_rate(dpc, job->cfg);
+    if (dpc == NULL || dplisten(dpc) < 0) {
+        if (dpc != NULL)
+            dpclose(dpc);
+        job->rc = DP_ERROR_GENERAL;
+        return NULL;
+    }
+    job->stats = dpstats_detach(dpc);
+    if (dprecv(dpc, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        printf("ERROR: range %d did not start with a range header\n", job->idx);
+        job->rc = DP_ERROR_PROTOCOL;
+        dpclose(dpc);
+        return NULL;
+    }
+    job->offset = hdr.offset;
+    job->length = hdr.length;
+
+    //the connection frees itself when the close is received
+    while ((rcvSz = dprecv(dpc, rBuff, sizeof(rBuff))) >= 0) {
+        if (pwrite(job->fd, rBuff, rcvSz, job->offset + job->done) != rcvSz) {
+            perror("range write failed");
+            job->rc = DP_ERROR_GENERAL;
+            dpclose(dpc);
+            return NULL;
+        }
+        job->done += rcvSz;
+        range_progress(rcvSz);
+    }
+    job->rc = (rcvSz == DP_CONNECTION_CLOSED && job->done == job->length) ? 
+                DP_NO_ERROR : DP_ERROR_PROTOCOL;
+    if (rcvSz != DP_CONNECTION_CLOSED)
+        dpclose(dpc);
+    return NULL;
+}
+
+//Runs one thread per range and reports how it went, true if every range
+//made it and passed the integrity check
+static bool run_ranges(prog_config *cfg, int fd, uint64_t fileSz, bool isClient){
+    static dp_stats stats;
+    range_job jobs[MAX_RANGES] = {0};
+    pthread_t tids[MAX_RANGES];
+    uint64_t per = (fileSz + cfg->ranges - 1) / cfg->ranges;
+    uint64_t total = 0;
+    int failed = 0;
+
+    for (int i = 0; i < cfg->ranges; i++) {
+        jobs[i].cfg = cfg;
+        jobs[i].idx = i;
+        jobs[i].fd = fd;
+        jobs[i].offset = per * i < fileSz ? per * i : fileSz;
+        jobs[i].length = fileSz - jobs[i].offset < per ? fileSz - jobs[i].offset : per;
+        pthread_create(&tids[i], NULL, isClient ? range_client : range_server, &jobs[i]);
+    }
+    for (int i = 0; i < cfg->ranges; i++) {
+        pthread_join(tids[i], NULL);
+        total += jobs[i].done;
+        if (jobs[i].rc != DP_NO_ERROR) {
+            printf("ERROR: range %d failed with %d after %llu of %llu bytes\n", i, 
+                jobs[i].rc, (unsigned long long)jobs[i].done, 
+                (unsigned long long)jobs[i].length);
+            failed++;
+        }
+        if (jobs[i].stats != NULL) {
+            dpstats_merge(&stats, jobs[i].stats);
+            free(jobs[i].stats);
+        }
+    }
+    dpinfo("Summary: %s %llu bytes in %d ranges, %d failed\n", 
+        isClient ? "Sent" : "Received", (unsigned long long)total, cfg->ranges, failed);
+    print_run_stats(&stats);
+    return failed == 0 && stats.integrity != DP_INTEGRITY_MISMATCH;
+}
+
+static void start_range_client(prog_config *cfg){
+    struct stat st;
+
+    int fd = open(full_file_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    progress.total = st.st_size;
+    run_ranges(cfg, fd, st.st_size, true);
+    close(fd);
+}
+
+//Ranges land in any order, so this writes a part file of its own and
+//renames it into place like dp_writer does
+static void start_range_server(prog_config *cfg){
+    char part[FNAME_SZ + sizeof(DP_WRITE_SUFFIX)];
+
+    snprintf(part, sizeof(part), "%s%s", full_file_path, DP_WRITE_SUFFIX);
+    int fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("ERROR:  Cannot open file %s\n", part);
+        exit(-1);
+    }
+    bool ok = run_ranges(cfg, fd, 0, false);
+    if (ok && write_cfg.durability != DP_DURABLE_NONE && fsync(fd) < 0)
+        ok = false;
+    close(fd);
+    if (ok && rename(part, full_file_path) == 0)
+        return;
+    printf("ERROR: %s failed a range or the integrity check, not kept\n", full_file_path);
+    unlink(part);
+}
+
+/*
+ *  Same as start_client() but the file is mmap()ed and dpsend() is pointed
+ *  straight at the mapping, so the data goes from the page cache to the
+ *  socket without the fread() copy or du-proto's datagram copy.  The
+ *  kernel is told we read sequentially and asked to page in the next
+ *  MMAP_AHEAD_SZ ahead of the sender.  Returns false if the file cant be
+ *  mapped (empty, or not a regular file) so the caller can use fread().
+ */
+static bool start_client_mmap(dp_connp dpc){
+    struct stat st;
+    int chunkSz;
+
+    int fd = open(full_file_path, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap failed, falling back to fread()");
+        return false;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    chunkSz = dpmaxpayload(dpc) > DEF_CHUNK_SZ ? dpmaxpayload(dpc) : DEF_CHUNK_SZ;
+
+    off_t off = 0, aheadTo = 0;
+    int dpBytesSent = 0;
+    int dp_err = 0;
+    while (off < st.st_size) {
+        if (off >= aheadTo - MMAP_AHEAD_SZ / 2 && aheadTo < st.st_size) {
+            off_t len = st.st_size - aheadTo < MMAP_AHEAD_SZ ? 
+                        st.st_size - aheadTo : MMAP_AHEAD_SZ;
+            madvise(map + aheadTo, len, MADV_WILLNEED);
+            aheadTo += len;
+        }
+        int bytes = st.st_size - off < chunkSz ? st.st_size - off : chunkSz;
+        int dp_rc = dpsend(dpc, map + off, bytes);
+        if (dp_rc > 0){
+            dpBytesSent += dp_rc;
+            dpprogress_add(&progress, dp_rc);
+        } else{
+            dp_err++;
+        }
+        off += bytes;
+    }
+
+    dpinfo("Summary: Bytes Sent: %d, Error Count: %d\n", dpBytesSent, dp_err);
+    munmap(map, st.st_size);
+    finish_client(dpc);
+    return true;
+}
+
+//Resumable (-r) versions, see du-resume.h
+static void start_resume_client(dp_connp dpc){
+    int rc = dpresume_send(dpc, full_file_path, &progress);
+    if (rc != DP_NO_ERROR)
+        printf("ERROR: resumable send failed with %d\n", rc);
+    finish_client(dpc);
+}
+
+static void start_resume_server(dp_connp dpc){
+    dp_stats *stats = dpstats_detach(dpc);
+    int rc = dpresume_recv(dpc, full_file_path, &progress);
+    if (rc == DP_CONNECTION_CLOSED)
+        dpinfo("Client closed connection\n");
+    else
+        printf("ERROR: resumable receive failed with %d\n", rc);
+    print_run_stats(stats);
+    free(stats);
+}
+
+//Delta (-d) versions, see du-delta.h
+static void start_delta_client(dp_connp dpc){
+    int rc = dpdelta_send(dpc, full_file_path, &progress);
+    if (rc != DP_NO_ERROR)
+        printf("ERROR: delta send failed with %d\n", rc);
+    finish_client(dpc);
+}
+
+static void start_delta_server(dp_connp dpc){
+    dp_stats *stats = dpstats_detach(dpc);
+    int rc = dpdelta_recv(dpc, full_file_path, &progress);
+    if (rc == DP_CONNECTION_CLOSED)
+        dpinfo("Client closed connection\n");
+    else
+        printf("ERROR: delta receive failed with %d\n", rc);
+    print_run_stats(stats);
+    free(stats);
+}
+
+//Compressed (-z) versions, see du-lz.h
+static void start_lz_client(dp_connp dpc){
+    int rc = dplz_send(dpc, full_file_path, &progress);
+    if (rc != DP_NO_ERROR)
+        printf("ERROR: compressed send failed with %d\n", rc);
+    finish_client(dpc);
+}
+
+static void start_lz_server(dp_connp dpc){
+    dp_stats *stats = dpstats_detach(dpc);
+    dp_write_stats ws;
+
+    dp_writer *w = dpwriter_open(full_file_path, 0644, 0, &write_cfg);
+    if (w == NULL)
+        exit(-1);
+    int rc = dplz_recv(dpc, w, &progress);
+    if (rc == DP_CONNECTION_CLOSED && stats->integrity == DP_INTEGRITY_MISMATCH) {
+        printf("ERROR: %s failed the integrity check, not kept\n", full_file_path);
+        dpwriter_abort(w);
+    } else if (rc == DP_CONNECTION_CLOSED) {
+        dpinfo("Client closed connection\n");
+        if (dpwriter_commit(w, &ws) == DP_NO_ERROR)
+            print_write_stats(&ws);
+        else
+            printf("ERROR: could not finish %s\n", full_file_path);
+    } else {
+        printf("ERROR: compressed receive failed with %d\n", rc);
+        dpwriter_abort(w);
+    }
+    print_run_stats(stats);
+    free(stats);
+}
+
+//Sparse (-H) versions, see du-sparse.h
+static void start_sparse_client(dp_connp dpc){
+    int rc = dpsparse_send(dpc, full_file_path, &progress);
+    if (rc != DP_NO_ERROR)
+        printf("ERROR: sparse send failed with %d\n", rc);
+    finish_client(dpc);
+}
+
+static void start_sparse_server(dp_connp dpc){
+    dp_stats *stats = dpstats_detach(dpc);
+    dp_write_stats ws;
+
+    dp_writer *w = dpwriter_open(full_file_path, 0644, 0, &write_cfg);
+    if (w == NULL)
+        exit(-1);
+    int rc = dpsparse_recv(dpc, w, &progress);
+    if (rc == DP_CONNECTION_CLOSED && stats->integrity == DP_INTEGRITY_MISMATCH) {
+        printf("ERROR: %s failed the integrity check, not kept\n", full_file_path);
+        dpwriter_abort(w);
+    } else if (rc == DP_CONNECTION_CLOSED) {
+        dpinfo("Client closed connection\n");
+        if (dpwriter_commit(w, &ws) == DP_NO_ERROR)
+            print_write_stats(&ws);
+        else
+            printf("ERROR: could not finish %s\n", full_file_path);
+    } else {
+        printf("ERROR: sparse receive failed with %d\n", rc);
+        dpwriter_abort(w);
+    }
+    print_run_stats(stats);
+    free(stats);
+}
+
+//Pull (-F) versions, see du-pull.h.  The files are kept only once the
+//close has checked the CRCs of everything that came in.
+/*
+ *  Where a pulled name goes, its path under ./pulled with the "." and
+ *  empty components dropped, so two spellings of one file come out equal.
+ *  False if name could climb out of ./pulled or is too long.
+ */
+static bool pull_dest(const char *name, char *out, int outSz){
+    int len = snprintf(out, outSz, "./pulled");
+
+    if (!dpbatch_path_ok(name, strlen(name) + 1))
+        return false;
+    for (const char *c = name; *c != '\0'; ) {
+        int n = strcspn(c, "/");
+        if (n > 0 && !(n == 1 && c[0] == '.'))
+            len += snprintf(out + len, outSz - len, "/%.*s", n, c);
+        if (len >= outSz)
+            return false;
+        c += n;
+        if (*c == '/')
+            c++;
+    }
+    return strcmp(out, "./pulled") != 0;
+}
+
+/*
+ *  A name that cannot be had, locally or from the server, is reported
+ *  and the rest are still pulled.  Whatever came in full is kept unless
+ *  the close says the session was corrupted; false if anything is missing.
+ */
+static bool start_pull_client(dp_connp dpc, prog_config *cfg, char **more, int moreCount){
+    dp_writer *w[moreCount + 1];
+    char (*path)[FTP_PATH_SZ + 16] = calloc(moreCount + 1, sizeof(*path));
+    int count = 0, failed = 0, rc = DP_NO_ERROR;
+
+    if (path == NULL) {
+        perror("pull");
+        exit(-1);
+    }
+    dp_stats *stats = dpstats_detach(dpc);
+    for (int i = 0; i <= moreCount; i++) {
+        const char *name = i == 0 ? cfg->file_name : more[i - 1];
+        bool dup = false;
+        uint64_t size;
+
+        if (!pull_dest(name, path[count], sizeof(path[count]))) {
+            printf("ERROR: %s is not a relative path the server could serve\n", name);
+            failed++;
+            continue;
+        }
+        for (int j = 0; j < count && !dup; j++)
+            if (strcmp(path[j], path[count]) == 0) {
+                printf("ERROR: %s would land on %s a second time\n", name, path[j]);
+                dup = true;
+            }
+        if (dup) {
+            failed++;
+            continue;
+        }
+        if ((rc = dppull_request(dpc, name, &size)) == DP_ERROR_GENERAL) {
+            failed++;
+            continue;
+        }
+        if (rc < 0)
+            break;
+        dpbatch_make_parents(path[count]);
+        w[count] = dpwriter_open(path[count], 0644, size, &write_cfg);
+        progress.total += size;
+        rc = dppull_recv(dpc, w[count], size, &progress);
+        if (rc == DP_NO_ERROR) {
+            count++;
+            continue;
+        }
+        if (w[count] != NULL)
+            dpwriter_abort(w[count]);
+        if (rc != DP_ERROR_GENERAL)
+            break;
+        printf("ERROR: could not write %s\n", path[count]);
+        failed++;
+    }
+    if (rc < 0 && rc != DP_ERROR_GENERAL) {
+        printf("ERROR: pull failed with %d\n", rc);
+        failed++;
+    }
+    //a server that gave up on a file closes the connection itself
+    if (rc != DP_CONNECTION_CLOSED && dpdisconnect(dpc) == DP_ERROR_INTEGRITY) {
+        printf("ERROR: integrity check failed, no pulled file kept\n");
+        rc = DP_ERROR_INTEGRITY;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+        if (rc == DP_ERROR_INTEGRITY)
+            dpwriter_abort(w[i]);
+        else if (dpwriter_commit(w[i], NULL) < 0) {
+            printf("ERROR: could not finish %s\n", path[i]);
+            failed++;
+        } else
+            kept++;
+    dpinfo("Pulled %d file%s into ./pulled\n", kept, kept == 1 ? "" : "s");
+    print_run_stats(stats);
+    free(stats);
+    free(path);
+    return failed == 0 && rc != DP_ERROR_INTEGRITY;
+}
+
+static void print_cache_stats(void){
+    dp_cache_stats cs;
+
+    dpcache_stats(pull_cache, &cs);
+    dpinfo("Cache: %llu hits, %llu misses, %llu evictions, %llu files in %llu bytes\n",
+        (unsigned long long)cs.hits, (unsigned long long)cs.misses,
+        (unsigned long long)cs.evictions, (unsigned long long)cs.entries,
+        (unsigned long long)cs.bytes);
+}
+
+static void start_pull_server(dp_connp dpc){
+    dp_stats *stats = dpstats_detach(dpc);
+    uint32_t served;
+
+    int rc = dppull_serve(dpc, "./infile", pull_cache, &served);
+    if (rc == DP_CONNECTION_CLOSED)
+        dpinfo("Client closed connection, %u files served\n", served);
+    else
+        printf("ERROR: pull session failed with %d\n", rc);
+    print_cache_stats();
+    print_run_stats(stats);
+    free(stats);
+}
+
+//Batch (-t) versions, see du-batch.h
+static void start_batch_client(dp_connp dpc, prog_config *cfg, char **more, int moreCount){
+    char *names[moreCount + 1];
+
+    names[0] = cfg->file_name;
+    for (int i = 0; i < moreCount; i++)
+        names[i + 1] = more[i];
+    int rc = dpbatch_send(dpc, "./outfile", names, moreCount + 1, &progress);
+    if (rc != DP_NO_ERROR)
+        printf("ERROR: batch send failed with %d\n", rc);
+    finish_client(dpc);
+}
+
+static void start_batch_server(dp_connp dpc){
+    dp_stats *stats = dpstats_detach(dpc);
+    int rc = dpbatch_recv(dpc, "./infile", rbuffer, sizeof(rbuffer), &write_cfg,
+                           &progress);
+    if (rc == DP_CONNECTION_CLOSED)
+        dpinfo("Client closed connection\n");
+    else
+        printf("ERROR: batch receive failed with %d\n", rc);
+    print_run_stats(stats);
+    free(stats);
+}
+
+//Pooled (-W) server, see du-pool.h.  Sessions run at the same time so
+//everything here has to stay off the shared globals.
+static int pool_session(dp_connp dpc, unsigned int id, char *buff, int buffSz, void *arg){
+    prog_config *cfg = arg;
+    char path[FNAME_SZ + 32];
+    int rc;
+
+    //each session is its own transfer, in the class its client asked for
+    int cls = dpc->trafficClass;
+    dp_flow *flow = NULL;
+    if (rate_sched != NULL || cfg->rate_limit > 0) {
+        flow = dpflow_new(rate_sched, cfg->rate_limit, cls);
+        dpflow_attach(dpc, flow);
+    }
+
+    dp_stats *stats = dpstats_detach(dpc);
+    if (cfg->pull) {
+        uint32_t served;
+        rc = dppull_serve(dpc, "./infile", pull_cache, &served);
+        snprintf(path, sizeof(path), "%u files from ./infile", served);
+    } else if (cfg->batch) {
+        snprintf(path, sizeof(path), "./infile/session-%u", id);
+        mkdir(path, 0755);
+        rc = dpbatch_recv(dpc, path, buff, buffSz, &write_cfg, NULL);
+    } else {
+        snprintf(path, sizeof(path), "./infile/%s.%u", cfg->file_name, id);
+        dp_writer *w = dpwriter_open(path, 0644, 0, &write_cfg);
+        if (w == NULL) {
+            rc = DP_ERROR_GENERAL;
+        } else {
+            while ((rc = dprecv(dpc, buff, buffSz)) >= 0)
+                if (dpwriter_write(w, buff, rc) < 0) {
+                    rc = DP_ERROR_GENERAL;
+                    break;
+                }
+            if (rc != DP_CONNECTION_CLOSED || stats->integrity == DP_INTEGRITY_MISMATCH)
+                dpwriter_abort(w);
+            else if (dpwriter_commit(w, NULL) < 0)
+                printf("ERROR: could not finish %s\n", path);
+        }
+    }
+    //dprecv() only frees the connection when the client closes it
+    if (rc != DP_CONNECTION_CLOSED)
+        dpclose(dpc);
+
+    if (rc == DP_CONNECTION_CLOSED && stats->integrity == DP_INTEGRITY_MISMATCH && !cfg->pull)
+        printf("ERROR: session %u failed the integrity check, %s not kept\n", id, path);
+    else if (rc == DP_CONNECTION_CLOSED && cfg->pull)
+        dpinfo("Session %u: %s served, %llu bytes in %llu datagrams, %s\n", id, path,
+            (unsigned long long)stats->bytesOut, (unsigned long long)stats->dgramsOut,
+            cls == DP_CLASS_BACKGROUND ? "background" : "interactive");
+    else if (rc == DP_CONNECTION_CLOSED)
+        dpinfo("Session %u: %s done, %llu bytes in %llu datagrams, %s\n", id, path,
+            (unsigned long long)stats->bytesIn, (unsigned long long)stats->dgramsIn,
+            cls == DP_CLASS_BACKGROUND ? "background" : "interactive");
+    else
+        printf("ERROR: session %u failed with %d\n", id, rc);
+    if (cfg->pull)
+        print_cache_stats();
+    free(stats);
+    dpflow_free(flow);
+    return rc;
+}
+
+static void start_pool_server(prog_config *cfg){
+    dp_pool_cfg pc = {
+        .workers = cfg->workers,
+        .maxSessions = cfg->max_sessions > 0 ? cfg->max_sessions : 4 * cfg->workers,
+        .memLimit = (size_t)cfg->mem_limit_kb * 1024,
+        .buffSz = cfg->batch ? FTP_BATCH_MSG_SZ : XFER_BUFF_SZ,
+        .extraMem = DP_WRITE_BUFF_SZ,
+    };
+
+    dp_connp listener = dpServerInit(cfg->port_number);
+    if (listener == NULL) {
+        printf("ERROR: Cannot create du-proto server\n");
+        exit(-1);
+    }
+    int rc = dppool_serve(listener, &pc, pool_session, cfg);
+    printf("ERROR: server stopped with %d\n", rc);
 }
 
 void start_server(dp_connp dpc){
@@ -159,6 +1266,8 @@ int main(int argc, char *argv[])
     prog_config cfg;
     int cmd;
     dp_connp dpc;
+    dp_pcap *pcap = NULL;
+    bool pullOk = true;
     int rc;
 
 
@@ -166,36 +1275,198 @@ int main(int argc, char *argv[])
     //in the cs472-pproto.c file
     cmd = initParams(argc, argv, &cfg);
 
-    printf("MODE %d\n", cfg.prog_mode);
-    printf("PORT %d\n", cfg.port_number);
-    printf("FILE NAME: %s\n", cfg.file_name);
+    write_cfg.durability = cfg.durability;
+    write_cfg.direct = cfg.direct_io;
+    quiet_mode = cfg.quiet;
+    if (cfg.shared_rate > 0)
+        rate_sched = dpsched_new(cfg.shared_rate);
+    if (cfg.workers == 0 && (rate_sched != NULL || cfg.rate_limit > 0))
+        xfer_flow = dpflow_new(rate_sched, cfg.rate_limit, cfg.traffic_class);
+    summary_path = cfg.json_file[0] != '\0' ? cfg.json_file : NULL;
+    if (quiet_mode)
+        dpsetdebug(0);
+    if (cfg.pull && cmd == PROG_MD_SVR)
+        pull_cache = dpcache_new((size_t)cfg.cache_mb << 20);
+
+    if (!quiet_mode) {
+        printf("MODE %d\n", cfg.prog_mode);
+        printf("PORT %d\n", cfg.port_number);
+        printf("FILE NAME: %s\n", cfg.file_name);
+    }
+    const char *role = cmd == PROG_MD_CLI ? "client" : "server";
+
+    if (cfg.workers > 0) {
+        //each session gets its own UDP socket from the default I/O engine
+        if (cmd != PROG_MD_SVR || cfg.unix_path[0] != '\0' || cfg.pcap_file[0] != '\0' ||
+            cfg.io_engine != IO_ENGINE_SOCKET || cfg.busy_poll_us > 0 || cfg.ranges > 1 ||
+            cfg.subflows > 1 || cfg.resume || cfg.delta || cfg.compress || cfg.sparse ||
+            (cfg.pull && cfg.batch)) {
+            printf("ERROR: -W is server only and takes no -u, -w, -i, -I, -b, -P, -S, -r, -d, -z or -H, nor -t with -F\n");
+            exit(-1);
+        }
+        start_pool_server(&cfg);
+        exit(-1);
+    }
+
+    if (cfg.ranges > 1) {
+        //each range is its own UDP connection on the default I/O engine
+        if (cfg.unix_path[0] != '\0' || cfg.pcap_file[0] != '\0' || 
+            cfg.io_engine != IO_ENGINE_SOCKET || cfg.busy_poll_us > 0 ||
+            cfg.subflows > 1 || cfg.resume || cfg.delta || cfg.compress || cfg.batch ||
+            cfg.sparse || cfg.pull) {
+            printf("ERROR: -P cannot be combined with -u, -w, -i, -I, -b, -S, -r, -d, -z, -t, -H or -F\n");
+            exit(-1);
+        }
+        dpprogress_start(&progress, role, cfg.file_name, 0, NULL, cfg.quiet);
+        if (cmd == PROG_MD_CLI) {
+            snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
+            start_range_client(&cfg);
+        } else {
+            snprintf(full_file_path, sizeof(full_file_path), "./infile/%s", cfg.file_name);
+            start_range_server(&cfg);
+        }
+        exit(0);
+    }
+
+    if (cfg.subflows > 1) {
+        //each subflow is its own UDP socket on the default I/O engine
+        if (cfg.unix_path[0] != '\0' || cfg.pcap_file[0] != '\0' || 
+            cfg.io_engine != IO_ENGINE_SOCKET || cfg.busy_poll_us > 0 || 
+            cfg.resume || cfg.delta || cfg.compress || cfg.batch || cfg.sparse || cfg.pull) {
+            printf("ERROR: -S cannot be combined with -u, -w, -i, -I, -b, -r, -d, -z, -t, -H or -F\n");
+            exit(-1);
+        }
+        dpprogress_start(&progress, role, cfg.file_name, 0, NULL, cfg.quiet);
+        if (cmd == PROG_MD_CLI) {
+            snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
+            start_stripe_client(&cfg);
+        } else {
+            snprintf(full_file_path, sizeof(full_file_path), "./infile/%s", cfg.file_name);
+            start_stripe_server(&cfg);
+        }
+        exit(0);
+    }
+
+    if (cfg.resume && cfg.use_mmap) {
+        printf("ERROR: -r cannot be combined with -m\n");
+        exit(-1);
+    }
+    if (cfg.delta && (cfg.resume || cfg.use_mmap)) {
+        printf("ERROR: -d cannot be combined with -r or -m\n");
+        exit(-1);
+    }
+    if (cfg.compress && (cfg.resume || cfg.delta || cfg.use_mmap)) {
+        printf("ERROR: -z cannot be combined with -r, -d or -m\n");
+        exit(-1);
+    }
+    if (cfg.batch && (cfg.resume || cfg.delta || cfg.use_mmap || cfg.compress)) {
+        printf("ERROR: -t cannot be combined with -r, -d, -m or -z\n");
+        exit(-1);
+    }
+    if (cfg.sparse && (cfg.resume || cfg.delta || cfg.use_mmap || cfg.compress || cfg.batch)) {
+        printf("ERROR: -H cannot be combined with -r, -d, -m, -z or -t\n");
+        exit(-1);
+    }
+    if (cfg.pull && (cfg.resume || cfg.delta || cfg.use_mmap || cfg.compress || cfg.batch ||
+                     cfg.sparse)) {
+        printf("ERROR: -F cannot be combined with -r, -d, -m, -z, -t or -H\n");
+        exit(-1);
+    }
+
+    if (cfg.pcap_file[0] != '\0') {
+        pcap = dppcap_open(cfg.pcap_file);
+        if (pcap == NULL)
+            exit(-1);
+    }
 
     switch(cmd){
         case PROG_MD_CLI:
             //by default client will look for files in the ./outfile directory
             snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
-            dpc = dpClientInit(cfg.svr_ip_addr,cfg.port_number);
+            if (cfg.unix_path[0] != '\0')
+                dpc = dpClientInitUnix(cfg.unix_path);
+            else
+                dpc = dpClientInit(cfg.svr_ip_addr,cfg.port_number);
+            if (dpc == NULL) {
+                printf("ERROR: Cannot create du-proto client\n");
+                exit(-1);
+            }
+            setup_io_engine(dpc, &cfg);
+            setup_busy_poll(dpc, &cfg);
+            setup_rate(dpc, &cfg);
+            if (pcap != NULL)
+                dppcap_attach(dpc, pcap);
             rc = dpconnect(dpc);
             if (rc < 0) {
                 perror("Error establishing connection");
                 exit(-1);
             }
+            struct stat st;
+            dpprogress_start(&progress, role, cfg.file_name, !cfg.batch && !cfg.pull &&
+                stat(full_file_path, &st) == 0 ? st.st_size : 0, dpc, cfg.quiet);
 
-            start_client(dpc);
-            exit(0);
+            if (cfg.pull)
+                pullOk = start_pull_client(dpc, &cfg, argv + optind, argc - optind);
+            else if (cfg.batch)
+                start_batch_client(dpc, &cfg, argv + optind, argc - optind);
+            else if (cfg.compress)
+                start_lz_client(dpc);
+            else if (cfg.sparse)
+                start_sparse_client(dpc);
+            else if (cfg.delta)
+                start_delta_client(dpc);
+            else if (cfg.resume)
+                start_resume_client(dpc);
+            else if (!cfg.use_mmap || !start_client_mmap(dpc)) {
+                if (cfg.pipe_depth > 1)
+                    start_pipe_client(dpc, &cfg);
+                else
+                    start_client(dpc);
+            }
+            dppcap_close(pcap);
+            exit(pullOk ? 0 : -1);
             break;
 
         case PROG_MD_SVR:
             //by default server will look for files in the ./infile directory
             snprintf(full_file_path, sizeof(full_file_path), "./infile/%s", cfg.file_name);
-            dpc = dpServerInit(cfg.port_number);
+            if (cfg.unix_path[0] != '\0')
+                dpc = dpServerInitUnix(cfg.unix_path);
+            else
+                dpc = dpServerInit(cfg.port_number);
+            if (dpc == NULL) {
+                printf("ERROR: Cannot create du-proto server\n");
+                exit(-1);
+            }
+            setup_io_engine(dpc, &cfg);
+            setup_busy_poll(dpc, &cfg);
+            setup_rate(dpc, &cfg);
+            if (pcap != NULL)
+                dppcap_attach(dpc, pcap);
             rc = dplisten(dpc);
             if (rc < 0) {
                 perror("Error establishing connection");
                 exit(-1);
             }
+            dpprogress_start(&progress, role, cfg.file_name, 0, dpc, cfg.quiet);
 
-            start_server(dpc);
+            if (cfg.pull)
+                start_pull_server(dpc);
+            else if (cfg.batch)
+                start_batch_server(dpc);
+            else if (cfg.compress)
+                start_lz_server(dpc);
+            else if (cfg.sparse)
+                start_sparse_server(dpc);
+            else if (cfg.delta)
+                start_delta_server(dpc);
+            else if (cfg.resume)
+                start_resume_server(dpc);
+            else if (cfg.pipe_depth > 1)
+                start_pipe_server(dpc, &cfg);
+            else
+                start_server(dpc);
+            dppcap_close(pcap);
             break;
         default:
             printf("ERROR: Unknown Program Mode.  Mode set is %d\n", cmd);
@@ -1,19 +1,65 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #define PROG_MD_CLI     0
 #define PROG_MD_SVR     1
 #define DEF_PORT_NO     2080
 #define FNAME_SZ        150
 #define PROG_DEF_FNAME  "test.c"
 #define PROG_DEF_SVR_ADDR   "127.0.0.1"
+#define UNIX_PATH_SZ    108
+#define DEF_CHUNK_SZ    5000            //bytes the client reads per dpsend()
+#define XFER_BUFF_SZ    (64 * 1024)     //must hold the largest chunk
+#define DEF_PIPE_DEPTH  3               //triple buffer the disk and network stages
+#define MMAP_AHEAD_SZ   (4 * 1024 * 1024)   //readahead window for -m
+#define DEF_CACHE_MB    64              //server content cache for -F
+
+#define IO_ENGINE_SOCKET    0
+#define IO_ENGINE_URING     1
+#define IO_ENGINE_SQPOLL    2
 
 typedef struct prog_config{
     int     prog_mode;
     int     port_number;
     char    svr_ip_addr[16];
     char    file_name[128];
+    char    unix_path[UNIX_PATH_SZ];    //empty means use UDP
+    int     io_engine;                  //IO_ENGINE_xxx
+    char    pcap_file[FNAME_SZ];        //empty means no capture
+    int     busy_poll_us;               //0 means block in recvfrom()
+    int     subflows;                   //>1 stripes over ports port..port+n-1
+    int     ranges;                     //>1 sends file ranges in parallel
+    bool    use_mmap;                   //client sends straight from the page cache
+    bool    resume;                     //chunked transfer that can be resumed
+    bool    delta;                      //send only what changed vs the server copy
+    bool    compress;                   //negotiate LZ compression of the stream
+    bool    batch;                      //multi-file session, see File_Transfer_PDU
+    bool    sparse;                     //send data extents only, keep the holes
+    bool    pull;                       //client fetches files from the server
+    int     cache_mb;                   //server content cache for pulls, 0 = none
+    int     workers;                    //>0 runs a long lived server with this many threads
+    int     max_sessions;               //running plus queued, 0 = 4 per worker
+    int     mem_limit_kb;               //session memory the server may use, 0 = no limit
+    int     pipe_depth;                 //buffers between disk and network, 1 = no pipeline
+    int     durability;                 //DP_DURABLE_xxx for received files
+    bool    direct_io;                  //receiver writes with O_DIRECT
+    bool    quiet;                      //errors only, no progress, status, stats or PDU dumps
+    char    json_file[FNAME_SZ];        //empty means no JSON summary, "-" is stdout
+    uint64_t rate_limit;                //bytes/s for each transfer, 0 = no cap
+    uint64_t shared_rate;               //bytes/s for all transfers together, 0 = no cap
+    int     traffic_class;              //DP_CLASS_xxx of our transfers
 } prog_config;
 
+#define MAX_RANGES      16
+
+//First message on each connection of a parallel (-P) transfer
+typedef struct ftp_range_hdr {
+    uint64_t    offset;                 //where the range starts in the file
+    uint64_t    length;                 //bytes that follow on this connection
+} ftp_range_hdr;
+
 typedef struct dp_pdu_ext {
     int     proto_ver;
     int     mtype;
@@ -22,13 +68,57 @@ typedef struct dp_pdu_ext {
     int     err_num;
 } dp_pdu_ext;
 
+/*
+ *  Batch (-t) sessions, many files and directories over one connection.
+ *  Every message is a File_Transfer_PDU, payload depending on fat:
+ *
+ *      MANIFEST        ftp_manifest, first message of the session
+ *      FILE_CREATE     ftp_file_create + relative path, starts a file or
+ *                      creates a directory
+ *      DATA            file bytes for the file just created
+ *      FILE_CLOSE      ftp_file_close, ends the current file
+ *      SESSION_END     no payload, the server answers with an
+ *                      ftp_session_result and the client disconnects
+ *
+ *  Payload structs follow the 4 byte fat unaligned, so copy them out.
+ */
 typedef enum {
    FILE_CREATE,
    DATA,
-   FILE_CLOSE
+   FILE_CLOSE,
+   MANIFEST,
+   SESSION_END
 } FILE_MSG_TYPE;
 
 typedef struct File_Transfer_PDU{
     FILE_MSG_TYPE fat;
     char payload[];
-} File_Transfer_PDU;
\ No newline at end of file
+} File_Transfer_PDU;
+
+#define FTP_PATH_SZ     1024            //longest relative path in a batch
+#define FTP_ENTRY_DIR   1               //ftp_file_create.flags
+
+typedef struct ftp_manifest {
+    uint32_t    files;
+    uint32_t    dirs;
+    uint64_t    total_bytes;
+} ftp_manifest;
+
+typedef struct ftp_file_create {
+    uint64_t    size;
+    uint32_t    mode;                   //permission bits
+    uint32_t    flags;                  //FTP_ENTRY_xxx
+    char        path[];                 //NUL terminated, relative
+} ftp_file_create;
+
+typedef struct ftp_file_close {
+    uint64_t    size;                   //bytes the client sent
+} ftp_file_close;
+
+typedef struct ftp_session_result {
+    uint32_t    files;                  //files written completely
+    uint32_t    dirs;
+    uint32_t    errors;                 //entries the server had to drop
+    uint32_t    pad;
+    uint64_t    bytes;
+} ftp_session_result;
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include <stdio.h> 
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "du-loop.h"
+
+typedef struct loop_dgram {
+    struct loop_dgram   *next;
+    uint64_t            deliverAt;      //virtual arrival time
+    int                 len;
+    char                data[];
+} loop_dgram;
+
+//One direction of the link, owned by the receiving end
+typedef struct loop_queue {
+    loop_dgram          *head;
+    loop_dgram          *tail;
+    uint64_t            linkFreeAt;     //when the sender finishes serializing
+} loop_queue;
+
+//State shared by both ends of a pair
+typedef struct loop_link {
+    pthread_mutex_t     lock;
+    pthread_cond_t      ready;
+    dp_loop_cfg         cfg;
+    loop_queue          q[2];
+    int                 refs;
+} loop_link;
+
+//Each end keeps its own time, so when one thread runs ahead of the other
+//(pipelined RPCs) what it stamps on a datagram does not depend on where
+//the peer thread happens to be
+typedef struct loop_end {
+    loop_link           *link;
+    int                 side;           //0 = client, 1 = server
+    dp_clock            clock;
+} loop_end;
+
+static int  loopsend(dp_connp dp, void *sbuff, int sbuff_sz);
+static int  looprecv(dp_connp dp, void *buff, int buff_sz);
+static void loopclose(dp_connp dp);
+static int  loopwait(dp_connp dp, int timeoutMs);
+
+static const dp_transport _loopTransport = {
+    .name  = "loopback",
+    .send  = loopsend,
+    .recv  = looprecv,
+    .close = loopclose,
+    .wait  = loopwait,
+};
+
+static dp_connp loopinitend(loop_link *link, int side){
+    dp_connp dpc = dpinit(AF_UNSPEC, link->cfg.maxBuffSz);
+    if (dpc == NULL)
+        return NULL;
+
+    loop_end *end = malloc(sizeof(loop_end));
+    if (end == NULL) {
+        dpclose(dpc);
+        return NULL;
+    }
+    end->link = link;
+    end->side = side;
+    end->clock.nowNs = 0;
+
+    dpc->xport = &_loopTransport;
+    dpc->xportCtx = end;
+    dpc->clock = &end->clock;
+    dpc->isServer = (side == 1);
+    //there are no addresses, the link itself is the "socket"
+    dpc->inSockAddr.isAddrInit = true;
+    dpc->outSockAddr.isAddrInit = true;
+    return dpc;
+}
+
+int dpLoopbackPair(dp_loop_cfg *cfg, dp_connp *client, dp_connp *server){
+    loop_link *link = calloc(1, sizeof(loop_link));
+    if (link == NULL)
+        return DP_ERROR_GENERAL;
+
+    if (cfg != NULL)
+        link->cfg = *cfg;
+    else {
+        link->cfg.latencyNs = DP_LOOP_DEF_LATENCY_NS;
+        link->cfg.bytesPerSec = DP_LOOP_DEF_BYTES_PER_SEC;
+    }
+    if (link->cfg.maxBuffSz <= 0)
+        link->cfg.maxBuffSz = DP_MAX_BUFF_SZ;
+
+    pthread_mutex_init(&link->lock, NULL);
+    pthread_cond_init(&link->ready, NULL);
+    link->refs = 2;
+
+    *client = loopinitend(link, 0);
+    *server = loopinitend(link, 1);
+    if (*client == NULL || *server == NULL) {
+        perror("loopback pair create failure");
+        return DP_ERROR_GENERAL;
+    }
+    return DP_NO_ERROR;
+}
+
+static int loopsend(dp_connp dp, void *sbuff, int sbuff_sz){
+    loop_end *end = dp->xportCtx;
+    loop_link *link = end->link;
+    loop_queue *q = &link->q[1 - end->side];
+
+    loop_dgram *dg = malloc(sizeof(loop_dgram) + sbuff_sz);
+    if (dg == NULL)
+        return -1;
+    dg->next = NULL;
+    dg->len = sbuff_sz;
+    memcpy(dg->data, sbuff, sbuff_sz);
+
+    pthread_mutex_lock(&link->lock);
+    //the datagram leaves once the link is free and it has been clocked out,
+    //then it is in flight for the propagation delay
+    uint64_t now = end->clock.nowNs;
+    uint64_t start = q->linkFreeAt > now ? q->linkFreeAt : now;
+    if (link->cfg.bytesPerSec > 0)
+        start += (uint64_t)sbuff_sz * 1000000000ull / link->cfg.bytesPerSec;
+    q->linkFreeAt = start;
+    dg->deliverAt = start + link->cfg.latencyNs;
+
+    if (q->tail == NULL)
+        q->head = dg;
+    else
+        q->tail->next = dg;
+    q->tail = dg;
+    pthread_cond_broadcast(&link->ready);
+    pthread_mutex_unlock(&link->lock);
+
+    return sbuff_sz;
+}
+
+static int looprecv(dp_connp dp, void *buff, int buff_sz){
+    loop_end *end = dp->xportCtx;
+    loop_link *link = end->link;
+    loop_queue *q = &link->q[end->side];
+    loop_dgram *dg;
+    int len;
+
+    pthread_mutex_lock(&link->lock);
+    while (q->head == NULL)
+        pthread_cond_wait(&link->ready, &link->lock);
+
+    dg = q->head;
+    q->head = dg->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+
+    //waiting for the datagram is free, time just jumps to its arrival
+    if (dg->deliverAt > end->clock.nowNs)
+        __atomic_store_n(&end->clock.nowNs, dg->deliverAt, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&link->lock);
+
+    //like a datagram socket, anything that does not fit is dropped
+    len = dg->len < buff_sz ? dg->len : buff_sz;
+    memcpy(buff, dg->data, len);
+    free(dg);
+    return len;
+}
+
+/*
+ *  Timeouts are in virtual time: a datagram that would arrive after the
+ *  deadline does not count, and the clock moves to the deadline instead.
+ *  If nothing is queued at all we give the peer thread the same amount of
+ *  real time to produce something before calling it a timeout.
+ */
+static int loopwait(dp_connp dp, int timeoutMs){
+    loop_end *end = dp->xportCtx;
+    loop_link *link = end->link;
+    loop_queue *q = &link->q[end->side];
+    struct timespec abs;
+    int ready;
+
+    clock_gettime(CLOCK_REALTIME, &abs);
+    abs.tv_sec += timeoutMs / 1000;
+    abs.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+    if (abs.tv_nsec >= 1000000000) {
+        abs.tv_sec++;
+        abs.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&link->lock);
+    uint64_t deadline = end->clock.nowNs + (uint64_t)timeoutMs * 1000000;
+    while (q->head == NULL) {
+        if (pthread_cond_timedwait(&link->ready, &link->lock, &abs) == ETIMEDOUT)
+            break;
+    }
+    if (q->head != NULL && q->head->deliverAt <= deadline) {
+        ready = 1;
+    } else {
+        if (deadline > end->clock.nowNs)
+            __atomic_store_n(&end->clock.nowNs, deadline, __ATOMIC_RELEASE);
+        ready = 0;
+    }
+    pthread_mutex_unlock(&link->lock);
+    return ready;
+}
+
+static void loopfreequeue(loop_queue *q){
+    loop_dgram *dg;
+
+    while ((dg = q->head) != NULL) {
+        q->head = dg->next;
+        free(dg);
+    }
+    q->tail = NULL;
+}
+
+static void loopclose(dp_connp dp){
+    loop_end *end = dp->xportCtx;
+    loop_link *link = end->link;
+    int side = end->side;
+    int refs;
+
+    pthread_mutex_lock(&link->lock);
+    loopfreequeue(&link->q[side]);
+    refs = --link->refs;
+    pthread_mutex_unlock(&link->lock);
+
+    free(end);
+    if (refs == 0) {
+        //anything sent after the peer closed is still queued on its side
+        loopfreequeue(&link->q[1 - side]);
+        pthread_cond_destroy(&link->ready);
+        pthread_mutex_destroy(&link->lock);
+        free(link);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "du-proto.h"
+
+/*
+ *  In memory loopback transport for du-proto.  A loopback pair is two
+ *  connected dp connections that hand datagrams to each other through a
+ *  queue instead of the kernel, each end on its own virtual clock.  Each
+ *  datagram is stamped with the virtual time it would arrive given the
+ *  sender's clock, the link latency and bandwidth, and the receiver jumps
+ *  its clock forward to that time if it is behind, so a simulated transfer
+ *  runs as fast as the CPU allows and always produces the same timings,
+ *  however the two threads get scheduled.
+ *
+ *  The protocol is still blocking, so each end of the pair needs to run on
+ *  its own thread (see du-sim.c).
+ */
+typedef struct dp_loop_cfg {
+    uint64_t    latencyNs;          //one way propagation delay
+    uint64_t    bytesPerSec;        //link rate, 0 means infinite
+    int         maxBuffSz;          //payload per datagram, 0 = DP_MAX_BUFF_SZ
+} dp_loop_cfg;
+
+#define DP_LOOP_DEF_LATENCY_NS      (50 * 1000)             //50us
+#define DP_LOOP_DEF_BYTES_PER_SEC   (1000ull * 1000 * 1000 / 8)   //1Gbps
+
+int  dpLoopbackPair(dp_loop_cfg *cfg, dp_connp *client, dp_connp *server);
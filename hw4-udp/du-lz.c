@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "du-lz.h"
+#include "du-pipe.h"
+
+/*
+ *  Codec.  A compressed block is a run of sequences, each
+ *
+ *      token       high nibble literal count, low nibble match length - 4,
+ *                  15 in either means more length bytes follow (255 = more)
+ *      literals
+ *      offset      2 bytes little endian, back from the current output
+ *      match len   extra bytes if the low nibble was 15
+ *
+ *  The last sequence is literals only and ends at the end of the input.
+ */
+#define LZ_HASH_BITS        12
+#define LZ_MIN_MATCH        4
+#define LZ_MAX_OFFSET       0xffff
+#define LZ_LAST_LITERALS    5           //tail always sent as literals
+#define LZ_SKIP_SHIFT       6           //misses before the scan speeds up
+
+static uint32_t lz_hash(const unsigned char *p){
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *lz_putlen(unsigned char *op, int len){
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+//false if the sequence does not fit in the output
+static bool lz_emit(unsigned char **opp, unsigned char *oend, const unsigned char *lit,
+                    int litLen, int offset, int matchLen){
+    unsigned char *op = *opp;
+    int ml = matchLen > 0 ? matchLen - LZ_MIN_MATCH : 0;
+
+    if (oend - op < 1 + litLen / 255 + 1 + litLen + 2 + ml / 255 + 1)
+        return false;
+    *op++ = ((litLen < 15 ? litLen : 15) << 4) | (ml < 15 ? ml : 15);
+    if (litLen >= 15)
+        op = lz_putlen(op, litLen - 15);
+    memcpy(op, lit, litLen);
+    op += litLen;
+    if (matchLen > 0) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (ml >= 15)
+            op = lz_putlen(op, ml - 15);
+    }
+    *opp = op;
+    return true;
+}
+
+//Compressed size, 0 if it would not fit in dstCap
+int dplz_compress(const void *src, int srcLen, void *dst, int dstCap){
+    const unsigned char *in = src, *ip = in, *anchor = in, *end = in + srcLen;
+    const unsigned char *mlimit = end - LZ_LAST_LITERALS;
+    unsigned char *op = dst, *oend = op + dstCap;
+    int32_t table[1 << LZ_HASH_BITS];
+    int miss = 0;
+
+    memset(table, 0xff, sizeof(table));
+    while (srcLen > LZ_LAST_LITERALS + LZ_MIN_MATCH && ip + LZ_MIN_MATCH <= mlimit) {
+        uint32_t h = lz_hash(ip);
+        int32_t cand = table[h];
+        table[h] = ip - in;
+        if (cand < 0 || (ip - in) - cand > LZ_MAX_OFFSET ||
+            memcmp(in + cand, ip, LZ_MIN_MATCH) != 0) {
+            //data that does not match gets scanned with a growing stride
+            ip += 1 + (miss++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        miss = 0;
+
+        const unsigned char *ref = in + cand;
+        int len = LZ_MIN_MATCH;
+        while (ip + len < mlimit && ref[len] == ip[len])
+            len++;
+        if (!lz_emit(&op, oend, anchor, ip - anchor, ip - ref, len))
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+    if (!lz_emit(&op, oend, anchor, end - anchor, 0, 0))
+        return 0;
+    return op - (unsigned char *)dst;
+}
+
+static int lz_getlen(const unsigned char **ipp, const unsigned char *iend, int len){
+    const unsigned char *ip = *ipp;
+    unsigned char b;
+
+    do {
+        if (ip >= iend || len > (1 << 24))
+            return -1;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    *ipp = ip;
+    return len;
+}
+
+//Decompressed size, -1 if the input is corrupt or does not fit in dstCap
+int dplz_decompress(const void *src, int srcLen, void *dst, int dstCap){
+    const unsigned char *ip = src, *iend = ip + srcLen;
+    unsigned char *op = dst, *oend = op + dstCap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int len = token >> 4;
+        if (len == 15 && (len = lz_getlen(&ip, iend, len)) < 0)
+            return -1;
+        if (len > iend - ip || len > oend - op)
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char *)dst)
+            return -1;
+        len = token & 15;
+        if (len == 15 && (len = lz_getlen(&ip, iend, len)) < 0)
+            return -1;
+        len += LZ_MIN_MATCH;
+        if (len > oend - op)
+            return -1;
+        //matches can overlap their own output, so byte at a time
+        const unsigned char *ref = op - offset;
+        for (int i = 0; i < len; i++)
+            op[i] = ref[i];
+        op += len;
+    }
+    return op - (unsigned char *)dst;
+}
+
+/*
+ *  Client side pipeline.  The compressor thread reads and compresses the
+ *  file into a small ring of slots (see du-pipe.h), each a ready to send
+ *  message, while the caller's thread sends them.
+ */
+#define LZ_RING_SLOTS       4
+#define LZ_MSG_SZ           (sizeof(dp_lz_block) + DP_LZ_BLOCK_SZ)
+#define LZ_MAX_BACKOFF      64          //most blocks sent stored before trying again
+
+typedef struct lz_job {
+    dp_ring         *ring;
+    int             fd;
+    uint32_t        codec;
+    uint64_t        rawBytes;
+    uint64_t        blocks;
+    uint64_t        compressed;
+    uint64_t        skipped;            //blocks not even tried
+} lz_job;
+
+//Commits a message length per block, 0 at the end of the file, < 0 on error
+static void *lz_compressor(void *arg){
+    static char scratch[DP_LZ_BLOCK_SZ];
+    lz_job *j = arg;
+    int skip = 0, backoff = 1;
+    char *msg;
+
+    while ((msg = dpring_claim(j->ring)) != NULL) {
+        dp_lz_block *blk = (dp_lz_block *)msg;
+        char *data = msg + sizeof(dp_lz_block);
+        int n = read(j->fd, data, DP_LZ_BLOCK_SZ);
+        if (n <= 0) {
+            if (n < 0)
+                perror("compress: read failed");
+            dpring_commit(j->ring, n < 0 ? DP_ERROR_GENERAL : 0);
+            break;
+        }
+
+        int len = sizeof(dp_lz_block) + n;
+        blk->raw_len = n;
+        blk->flags = DP_LZ_STORED;
+        j->rawBytes += n;
+        j->blocks++;
+        if (j->codec == DP_LZ_CODEC_LZ && skip > 0) {
+            skip--;
+            j->skipped++;
+        } else if (j->codec == DP_LZ_CODEC_LZ) {
+            //only worth it if it saves an eighth, else back off
+            int c = dplz_compress(data, n, scratch, n - n / 8);
+            if (c > 0) {
+                memcpy(data, scratch, c);
+                blk->flags = DP_LZ_COMPRESSED;
+                len = sizeof(dp_lz_block) + c;
+                j->compressed++;
+                backoff = 1;
+            } else {
+                skip = backoff;
+                backoff = backoff * 2 < LZ_MAX_BACKOFF ? backoff * 2 : LZ_MAX_BACKOFF;
+            }
+        }
+        dpring_commit(j->ring, len);
+    }
+    return NULL;
+}
+
+/*
+ *  Client side.  Agrees on a codec with the server then streams the file.
+ *  The caller still owns and disconnects dpc.
+ */
+int dplz_send(dp_connp dpc, const char *path, dp_progress *p){
+    lz_job j = {0};
+    dp_lz_hello hello = { .magic = DP_LZ_MAGIC, .codecs = DP_LZ_CODEC_LZ };
+    uint64_t wireBytes = 0;
+    pthread_t tid;
+    char *msg;
+    int len = 0, rc;
+
+    j.fd = open(path, O_RDONLY);
+    if (j.fd < 0) {
+        printf("ERROR:  Cannot open file %s\n", path);
+        return DP_ERROR_GENERAL;
+    }
+    if ((rc = dpsend(dpc, &hello, sizeof(hello))) < 0 ||
+        (rc = dprecv(dpc, &hello, sizeof(hello))) != sizeof(hello) ||
+        hello.magic != DP_LZ_MAGIC) {
+        close(j.fd);
+        return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+    }
+    j.codec = hello.codecs;
+    dpinfo("Compression: server picked %s\n", j.codec == DP_LZ_CODEC_LZ ? "lz" : "none");
+
+    if ((j.ring = dpring_new(LZ_RING_SLOTS, LZ_MSG_SZ)) == NULL ||
+        pthread_create(&tid, NULL, lz_compressor, &j) != 0) {
+        perror("compress: cannot start compressor thread");
+        dpring_free(j.ring);
+        close(j.fd);
+        return DP_ERROR_GENERAL;
+    }
+
+    rc = DP_NO_ERROR;
+    while ((msg = dpring_next(j.ring, &len)) != NULL && len > 0) {
+        if ((rc = dpsend(dpc, msg, len)) < 0)
+            break;
+        wireBytes += len;
+        dpprogress_add(p, ((dp_lz_block *)msg)->raw_len);
+        rc = DP_NO_ERROR;
+        dpring_release(j.ring);
+    }
+    if (msg != NULL && len < 0)
+        rc = len;
+    dpring_abort(j.ring);
+    pthread_join(tid, NULL);
+    dpring_free(j.ring);
+    close(j.fd);
+
+    if (rc == DP_NO_ERROR)
+        dpinfo("Compression: %llu raw bytes as %llu on the wire (%.2fx), "
+            "%llu of %llu blocks compressed, %llu not tried\n",
+            (unsigned long long)j.rawBytes, (unsigned long long)wireBytes,
+            wireBytes > 0 ? (double)j.rawBytes / wireBytes : 1.0,
+            (unsigned long long)j.compressed, (unsigned long long)j.blocks,
+            (unsigned long long)j.skipped);
+    return rc;
+}
+
+/*
+ *  Server side.  Writes through w and runs until the client closes the
+ *  connection, which also frees dpc.  The caller commits w.
+ */
+int dplz_recv(dp_connp dpc, dp_writer *w, dp_progress *p){
+    static char msg[sizeof(dp_lz_block) + DP_LZ_BLOCK_SZ];
+    static char raw[DP_LZ_BLOCK_SZ];
+    dp_lz_hello hello;
+    uint64_t rawBytes = 0, wireBytes = 0;
+    int rc;
+
+    if ((rc = dprecv(dpc, &hello, sizeof(hello))) != sizeof(hello) ||
+        hello.magic != DP_LZ_MAGIC)
+        return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+    uint32_t codec = (hello.codecs & DP_LZ_CODEC_LZ) ? DP_LZ_CODEC_LZ : DP_LZ_CODEC_NONE;
+
+    hello.codecs = codec;
+    if ((rc = dpsend(dpc, &hello, sizeof(hello))) < 0)
+        return rc;
+
+    while ((rc = dprecv(dpc, msg, sizeof(msg))) >= 0) {
+        dp_lz_block *blk = (dp_lz_block *)msg;
+        char *data = msg + sizeof(dp_lz_block);
+        int len = rc - (int)sizeof(dp_lz_block);
+        if (len < 0 || blk->raw_len > DP_LZ_BLOCK_SZ) {
+            rc = DP_ERROR_PROTOCOL;
+            break;
+        }
+        if (blk->flags == DP_LZ_COMPRESSED) {
+            if (codec != DP_LZ_CODEC_LZ ||
+                dplz_decompress(data, len, raw, sizeof(raw)) != blk->raw_len) {
+                printf("ERROR: corrupt compressed block\n");
+                rc = DP_ERROR_PROTOCOL;
+                break;
+            }
+            data = raw;
+        } else if (blk->raw_len != len) {
+            rc = DP_ERROR_PROTOCOL;
+            break;
+        }
+        if (dpwriter_write(w, data, blk->raw_len) < 0) {
+            rc = DP_ERROR_GENERAL;
+            break;
+        }
+        rawBytes += blk->raw_len;
+        wireBytes += rc;
+        dpprogress_add(p, blk->raw_len);
+    }
+    if (rc == DP_CONNECTION_CLOSED)
+        dpinfo("Compression: %llu bytes on the wire became %llu bytes\n",
+            (unsigned long long)wireBytes, (unsigned long long)rawBytes);
+    return rc;
+}
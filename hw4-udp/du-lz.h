@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "du-proto.h"
+#include "du-write.h"
+#include "du-progress.h"
+
+/*
+ *  Compressed transfers for du-ftp.  The codec is a small LZ4 style LZ77
+ *  (greedy matching through a 4 byte hash, 64KB window, byte oriented
+ *  tokens) that is cheap enough to keep up with the link; it is not LZ4
+ *  compatible.
+ *
+ *  The codec is negotiated per transfer: the client offers a mask of
+ *  DP_LZ_CODEC_xxx in a dp_lz_hello, the server answers with the one it
+ *  picked or DP_LZ_CODEC_NONE.  Then the file goes as blocks of up to
+ *  DP_LZ_BLOCK_SZ raw bytes, one du-proto message each, a dp_lz_block
+ *  header in front.  A block that does not shrink by at least 1/8 is sent
+ *  stored, and after that compression is not tried again for a growing
+ *  number of blocks so incompressible data costs next to nothing.  The
+ *  client compresses on its own thread a few blocks ahead of the sender.
+ */
+#define DP_LZ_BLOCK_SZ      (60 * 1024)
+#define DP_LZ_MAGIC         0x5a4c5044      //"DPLZ"
+
+#define DP_LZ_CODEC_NONE    0
+#define DP_LZ_CODEC_LZ      1
+
+typedef struct dp_lz_hello {
+    uint32_t    magic;
+    uint32_t    codecs;                 //offered mask, or the single pick
+} dp_lz_hello;
+
+#define DP_LZ_STORED        0           //payload is the raw bytes
+#define DP_LZ_COMPRESSED    1
+
+typedef struct dp_lz_block {
+    uint32_t    raw_len;
+    uint32_t    flags;                  //DP_LZ_STORED or DP_LZ_COMPRESSED
+} dp_lz_block;
+
+int dplz_compress(const void *src, int srcLen, void *dst, int dstCap);
+int dplz_decompress(const void *src, int srcLen, void *dst, int dstCap);
+
+int dplz_send(dp_connp dpc, const char *path, dp_progress *p);
+int dplz_recv(dp_connp dpc, dp_writer *w, dp_progress *p);
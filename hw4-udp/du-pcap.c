@@ -0,0 +1,228 @@
+#include <stdio.h> 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "du-pcap.h"
+
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+#define PCAP_LINKTYPE_IPV4  228
+#define PCAP_SNAPLEN        65535
+
+//headers of the synthetic packet wrapped around each datagram
+#define IP_HDR_SZ           20
+#define UDP_HDR_SZ          8
+
+typedef struct pcap_file_hdr {
+    uint32_t    magic;
+    uint16_t    verMajor;
+    uint16_t    verMinor;
+    int32_t     thisZone;
+    uint32_t    sigFigs;
+    uint32_t    snapLen;
+    uint32_t    linkType;
+} pcap_file_hdr;
+
+typedef struct pcap_rec_hdr {
+    uint32_t    tsSec;
+    uint32_t    tsNsec;
+    uint32_t    inclLen;
+    uint32_t    origLen;
+} pcap_rec_hdr;
+
+struct dp_pcap {
+    pthread_mutex_t lock;
+    int             fd;
+    char            *buff;
+    int             used;
+    uint16_t        ipId;
+};
+
+static void pcap_resolvelocal(dp_connp dp);
+
+dp_pcap *dppcap_open(const char *path){
+    dp_pcap *pc = calloc(1, sizeof(dp_pcap));
+    if (pc == NULL)
+        return NULL;
+
+    pc->buff = malloc(DP_PCAP_BUFF_SZ);
+    pc->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pc->buff == NULL || pc->fd < 0) {
+        perror("dppcap_open: cannot create capture file");
+        if (pc->fd >= 0)
+            close(pc->fd);
+        free(pc->buff);
+        free(pc);
+        return NULL;
+    }
+    pthread_mutex_init(&pc->lock, NULL);
+
+    pcap_file_hdr fh = {
+        .magic = PCAP_MAGIC_NSEC,
+        .verMajor = 2,
+        .verMinor = 4,
+        .snapLen = PCAP_SNAPLEN,
+        .linkType = PCAP_LINKTYPE_IPV4,
+    };
+    memcpy(pc->buff, &fh, sizeof(fh));
+    pc->used = sizeof(fh);
+    return pc;
+}
+
+void dppcap_attach(dp_connp dp, dp_pcap *pc){
+    dp->pcap = pc;
+    pcap_resolvelocal(dp);
+}
+
+//caller holds the lock
+static int pcap_flushlocked(dp_pcap *pc){
+    char *p = pc->buff;
+    int left = pc->used;
+
+    while (left > 0) {
+        ssize_t n = write(pc->fd, p, left);
+        if (n < 0) {
+            perror("dppcap: write failed");
+            pc->used = 0;
+            return DP_ERROR_GENERAL;
+        }
+        p += n;
+        left -= n;
+    }
+    pc->used = 0;
+    return DP_NO_ERROR;
+}
+
+int dppcap_flush(dp_pcap *pc){
+    pthread_mutex_lock(&pc->lock);
+    int rc = pcap_flushlocked(pc);
+    pthread_mutex_unlock(&pc->lock);
+    return rc;
+}
+
+void dppcap_close(dp_pcap *pc){
+    if (pc == NULL)
+        return;
+    dppcap_flush(pc);
+    close(pc->fd);
+    pthread_mutex_destroy(&pc->lock);
+    free(pc->buff);
+    free(pc);
+}
+
+static uint16_t ip_checksum(uint8_t *hdr, int len){
+    uint32_t sum = 0;
+
+    for (int i = 0; i < len; i += 2)
+        sum += (hdr[i] << 8) | hdr[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/*
+ *  Looks up the local address for the synthetic headers and keeps it in
+ *  dp, so a record does not cost a getsockname().  A client socket only
+ *  gets its port on the first send, until then the port stays 0 and the
+ *  next record asks again.  Non UDP connections get 127.0.0.1 and
+ *  DP_PCAP_SYNTH_PORT (server) or the port after it (client).
+ */
+static void pcap_resolvelocal(dp_connp dp){
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+
+    dp->pcapLocalIp = htonl(INADDR_LOOPBACK);
+    if (dp->family != AF_INET) {
+        dp->pcapLocalPort = htons(dp->isServer ? DP_PCAP_SYNTH_PORT : DP_PCAP_SYNTH_PORT + 1);
+        return;
+    }
+    if (getsockname(dp->udp_sock, (struct sockaddr *)&local, &len) == 0) {
+        if (local.sin_addr.s_addr != INADDR_ANY)
+            dp->pcapLocalIp = local.sin_addr.s_addr;
+        dp->pcapLocalPort = local.sin_port;
+    }
+}
+
+//Both values in network byte order, the peer is whoever dp last talked to
+static void pcap_endpoints(dp_connp dp, uint32_t *localIp, uint16_t *localPort,
+                        uint32_t *peerIp, uint16_t *peerPort){
+    if (dp->pcapLocalPort == 0)
+        pcap_resolvelocal(dp);
+    *localIp = dp->pcapLocalIp;
+    *localPort = dp->pcapLocalPort;
+
+    *peerIp = htonl(INADDR_LOOPBACK);
+    if (dp->family != AF_INET)
+        *peerPort = htons(dp->isServer ? DP_PCAP_SYNTH_PORT + 1 : DP_PCAP_SYNTH_PORT);
+    else if (dp->outSockAddr.isAddrInit) {
+        *peerIp = dp->outSockAddr.addr.sin_addr.s_addr;
+        *peerPort = dp->outSockAddr.addr.sin_port;
+    } else
+        *peerPort = 0;
+}
+
+void dppcap_record(dp_connp dp, int isOutbound, void *dgram, int len){
+    dp_pcap *pc = dp->pcap;
+    uint32_t localIp, peerIp;
+    uint16_t localPort, peerPort;
+    uint64_t ns;
+    struct timespec ts;
+
+    if (pc == NULL || len <= 0)
+        return;
+
+    //simulated connections are stamped with their virtual time
+    if (dp->clock != NULL) {
+        ns = dpnow(dp);
+    } else {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+    pcap_endpoints(dp, &localIp, &localPort, &peerIp, &peerPort);
+
+    int pktLen = IP_HDR_SZ + UDP_HDR_SZ + len;
+    int inclLen = pktLen > PCAP_SNAPLEN ? PCAP_SNAPLEN : pktLen;
+    int recLen = sizeof(pcap_rec_hdr) + inclLen;
+
+    pthread_mutex_lock(&pc->lock);
+    if (pc->used + recLen > DP_PCAP_BUFF_SZ)
+        pcap_flushlocked(pc);
+
+    char *p = pc->buff + pc->used;
+    pcap_rec_hdr rh = {
+        .tsSec = (uint32_t)(ns / 1000000000ull),
+        .tsNsec = (uint32_t)(ns % 1000000000ull),
+        .inclLen = inclLen,
+        .origLen = pktLen,
+    };
+    memcpy(p, &rh, sizeof(rh));
+    p += sizeof(rh);
+
+    uint8_t *ip = (uint8_t *)p;
+    uint16_t totLen = htons(pktLen > 0xffff ? 0xffff : pktLen);
+    uint16_t id = htons(pc->ipId++);
+    memset(ip, 0, IP_HDR_SZ);
+    ip[0] = 0x45;                               //IPv4, 5 word header
+    memcpy(ip + 2, &totLen, 2);
+    memcpy(ip + 4, &id, 2);
+    ip[8] = 64;                                 //TTL
+    ip[9] = 17;                                 //UDP
+    memcpy(ip + 12, isOutbound ? &localIp : &peerIp, 4);
+    memcpy(ip + 16, isOutbound ? &peerIp : &localIp, 4);
+    uint16_t csum = htons(ip_checksum(ip, IP_HDR_SZ));
+    memcpy(ip + 10, &csum, 2);
+
+    uint8_t *udp = ip + IP_HDR_SZ;
+    uint16_t udpLen = htons((UDP_HDR_SZ + len) > 0xffff ? 0xffff : UDP_HDR_SZ + len);
+    memcpy(udp, isOutbound ? &localPort : &peerPort, 2);
+    memcpy(udp + 2, isOutbound ? &peerPort : &localPort, 2);
+    memcpy(udp + 4, &udpLen, 2);
+    memset(udp + 6, 0, 2);                      //no checksum, fine for IPv4
+
+    memcpy(udp + UDP_HDR_SZ, dgram, inclLen - IP_HDR_SZ - UDP_HDR_SZ);
+    pc->used += recLen;
+    pthread_mutex_unlock(&pc->lock);
+}
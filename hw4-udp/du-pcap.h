@@ -0,0 +1,28 @@
+#pragma once
+
+#include "du-proto.h"
+
+/*
+ *  pcap capture of du-proto traffic.  Every datagram a connection sends or
+ *  receives is written as a raw IPv4/UDP packet (LINKTYPE_IPV4) with a
+ *  nanosecond timestamp, so the file opens directly in Wireshark/tshark.
+ *  Unix and loopback connections have no IP addresses, they are shown as
+ *  127.0.0.1 with the server on DP_PCAP_SYNTH_PORT and the client
+ *  on the port after it.  Records are
+ *  collected in a large buffer and written out in DP_PCAP_BUFF_SZ chunks
+ *  so capturing does not add a write per datagram.  du-proto.lua in this
+ *  directory dissects the dp_pdu header.
+ *
+ *  One capture can be attached to several connections (it is locked),
+ *  the app owns it and closes it after the connections are done.
+ */
+#define DP_PCAP_BUFF_SZ     (1024 * 1024)
+#define DP_PCAP_SYNTH_PORT  2080
+
+typedef struct dp_pcap dp_pcap;
+
+dp_pcap *dppcap_open(const char *path);
+void     dppcap_attach(dp_connp dp, dp_pcap *pc);
+void     dppcap_record(dp_connp dp, int isOutbound, void *dgram, int len);
+int      dppcap_flush(dp_pcap *pc);
+void     dppcap_close(dp_pcap *pc);
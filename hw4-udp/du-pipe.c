@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "du-pipe.h"
+
+struct dp_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t  notFull;
+    pthread_cond_t  notEmpty;
+    int             slots;
+    int             slotSz;
+    char            *mem;
+    int             *lens;
+    int             head;               //oldest filled slot
+    int             count;              //filled slots
+    bool            aborted;
+    dp_ring_stats   stats;
+};
+
+dp_ring *dpring_new(int slots, int slotSz){
+    if (slots < 1 || slots > DP_RING_MAX_SLOTS || slotSz <= 0)
+        return NULL;
+    dp_ring *r = calloc(1, sizeof(dp_ring));
+    if (r == NULL)
+        return NULL;
+    r->mem = malloc((size_t)slots * slotSz);
+    r->lens = calloc(slots, sizeof(int));
+    if (r->mem == NULL || r->lens == NULL) {
+        free(r->mem);
+        free(r->lens);
+        free(r);
+        return NULL;
+    }
+    r->slots = slots;
+    r->slotSz = slotSz;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->notFull, NULL);
+    pthread_cond_init(&r->notEmpty, NULL);
+    return r;
+}
+
+void dpring_free(dp_ring *r){
+    if (r == NULL)
+        return;
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->notFull);
+    pthread_cond_destroy(&r->notEmpty);
+    free(r->mem);
+    free(r->lens);
+    free(r);
+}
+
+//Next free slot, slotSz bytes, blocks while the consumer is behind
+char *dpring_claim(dp_ring *r){
+    char *slot = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->count == r->slots && !r->aborted)
+        r->stats.producerWaits++;
+    while (r->count == r->slots && !r->aborted)
+        pthread_cond_wait(&r->notFull, &r->lock);
+    if (!r->aborted)
+        slot = r->mem + (size_t)((r->head + r->count) % r->slots) * r->slotSz;
+    pthread_mutex_unlock(&r->lock);
+    return slot;
+}
+
+void dpring_commit(dp_ring *r, int len){
+    pthread_mutex_lock(&r->lock);
+    r->lens[(r->head + r->count) % r->slots] = len;
+    r->count++;
+    pthread_cond_signal(&r->notEmpty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+//Oldest filled slot and its length, blocks while the producer is behind
+char *dpring_next(dp_ring *r, int *len){
+    char *slot = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->count == 0 && !r->aborted)
+        r->stats.consumerWaits++;
+    while (r->count == 0 && !r->aborted)
+        pthread_cond_wait(&r->notEmpty, &r->lock);
+    if (!r->aborted) {
+        slot = r->mem + (size_t)r->head * r->slotSz;
+        *len = r->lens[r->head];
+    }
+    pthread_mutex_unlock(&r->lock);
+    return slot;
+}
+
+void dpring_release(dp_ring *r){
+    pthread_mutex_lock(&r->lock);
+    r->head = (r->head + 1) % r->slots;
+    r->count--;
+    r->stats.slotsPassed++;
+    pthread_cond_signal(&r->notFull);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void dpring_abort(dp_ring *r){
+    pthread_mutex_lock(&r->lock);
+    r->aborted = true;
+    pthread_cond_broadcast(&r->notFull);
+    pthread_cond_broadcast(&r->notEmpty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void dpring_stats(dp_ring *r, dp_ring_stats *out){
+    pthread_mutex_lock(&r->lock);
+    *out = r->stats;
+    pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ *  Bounded ring of buffers between two pipeline stages, one thread
+ *  producing and one consuming.  The producer claims a free slot, fills
+ *  it and commits it with a length; the consumer takes filled slots in
+ *  order and releases them when done, so nothing is copied between the
+ *  stages.  With 2 slots the stages double buffer, with 3 triple buffer.
+ *
+ *  A commit with a length <= 0 ends the stream, the consumer gets it like
+ *  any other slot.  dpring_abort() wakes both sides for good, claim and
+ *  next return NULL from then on.
+ */
+#define DP_RING_MAX_SLOTS   16
+
+typedef struct dp_ring dp_ring;
+
+typedef struct dp_ring_stats {
+    uint64_t    slotsPassed;
+    uint64_t    producerWaits;          //claims that found every slot full
+    uint64_t    consumerWaits;          //nexts that found every slot empty
+} dp_ring_stats;
+
+dp_ring *dpring_new(int slots, int slotSz);
+void  dpring_free(dp_ring *r);
+char *dpring_claim(dp_ring *r);
+void  dpring_commit(dp_ring *r, int len);
+char *dpring_next(dp_ring *r, int *len);
+void  dpring_release(dp_ring *r);
+void  dpring_abort(dp_ring *r);
+void  dpring_stats(dp_ring *r, dp_ring_stats *out);
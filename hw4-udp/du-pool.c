@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "du-pool.h"
+
+typedef struct pool_session {
+    dp_connp        dpc;
+    char            *buff;
+    unsigned int    id;
+} pool_session;
+
+typedef struct dp_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  queued;
+    pool_session    *queue;             //maxSessions slots
+    int             head;
+    int             qLen;
+    int             sessions;           //running plus queued
+    size_t          memUsed;
+    size_t          sessionCost;
+    dp_pool_cfg     cfg;
+    dp_session_fn   fn;
+    void            *arg;
+    unsigned long   completed;
+} dp_pool;
+
+static void *pool_worker(void *arg){
+    dp_pool *p = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->qLen == 0)
+            pthread_cond_wait(&p->queued, &p->lock);
+        pool_session s = p->queue[p->head];
+        p->head = (p->head + 1) % p->cfg.maxSessions;
+        p->qLen--;
+        pthread_mutex_unlock(&p->lock);
+
+        p->fn(s.dpc, s.id, s.buff, p->cfg.buffSz, p->arg);
+        free(s.buff);
+
+        pthread_mutex_lock(&p->lock);
+        p->sessions--;
+        p->memUsed -= p->sessionCost;
+        p->completed++;
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+//Only returns if the listening socket fails
+int dppool_serve(dp_connp listener, dp_pool_cfg *cfg, dp_session_fn fn, void *arg){
+    static dp_pool p;
+    pthread_t tid;
+    unsigned int nextId = 1;
+    unsigned long refused = 0;
+
+    if (cfg->workers < 1 || cfg->workers > DP_POOL_MAX_WORKERS || cfg->maxSessions < 1)
+        return DP_ERROR_GENERAL;
+    p.cfg = *cfg;
+    p.fn = fn;
+    p.arg = arg;
+    p.sessionCost = sizeof(dp_connection) + sizeof(dp_stats) + sizeof(dp_pdu) +
+                    listener->maxBuffSz + cfg->buffSz + cfg->extraMem;
+    p.queue = calloc(cfg->maxSessions, sizeof(pool_session));
+    if (p.queue == NULL)
+        return DP_ERROR_GENERAL;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.queued, NULL);
+    for (int i = 0; i < cfg->workers; i++) {
+        if (pthread_create(&tid, NULL, pool_worker, &p) != 0) {
+            perror("pool: cannot start worker");
+            return DP_ERROR_GENERAL;
+        }
+        pthread_detach(tid);
+    }
+    dpinfo("Serving up to %d sessions on %d workers, session memory limit %zu bytes\n",
+        cfg->maxSessions, cfg->workers, cfg->memLimit);
+
+    for (;;) {
+        dp_connp dpc;
+
+        //decide once a CONNECT is waiting, so a session that just ended counts
+        if (listener->xport->wait(listener, -1) < 0)
+            return DP_ERROR_GENERAL;
+        pthread_mutex_lock(&p.lock);
+        bool busy = p.sessions >= cfg->maxSessions ||
+                    (cfg->memLimit > 0 && p.memUsed + p.sessionCost > cfg->memLimit);
+        pthread_mutex_unlock(&p.lock);
+
+        int rc = dpaccept(listener, &dpc, busy);
+        if (rc == DP_ERROR_BUSY) {
+            printf("Session refused, server full (%lu refused so far)\n", ++refused);
+            continue;
+        }
+        if (rc < 0)
+            continue;
+        char *buff = malloc(cfg->buffSz);
+        if (buff == NULL) {
+            dpclose(dpc);
+            continue;
+        }
+
+        pthread_mutex_lock(&p.lock);
+        p.queue[(p.head + p.qLen) % cfg->maxSessions] =
+            (pool_session){ .dpc = dpc, .buff = buff, .id = nextId };
+        p.qLen++;
+        p.sessions++;
+        p.memUsed += p.sessionCost;
+        dpinfo("Session %u accepted, %d running or queued, %lu done\n",
+            nextId, p.sessions, p.completed);
+        pthread_cond_signal(&p.queued);
+        pthread_mutex_unlock(&p.lock);
+        nextId++;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "du-proto.h"
+
+/*
+ *  Long running multi-session server.  The caller's thread accepts
+ *  sessions on a listening connection (see dpaccept()) and a fixed pool of
+ *  worker threads serves them, so many clients can be served at once
+ *  without a thread per client.  Sessions that arrive while every worker
+ *  is busy wait in a queue.  A CONNECT that would go over maxSessions
+ *  (running plus queued) or over memLimit is refused right away and the
+ *  client's dpconnect() fails with DP_ERROR_BUSY.
+ *
+ *  The handler owns the session: it runs until the client closes, which
+ *  frees dpc, or dpclose()s it after an error.  buff is the session's own
+ *  buffer of buffSz bytes, counted against memLimit along with the
+ *  connection itself and the extraMem the handler says it allocates.
+ */
+#define DP_POOL_MAX_WORKERS     64
+
+typedef int (*dp_session_fn)(dp_connp dpc, unsigned int sessionId,
+                             char *buff, int buffSz, void *arg);
+
+typedef struct dp_pool_cfg {
+    int         workers;                //threads serving sessions
+    int         maxSessions;            //running plus queued
+    size_t      memLimit;               //bytes of session memory, 0 = no limit
+    int         buffSz;                 //per session buffer for the handler
+    size_t      extraMem;               //what the handler allocates on top
+} dp_pool_cfg;
+
+int dppool_serve(dp_connp listener, dp_pool_cfg *cfg, dp_session_fn fn, void *arg);
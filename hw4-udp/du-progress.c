@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "du-progress.h"
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void dpprogress_start(dp_progress *p, const char *role, const char *name,
+                      uint64_t total, dp_connp dpc, bool quiet){
+    memset(p, 0, sizeof(*p));
+    p->role = role;
+    p->name = name;
+    p->total = total;
+    p->dpc = dpc;
+    p->quiet = quiet;
+    p->tty = isatty(STDERR_FILENO);
+    p->startNs = p->lastNs = now_ns();
+    p->nextNs = p->startNs + DP_PROGRESS_INTERVAL_MS * 1000000ull;
+}
+
+static void show(dp_progress *p, uint64_t now){
+    double secs = (now - p->lastNs) / 1e9;
+    double rate = secs > 0 ? (p->done - p->lastDone) / secs : 0;
+    double avg = (p->done) / ((now - p->startNs) / 1e9);
+    char eta[32] = "", rtt[32] = "";
+
+    if (p->total > p->done && avg > 0) {
+        unsigned left = (unsigned)((p->total - p->done) / avg);
+        snprintf(eta, sizeof(eta), "  ETA %u:%02u", left / 60, left % 60);
+    }
+    if (p->dpc != NULL && p->dpc->srttNs > 0)
+        snprintf(rtt, sizeof(rtt), "  rtt %.0f us", p->dpc->srttNs / 1e3);
+    if (p->total > 0)
+        fprintf(stderr, "%s%s: %.1f / %.1f MB %3.0f%%  %.1f MB/s%s%s%s", p->tty ? "\r" : "",
+            p->name, p->done / 1e6, p->total / 1e6, 100.0 * p->done / p->total,
+            rate / 1e6, eta, rtt, p->tty ? "   " : "\n");
+    else
+        fprintf(stderr, "%s%s: %.1f MB  %.1f MB/s%s%s", p->tty ? "\r" : "", p->name,
+            p->done / 1e6, rate / 1e6, rtt, p->tty ? "   " : "\n");
+    p->shown = true;
+    p->lastNs = now;
+    p->lastDone = p->done;
+}
+
+//p may be NULL, for sessions that keep no progress
+void dpprogress_add(dp_progress *p, uint64_t bytes){
+    if (p == NULL)
+        return;
+    p->done += bytes;
+    if (p->quiet)
+        return;
+    uint64_t now = now_ns();
+    if (now < p->nextNs)
+        return;
+    show(p, now);
+    p->nextNs = now + DP_PROGRESS_INTERVAL_MS * 1000000ull;
+}
+
+//Finishes the line on a terminal, the connection may be gone by now
+void dpprogress_end(dp_progress *p){
+    double secs = (now_ns() - p->startNs) / 1e9;
+
+    if (p->quiet || p->done == 0)
+        return;
+    fprintf(stderr, "%s%s: %.1f MB in %.2f s, %.1f MB/s\n", p->tty && p->shown ? "\r" : "",
+        p->name, p->done / 1e6, secs, secs > 0 ? p->done / 1e6 / secs : 0);
+    p->quiet = true;
+}
+
+//s as a JSON string, quotes included
+static void json_string(FILE *f, const char *s){
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+//path "-" is stdout
+int dpprogress_summary(dp_progress *p, const char *path, dp_stats *st){
+    struct rusage ru = {0};
+    double secs = (now_ns() - p->startNs) / 1e9;
+
+    uint64_t bytes = p->done;
+
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (f == NULL) {
+        printf("ERROR:  Cannot open file %s\n", path);
+        return DP_ERROR_GENERAL;
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(f, "{\"role\": \"%s\", \"file\": ", p->role);
+    json_string(f, p->name);
+    fprintf(f, ", \"wall_s\": %.6f, \"bytes\": %llu, "
+        "\"mb_per_s\": %.3f, \"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, \"du_proto\": ",
+        secs, (unsigned long long)bytes, secs > 0 ? bytes / 1e6 / secs : 0,
+        ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+    dpstats_json(st, f);
+    fprintf(f, "}\n");
+    if (f == stdout)
+        fflush(f);
+    else
+        fclose(f);
+    return DP_NO_ERROR;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "du-proto.h"
+
+/*
+ *  Transfer progress for du-ftp.  dpprogress_add() is called with every
+ *  chunk of file data (not protocol traffic) and only reads the clock, a
+ *  line (bytes, rate over the last interval, ETA when the total is known,
+ *  smoothed RTT) goes to stderr at most every DP_PROGRESS_INTERVAL_MS.  On
+ *  a terminal the line is redrawn in place.  In quiet mode nothing is
+ *  shown, the bytes are still counted for the summary.
+ *
+ *  dpprogress_summary() writes one JSON object with the wall time since
+ *  dpprogress_start(), throughput, CPU time and the du-proto stats, for
+ *  scripts that benchmark transfers.
+ */
+#define DP_PROGRESS_INTERVAL_MS     1000
+
+typedef struct dp_progress {
+    const char      *role;              //"client" or "server"
+    const char      *name;              //file shown in the line
+    uint64_t        total;              //bytes expected, 0 if not known
+    uint64_t        done;
+    uint64_t        startNs;
+    uint64_t        nextNs;             //when the next line is due
+    uint64_t        lastNs;             //rate is over the last interval
+    uint64_t        lastDone;
+    bool            quiet;
+    bool            tty;
+    bool            shown;              //a line is on the screen
+    dp_connp        dpc;                //for the RTT, NULL if none
+} dp_progress;
+
+void dpprogress_start(dp_progress *p, const char *role, const char *name,
+                      uint64_t total, dp_connp dpc, bool quiet);
+void dpprogress_add(dp_progress *p, uint64_t bytes);
+void dpprogress_end(dp_progress *p);
+int  dpprogress_summary(dp_progress *p, const char *path, dp_stats *st);
@@ -1,45 +1,198 @@
 #include <stdio.h> 
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <time.h>
+#include <poll.h>
+#include <errno.h>
 
 #include "du-proto.h"
+#include "du-pcap.h"
+#include "du-crc.h"
+#include "du-rate.h"
 
-static char _dpBuffer[DP_MAX_DGRAM_SZ];
 static int  _debugMode = 1;
 
-static dp_connp dpinit(){
+static int  dpsocksend(dp_connp dp, void *sbuff, int sbuff_sz);
+static int  dpsocksendv(dp_connp dp, struct iovec *iov, int iovcnt);
+static int  dpsockrecv(dp_connp dp, void *buff, int buff_sz);
+static int  dpsockwait(dp_connp dp, int timeoutMs);
+static void dpstreamfree(dp_connp dp);
+static void dprpcfree(dp_connp dp);
+static int  dpbatchadd(dp_connp dp, void *sbuff, int sbuff_sz);
+static int  dpbatchload(dp_connp dp, char *data, int len);
+static int  dpbatchpop(dp_connp dp, void *buff, int buff_sz);
+
+static const dp_transport _sockTransport = {
+    .name  = "socket",
+    .send  = dpsocksend,
+    .recv  = dpsockrecv,
+    .close = dpsockclose,
+    .wait  = dpsockwait,
+    .sendv = dpsocksendv,
+};
+
+/*
+ *  Allocates a connection using the socket transport.  Other transports
+ *  (see du-loop.c) call this and then swap in their own xport.
+ */
+dp_connp dpinit(int family, int maxBuffSz){
     dp_connp dpsession = malloc(sizeof(dp_connection));
+    if (dpsession == NULL)
+        return NULL;
     bzero(dpsession, sizeof(dp_connection));
+    dpsession->dgramBuff = malloc(maxBuffSz + sizeof(dp_pdu));
+    dpsession->stats = calloc(1, sizeof(dp_stats));
+    if (dpsession->dgramBuff == NULL || dpsession->stats == NULL) {
+        free(dpsession->dgramBuff);
+        free(dpsession->stats);
+        free(dpsession);
+        return NULL;
+    }
+    dpsession->statsOwned = true;
+    dpsession->family = family;
+    dpsession->maxBuffSz = maxBuffSz;
+    dpsession->udp_sock = -1;
     dpsession->outSockAddr.isAddrInit = false;
     dpsession->inSockAddr.isAddrInit = false;
-    dpsession->outSockAddr.len = sizeof(struct sockaddr_in);
-    dpsession->inSockAddr.len = sizeof(struct sockaddr_in);
+    dpsession->outSockAddr.len = (family == AF_UNIX) ? 
+            sizeof(struct sockaddr_un) : sizeof(struct sockaddr_in);
+    dpsession->inSockAddr.len = dpsession->outSockAddr.len;
     dpsession->seqNum = 0;
     dpsession->isConnected = false;
     dpsession->dbgMode = true;
+    dpsession->xport = &_sockTransport;
+    dpsession->clock = NULL;
+    dpsession->rtoNs = DP_RTO_INIT_NS;
     return dpsession;
 }
 
 void dpclose(dp_connp dpsession) {
+    dpsession->xport->close(dpsession);
+    if (dpsession->statsOwned)
+        free(dpsession->stats);
+    dpstreamfree(dpsession);
+    dprpcfree(dpsession);
+    free(dpsession->txBatch);
+    free(dpsession->rxBatch);
+    free(dpsession->dgramBuff);
     free(dpsession);
 }
 
+void dpsockclose(dp_connp dp) {
+    if (dp->udp_sock >= 0)
+        close(dp->udp_sock);
+    //the server owns the socket file, clean it up so the path can be reused
+    if (dp->unixPath[0] != '\0')
+        unlink(dp->unixPath);
+}
+
+void dpsetdebug(int on){
+    _debugMode = on ? 1 : 0;
+}
+
+//Status lines of the apps and modules on top of du-proto, they go quiet
+//along with the PDU dumps when debug is off.  Errors use printf().
+void dpinfo(const char *fmt, ...){
+    va_list ap;
+
+    if (_debugMode != 1)
+        return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+uint64_t dpnow(dp_connp dp){
+    struct timespec ts;
+
+    if (dp->clock != NULL)
+        return __atomic_load_n(&dp->clock->nowNs, __ATOMIC_ACQUIRE);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ *  Arrival time of the datagram dprecvraw() just returned, as a dpnow()
+ *  value.  With kernel timestamps this is when the socket got it, not when
+ *  we got scheduled, so round trips measured to it leave out our own
+ *  wakeup latency.
+ */
+static uint64_t dprxtime(dp_connp dp){
+    return dp->rxNs != 0 ? dp->rxNs : dpnow(dp);
+}
+
+//time from startNs to the last arrival, 0 if it was already queued
+static uint64_t dprxsince(dp_connp dp, uint64_t startNs){
+    uint64_t rx = dprxtime(dp);
+    return rx > startNs ? rx - startNs : 0;
+}
+
+static void dprttsample(dp_connp dp, uint64_t rttNs){
+    if (dp->srttNs == 0) {
+        dp->srttNs = rttNs > 0 ? rttNs : 1;
+        dp->rttvarNs = rttNs / 2;
+    } else {
+        uint64_t err = dp->srttNs > rttNs ? dp->srttNs - rttNs : rttNs - dp->srttNs;
+        dp->rttvarNs = (3 * dp->rttvarNs + err) / 4;
+        dp->srttNs = (7 * dp->srttNs + rttNs) / 8;
+    }
+    dp->rtoNs = dp->srttNs + 4 * dp->rttvarNs;
+    if (dp->rtoNs < DP_RTO_MIN_NS)
+        dp->rtoNs = DP_RTO_MIN_NS;
+    if (dp->rtoNs > DP_RTO_MAX_NS)
+        dp->rtoNs = DP_RTO_MAX_NS;
+}
+
+uint64_t dprto(dp_connp dp){
+    return dp->rtoNs;
+}
+
+dp_stats *dpstats(dp_connp dp){
+    return dp->stats;
+}
+
+/*
+ *  The connection is freed as soon as a CLOSE is received, so an app that
+ *  wants the stats afterwards takes ownership of them here.  They keep
+ *  being updated until the connection closes, then the app free()s them.
+ */
+dp_stats *dpstats_detach(dp_connp dp){
+    dp->statsOwned = false;
+    return dp->stats;
+}
+
+//simulate local work (or an idle period) on a virtual clock
+void dpclock_advance(dp_clock *clk, uint64_t ns){
+    __atomic_add_fetch(&clk->nowNs, ns, __ATOMIC_ACQ_REL);
+}
+
 int  dpmaxdgram(){
     return DP_MAX_BUFF_SZ;
 }
 
+int  dpmaxpayload(dp_connp dp){
+    return dp->maxBuffSz;
+}
+
+
+//Ask the kernel to stamp arriving datagrams, user space time if it cant
+static void dpsockstamps(dp_connp dpc){
+    dpc->rxStamps = setsockopt(dpc->udp_sock, SOL_SOCKET, SO_TIMESTAMPNS, 
+                        &(int){1}, sizeof(int)) == 0;
+}
 
 dp_connp dpServerInit(int port) {
     struct sockaddr_in *servaddr;
     int *sock;
     int rc;
 
-    dp_connp dpc = dpinit();
+    dp_connp dpc = dpinit(AF_INET, DP_MAX_BUFF_SZ);
     if (dpc == NULL) {
         perror("drexel protocol create failure"); 
         return NULL;
@@ -54,6 +207,7 @@ dp_connp dpServerInit(int port) {
         perror("socket creation failed"); 
         return NULL;
     } 
+    dpsockstamps(dpc);
 
     // Filling server information 
     servaddr->sin_family    = AF_INET; // IPv4 
@@ -81,6 +235,7 @@ dp_connp dpServerInit(int port) {
 
     dpc->inSockAddr.isAddrInit = true;
     dpc->outSockAddr.len = sizeof(struct sockaddr_in);
+    dpc->isServer = true;
     return dpc;
 }
 
@@ -89,7 +244,7 @@ dp_connp dpClientInit(char *addr, int port) {
     struct sockaddr_in *servaddr;
     int *sock;
 
-    dp_connp dpc = dpinit();
+    dp_connp dpc = dpinit(AF_INET, DP_MAX_BUFF_SZ);
     if (dpc == NULL) {
         perror("drexel protocol create failure"); 
         return NULL;
@@ -103,6 +258,7 @@ dp_connp dpClientInit(char *addr, int port) {
         perror("socket creation failed"); 
         return NULL;
     } 
+    dpsockstamps(dpc);
 
     // Filling server information 
     servaddr->sin_family = AF_INET; 
@@ -117,16 +273,129 @@ dp_connp dpClientInit(char *addr, int port) {
     return dpc;
 }
 
+/*
+ *  Unix domain (AF_UNIX, SOCK_DGRAM) versions of the init functions.  Same
+ *  host peers can use these to skip the IP stack entirely, everything above
+ *  dpsendraw()/dprecvraw() stays the same.  Unix datagrams are not limited
+ *  by the network MTU so the payload size is bumped up to DP_UNIX_MAX_BUFF_SZ.
+ */
+static int dpunixsockinit(dp_connp dpc){
+    int buffSz = DP_UNIX_SOCK_BUFF_SZ;
+
+    if ( (dpc->udp_sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0 ) { 
+        perror("socket creation failed"); 
+        return DP_ERROR_GENERAL;
+    }
+
+    //make sure a few full sized datagrams can be queued in the socket
+    setsockopt(dpc->udp_sock, SOL_SOCKET, SO_SNDBUF, &buffSz, sizeof(buffSz));
+    setsockopt(dpc->udp_sock, SOL_SOCKET, SO_RCVBUF, &buffSz, sizeof(buffSz));
+    dpsockstamps(dpc);
+    return DP_NO_ERROR;
+}
+
+dp_connp dpServerInitUnix(char *path) {
+    struct sockaddr_un *servaddr;
+
+    if (strlen(path) >= sizeof(servaddr->sun_path)) {
+        printf("ERROR: unix socket path too long %s\n", path);
+        return NULL;
+    }
+
+    dp_connp dpc = dpinit(AF_UNIX, DP_UNIX_MAX_BUFF_SZ);
+    if (dpc == NULL) {
+        perror("drexel protocol create failure"); 
+        return NULL;
+    }
+
+    if (dpunixsockinit(dpc) != DP_NO_ERROR) {
+        dpclose(dpc);
+        return NULL;
+    }
+
+    servaddr = &(dpc->inSockAddr.unAddr);
+    servaddr->sun_family = AF_UNIX;
+    strcpy(servaddr->sun_path, path);
+    dpc->inSockAddr.len = sizeof(struct sockaddr_un);
+
+    //a stale socket file from a previous run would make bind fail
+    unlink(path);
+    if (bind(dpc->udp_sock, (const struct sockaddr *)servaddr,  
+            dpc->inSockAddr.len) < 0 ) 
+    { 
+        perror("bind failed"); 
+        dpclose(dpc);
+        return NULL;
+    }
+    strcpy(dpc->unixPath, path);
+
+    dpc->inSockAddr.isAddrInit = true;
+    dpc->outSockAddr.len = sizeof(struct sockaddr_un);
+    dpc->isServer = true;
+    return dpc;
+}
+
+dp_connp dpClientInitUnix(char *path) {
+    struct sockaddr_un *servaddr;
+    struct sockaddr_un cliaddr = {0};
+
+    if (strlen(path) >= sizeof(servaddr->sun_path)) {
+        printf("ERROR: unix socket path too long %s\n", path);
+        return NULL;
+    }
+
+    dp_connp dpc = dpinit(AF_UNIX, DP_UNIX_MAX_BUFF_SZ);
+    if (dpc == NULL) {
+        perror("drexel protocol create failure"); 
+        return NULL;
+    }
+
+    if (dpunixsockinit(dpc) != DP_NO_ERROR) {
+        dpclose(dpc);
+        return NULL;
+    }
+
+    //unlike UDP a unix datagram socket needs a name or the server cant
+    //answer, binding with just the family autobinds an abstract address
+    cliaddr.sun_family = AF_UNIX;
+    if (bind(dpc->udp_sock, (const struct sockaddr *)&cliaddr, 
+            sizeof(sa_family_t)) < 0) {
+        perror("bind failed"); 
+        dpclose(dpc);
+        return NULL;
+    }
+
+    servaddr = &(dpc->outSockAddr.unAddr);
+    servaddr->sun_family = AF_UNIX;
+    strcpy(servaddr->sun_path, path);
+    dpc->outSockAddr.len = sizeof(struct sockaddr_un); 
+    dpc->outSockAddr.isAddrInit = true;
+
+    // The inbound address is the same as the outbound address
+    memcpy(&dpc->inSockAddr, &dpc->outSockAddr, sizeof(dpc->outSockAddr));
+
+    return dpc;
+}
+
 
 int dprecv(dp_connp dp, void *buff, int buff_sz){
 
     int totalBytes = 0;
     char *buffLocation = (char*) buff;
     bool isFragment = true;
+    uint64_t startNs = dpnow(dp);
+    int rc;
+
+    //the peer may be waiting on our batched messages before it answers
+    if ((rc = dpflush(dp)) < 0)
+        return rc;
+    if (dp->rxBatchOff < dp->rxBatchLen)
+        return dpbatchpop(dp, buff, buff_sz);
 
     while (1){
         dp_pdu *inPdu;
-        int rcvLen = dprecvdgram(dp, _dpBuffer, sizeof(_dpBuffer));
+        int rcvLen = dprecvdgram(dp, dp->dgramBuff, 
+                            dp->maxBuffSz + sizeof(dp_pdu));
 
         if (rcvLen == DP_CONNECTION_CLOSED){
             return DP_CONNECTION_CLOSED;
@@ -142,9 +411,24 @@ int dprecv(dp_connp dp, void *buff, int buff_sz){
 
         
 
-        inPdu = (dp_pdu *)_dpBuffer;
+        inPdu = (dp_pdu *)dp->dgramBuff;
+        if (inPdu->mtype & DP_MT_STREAM) {
+            printf("ERROR: stream data received, use dprecvstream()\n");
+            return DP_ERROR_PROTOCOL;
+        }
         int payloadSize = inPdu->dgram_sz;
-        memcpy(buffLocation, (_dpBuffer+sizeof(dp_pdu)), inPdu->dgram_sz);
+        if (inPdu->mtype & DP_MT_BATCH) {
+            if (totalBytes != 0)
+                return DP_ERROR_PROTOCOL;
+            if ((rc = dpbatchload(dp, dp->dgramBuff + sizeof(dp_pdu), 
+                                    payloadSize)) < 0)
+                return rc;
+            return dpbatchpop(dp, buff, buff_sz);
+        }
+        if (totalBytes + payloadSize > buff_sz) {
+            return DP_BUFF_UNDERSIZED;
+        }
+        memcpy(buffLocation, (dp->dgramBuff+sizeof(dp_pdu)), payloadSize);
         buffLocation += payloadSize;
         totalBytes += payloadSize;
 
@@ -155,6 +439,10 @@ int dprecv(dp_connp dp, void *buff, int buff_sz){
         } 
     }
 
+    dphist_record(&dp->stats->recvWait, dprxsince(dp, startNs));
+    dp->stats->msgsIn++;
+    dp->stats->bytesIn += totalBytes;
+    dp->stats->rxCrc = dpcrc32c(dp->stats->rxCrc, buff, totalBytes);
     return totalBytes;
 }
 
@@ -163,7 +451,7 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     int bytesIn = 0;
     int errCode = DP_NO_ERROR;
 
-    if(buff_sz > DP_MAX_DGRAM_SZ)
+    if(buff_sz > dp->maxBuffSz + (int)sizeof(dp_pdu))
         return DP_BUFF_OVERSIZED;
 
     bytesIn = dprecvraw(dp, buff, buff_sz);
@@ -178,11 +466,15 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
         errCode = DP_BUFF_UNDERSIZED;
 
     //Copy buffer back
-    // memcpy(buff, (_dpBuffer+sizeof(dp_pdu)), inPdu.dgram_sz);
+    // memcpy(buff, (dp->dgramBuff+sizeof(dp_pdu)), inPdu.dgram_sz);
     
     
     //UDPATE SEQ NUMBER AND PREPARE ACK
-    printf("ERRCODE: %d\n", errCode);
+    if (_debugMode == 1)
+        printf("ERRCODE: %d\n", errCode);
+    //holding the ACK back is how a capped receiver slows the sender
+    if (errCode == DP_NO_ERROR && (inPdu.mtype & (DP_MT_SND | DP_MT_FRAGMENT)))
+        dpflow_acquire(dp->flow, inPdu.dgram_sz);
     if (errCode == DP_NO_ERROR){
         if(inPdu.dgram_sz == 0)
             //Update Seq Number to just ack a control message - just got PDU
@@ -211,7 +503,8 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     }
 
 
-    switch(inPdu.mtype){
+    //stream and batch datagrams are ACKed just like plain ones
+    switch(inPdu.mtype & ~(DP_MT_STREAM | DP_MT_BATCH)){
         case DP_MT_SND:
             outPdu.mtype = DP_MT_SNDACK;
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
@@ -224,7 +517,24 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
             if (actSndSz != sizeof(dp_pdu))
                 return DP_ERROR_PROTOCOL;
             break;  
+        case DP_MT_RPC | DP_MT_SND:
+        case DP_MT_RPC | DP_MT_ACK:
+            //the RPC response doubles as the ACK for its request
+            break;
         case DP_MT_CLOSE:
+            if (inPdu.dgram_sz == sizeof(dp_close_digest) && 
+                bytesIn >= sizeof(dp_pdu) + sizeof(dp_close_digest)) {
+                dp_close_digest d;
+                memcpy(&d, (char *)buff + sizeof(dp_pdu), sizeof(d));
+                bool ok = d.txCrc == dp->stats->rxCrc && d.rxCrc == dp->stats->txCrc;
+                dp->stats->integrity = ok ? DP_INTEGRITY_OK : DP_INTEGRITY_MISMATCH;
+                if (!ok) {
+                    printf("ERROR: integrity check failed, peer sent %08x we got %08x, "
+                        "we sent %08x peer got %08x\n", d.txCrc, dp->stats->rxCrc,
+                        dp->stats->txCrc, d.rxCrc);
+                    outPdu.err_num = DP_ERROR_INTEGRITY;
+                }
+            }
             outPdu.mtype = DP_MT_CLOSEACK;
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
             if (actSndSz != sizeof(dp_pdu))
@@ -242,6 +552,40 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
 }
 
 
+/*
+ *  Sends one datagram whose first iovec is the dp_pdu in dp->dgramBuff.
+ *  With a sendv transport the payload goes straight from the caller's
+ *  memory (an mmap()ed file in du-ftp) to the kernel.  Otherwise, or when
+ *  capturing, the pieces are copied in behind the header first.
+ */
+static int dpsendrawv(dp_connp dp, struct iovec *iov, int iovcnt){
+    int bytesOut, total = 0;
+
+    if (dp->xport->sendv == NULL || dp->pcap != NULL) {
+        char *p = dp->dgramBuff + iov[0].iov_len;
+        for (int i = 1; i < iovcnt; i++) {
+            if (iov[i].iov_len > 0)
+                memcpy(p, iov[i].iov_base, iov[i].iov_len);
+            p += iov[i].iov_len;
+        }
+        return dpsendraw(dp, dp->dgramBuff, p - dp->dgramBuff);
+    }
+
+    if(!dp->outSockAddr.isAddrInit) {
+        perror("dpsendraw:dp connection not setup properly");
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    bytesOut = dp->xport->sendv(dp, iov, iovcnt);
+    dp->stats->dgramsOut++;
+    if (bytesOut != total)
+        return bytesOut;
+
+    print_out_pdu((dp_pdu *)iov[0].iov_base);
+    return bytesOut;
+}
+
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
     int bytes = 0;
 
@@ -250,15 +594,16 @@ static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
         return -1;
     }
 
-    bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
-                MSG_WAITALL, ( struct sockaddr *) &(dp->outSockAddr.addr), 
-                &(dp->outSockAddr.len)); 
-
+    dp->rxNs = 0;                           //the transport may stamp it
+    bytes = dp->xport->recv(dp, buff, buff_sz);
     if (bytes < 0) {
-        perror("dprecv: received error from recvfrom()");
+        perror("dprecv: received error from transport");
         return -1;
     }
     dp->outSockAddr.isAddrInit = true;
+    dp->stats->dgramsIn++;
+    if (dp->pcap != NULL)
+        dppcap_record(dp, false, buff, bytes);
 
     //some helper code if you want to do debugging
     if (bytes > sizeof(dp_pdu)){
@@ -281,14 +626,27 @@ int dpsend(dp_connp dp, void *sbuff, int sbuff_sz){
 
     int totalSent = 0;
     char *sBuffLocation = (char*)sbuff;
+    uint64_t startNs = dpnow(dp);
+    int rc;
+
+    if (sbuff_sz > 0)
+        dp->stats->txCrc = dpcrc32c(dp->stats->txCrc, sbuff, sbuff_sz);
+
+    if (dp->coalesceNs > 0) {
+        if (sbuff_sz + DP_BATCH_LEN_SZ <= dp->maxBuffSz / 2)
+            return dpbatchadd(dp, sbuff, sbuff_sz);
+        //big messages go out as usual, but after anything already batched
+        if ((rc = dpflush(dp)) < 0)
+            return rc;
+    }
 
     while (totalSent < sbuff_sz){
         int remainingBytes = sbuff_sz - totalSent;
         int chunk;
         bool isFragment;
 
-        if (remainingBytes > DP_MAX_BUFF_SZ){
-            chunk = DP_MAX_BUFF_SZ;
+        if (remainingBytes > dp->maxBuffSz){
+            chunk = dp->maxBuffSz;
             isFragment = true;
         } else{
             chunk = remainingBytes;
@@ -305,32 +663,54 @@ int dpsend(dp_connp dp, void *sbuff, int sbuff_sz){
 
     }
 
+    dphist_record(&dp->stats->sendLat, dpnow(dp) - startNs);
+    dp->stats->msgsOut++;
+    dp->stats->bytesOut += totalSent;
     return totalSent;
 }
 
 static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, bool frag){
+    return dpsendpdu(dp, frag ? DP_MT_FRAGMENT : DP_MT_SND, NULL, 0, 
+                        sbuff, sbuff_sz);
+}
+
+/*
+ *  Sends one datagram and waits for its ACK.  prefix is an optional sub
+ *  header (like dp_stream_hdr) that goes between the dp_pdu and the
+ *  payload, it counts against maxBuffSz.  Returns the payload bytes sent.
+ */
+static int dpsendpdu(dp_connp dp, int mtype, void *prefix, int prefix_sz,
+                        void *sbuff, int sbuff_sz){
     int bytesOut = 0;
+    bool frag = (mtype & DP_MT_FRAGMENT) != 0;
 
     if(!dp->outSockAddr.isAddrInit) {
         perror("dpsend:dp connection not setup properly");
         return DP_ERROR_GENERAL;
     }
 
-    if(sbuff_sz > DP_MAX_BUFF_SZ)
+    if(prefix_sz + sbuff_sz > dp->maxBuffSz)
         return DP_ERROR_GENERAL;
 
     //Build the PDU and out buffer
-    dp_pdu *outPdu = (dp_pdu *)_dpBuffer;
-    int    sndSz = sbuff_sz;
+    dp_pdu *outPdu = (dp_pdu *)dp->dgramBuff;
+    int    sndSz = prefix_sz + sbuff_sz;
     outPdu->proto_ver = DP_PROTO_VER_1;
-    outPdu->mtype = frag ? DP_MT_FRAGMENT : DP_MT_SND;
+    outPdu->mtype = mtype;
     outPdu->dgram_sz = sndSz;
     outPdu->seqnum = dp->seqNum;
 
-    memcpy((_dpBuffer + sizeof(dp_pdu)), sbuff, sndSz);
+    //the header, prefix and caller's data go out as one gathered datagram
+    struct iovec iov[3] = {
+        { .iov_base = dp->dgramBuff, .iov_len = sizeof(dp_pdu) },
+        { .iov_base = prefix, .iov_len = prefix_sz },
+        { .iov_base = sbuff, .iov_len = sbuff_sz },
+    };
 
     int totalSendSz = outPdu->dgram_sz + sizeof(dp_pdu);
-    bytesOut = dpsendraw(dp, _dpBuffer, totalSendSz);
+    dpflow_acquire(dp->flow, sndSz);
+    uint64_t sentNs = dpnow(dp);
+    bytesOut = dpsendrawv(dp, iov, 3);
 
     if(bytesOut != totalSendSz){
         printf("Warning send %d, but expected %d!\n", bytesOut, totalSendSz);
@@ -362,8 +742,11 @@ static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, bool frag){
             return DP_ERROR_PROTOCOL;
         }
     }
+    uint64_t rttNs = dprxsince(dp, sentNs);
+    dphist_record(&dp->stats->ackRtt, rttNs);
+    dprttsample(dp, rttNs);
 
-    return bytesOut - sizeof(dp_pdu);
+    return bytesOut - sizeof(dp_pdu) - prefix_sz;
 }
 
 
@@ -377,9 +760,10 @@ static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
     }
 
     dp_pdu *outPdu = sbuff;
-    bytesOut = sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
-        0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
-            dp->outSockAddr.len); 
+    bytesOut = dp->xport->send(dp, sbuff, sbuff_sz);
+    dp->stats->dgramsOut++;
+    if (dp->pcap != NULL && bytesOut > 0)
+        dppcap_record(dp, true, sbuff, bytesOut);
 
     
     print_out_pdu(outPdu);
@@ -387,6 +771,729 @@ static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
     return bytesOut;
 }
 
+static int dpsocksend(dp_connp dp, void *sbuff, int sbuff_sz){
+    return sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
+        0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
+            dp->outSockAddr.len); 
+}
+
+static int dpsocksendv(dp_connp dp, struct iovec *iov, int iovcnt){
+    struct msghdr msg = {
+        .msg_name = &(dp->outSockAddr.addr),
+        .msg_namelen = dp->outSockAddr.len,
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+    };
+    return sendmsg(dp->udp_sock, &msg, 0);
+}
+
+static int dpsockwait(dp_connp dp, int timeoutMs){
+    struct pollfd pfd = { .fd = dp->udp_sock, .events = POLLIN };
+    int rc;
+
+    do {
+        rc = poll(&pfd, 1, timeoutMs);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0)
+        return -1;
+    return rc > 0 ? 1 : 0;
+}
+
+/*
+ *  SO_TIMESTAMPNS stamps are CLOCK_REALTIME, dpnow() is CLOCK_MONOTONIC.
+ *  Carry the stamp over by its age, which is all that matters for a
+ *  round trip and does not care about the offset between the clocks.
+ */
+static uint64_t dpstamptonow(dp_connp dp, struct timespec *stamp){
+    struct timespec real;
+    int64_t ageNs;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t now = dpnow(dp);
+    ageNs = (int64_t)(real.tv_sec - stamp->tv_sec) * 1000000000ll + 
+            (real.tv_nsec - stamp->tv_nsec);
+    if (ageNs < 0)
+        ageNs = 0;
+    return (uint64_t)ageNs < now ? now - ageNs : now;
+}
+
+static int dpsockrecvfrom(dp_connp dp, void *buff, int buff_sz, int flags){
+    union {
+        char            buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr  align;
+    } ctl;
+    struct iovec iov = { .iov_base = buff, .iov_len = buff_sz };
+    struct msghdr msg = {
+        .msg_name = &(dp->outSockAddr.addr),
+        //a smaller len from the last peer would truncate a unix socket path
+        .msg_namelen = (dp->family == AF_UNIX) ? 
+            sizeof(struct sockaddr_un) : sizeof(struct sockaddr_in),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cm;
+    int rc;
+
+    if (dp->rxStamps) {
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+    }
+    rc = recvmsg(dp->udp_sock, &msg, flags);
+    if (rc < 0)
+        return rc;
+    dp->outSockAddr.len = msg.msg_namelen;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp;
+            memcpy(&stamp, CMSG_DATA(cm), sizeof(stamp));
+            dp->rxNs = dpstamptonow(dp, &stamp);
+        }
+    }
+    return rc;
+}
+
+static int dpsockrecv(dp_connp dp, void *buff, int buff_sz){
+    int rc;
+
+    if (dp->busyPollUs > 0) {
+        uint64_t start = dpnow(dp);
+        uint64_t end = start + (uint64_t)dp->busyPollUs * 1000;
+        uint64_t now;
+        do {
+            rc = dpsockrecvfrom(dp, buff, buff_sz, MSG_DONTWAIT);
+            now = dpnow(dp);
+            if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                dp->stats->pollHits++;
+                dp->stats->pollSpinNs += now - start;
+                return rc;
+            }
+        } while (now < end);
+        dp->stats->pollMisses++;
+        dp->stats->pollSpinNs += now - start;
+    }
+    return dpsockrecvfrom(dp, buff, buff_sz, MSG_WAITALL);
+}
+
+/*
+ *  Busy polling: dprecv() spins on a non-blocking recvfrom() for up to
+ *  spinUs before falling back to a blocking one, trading a CPU core for
+ *  not paying the sleep/wakeup on every datagram.  SO_BUSY_POLL is also
+ *  set so the kernel polls the NIC queue; raising it past the
+ *  net.core.busy_read sysctl needs CAP_NET_ADMIN and failing is harmless.
+ *  It only pays off with a spare core: on a single CPU the spinning side
+ *  keeps the peer from running.  Only the socket transport spins, 0 turns
+ *  it off.
+ */
+int dpsetbusypoll(dp_connp dp, int spinUs){
+    if (dp->xport != &_sockTransport)
+        return DP_ERROR_GENERAL;
+    if (spinUs < 0)
+        spinUs = 0;
+#ifdef SO_BUSY_POLL
+    if (dp->family == AF_INET &&
+        setsockopt(dp->udp_sock, SOL_SOCKET, SO_BUSY_POLL, &spinUs, 
+                    sizeof(spinUs)) < 0 && _debugMode)
+        perror("dpsetbusypoll: SO_BUSY_POLL not set, spinning in user space only");
+#endif
+    dp->busyPollUs = spinUs;
+    return DP_NO_ERROR;
+}
+
+
+//// COALESCING
+/*
+ *  Turns on coalescing of small messages, 0 turns it off.  A message is
+ *  held for at most maxDelayUs, but there is no timer behind it: the bound
+ *  is checked on every dpsend(), and dprecv(), dprecvstream() and
+ *  dpdisconnect() always flush first.  An app that sends and then goes
+ *  quiet without receiving should call dpflush() itself.
+ */
+int dpsetcoalesce(dp_connp dp, int maxDelayUs){
+    int rc;
+
+    if (maxDelayUs <= 0) {
+        if ((rc = dpflush(dp)) < 0)
+            return rc;
+        dp->coalesceNs = 0;
+        return DP_NO_ERROR;
+    }
+    if (dp->txBatch == NULL) {
+        dp->txBatch = malloc(dp->maxBuffSz);
+        if (dp->txBatch == NULL)
+            return DP_ERROR_GENERAL;
+    }
+    dp->coalesceNs = (uint64_t)maxDelayUs * 1000;
+    return DP_NO_ERROR;
+}
+
+//sends whatever is batched as one datagram
+int dpflush(dp_connp dp){
+    int rc;
+
+    if (dp->txBatchLen == 0)
+        return DP_NO_ERROR;
+
+    uint64_t startNs = dp->txBatchStartNs;
+    int msgs = dp->txBatchMsgs;
+    rc = dpsendpdu(dp, DP_MT_SND | DP_MT_BATCH, NULL, 0, 
+                    dp->txBatch, dp->txBatchLen);
+    dp->txBatchLen = 0;
+    dp->txBatchMsgs = 0;
+    if (rc < 0)
+        return rc;
+
+    //from the first message queued to the batch being ACKed
+    dphist_record(&dp->stats->sendLat, dpnow(dp) - startNs);
+    dp->stats->msgsOut += msgs;
+    return DP_NO_ERROR;
+}
+
+static int dpbatchadd(dp_connp dp, void *sbuff, int sbuff_sz){
+    unsigned short len = sbuff_sz;
+    uint64_t now = dpnow(dp);
+    int rc;
+
+    if (dp->txBatchLen + DP_BATCH_LEN_SZ + sbuff_sz > dp->maxBuffSz) {
+        if ((rc = dpflush(dp)) < 0)
+            return rc;
+    }
+    if (dp->txBatchLen == 0)
+        dp->txBatchStartNs = now;
+
+    memcpy(dp->txBatch + dp->txBatchLen, &len, DP_BATCH_LEN_SZ);
+    memcpy(dp->txBatch + dp->txBatchLen + DP_BATCH_LEN_SZ, sbuff, sbuff_sz);
+    dp->txBatchLen += DP_BATCH_LEN_SZ + sbuff_sz;
+    dp->txBatchMsgs++;
+    dp->stats->bytesOut += sbuff_sz;
+
+    if (now - dp->txBatchStartNs >= dp->coalesceNs) {
+        if ((rc = dpflush(dp)) < 0)
+            return rc;
+    }
+    return sbuff_sz;
+}
+
+//keeps a received batch around so dprecv() can hand it out piece by piece
+static int dpbatchload(dp_connp dp, char *data, int len){
+    if (dp->rxBatch == NULL) {
+        dp->rxBatch = malloc(dp->maxBuffSz);
+        if (dp->rxBatch == NULL)
+            return DP_ERROR_GENERAL;
+    }
+    memcpy(dp->rxBatch, data, len);
+    dp->rxBatchLen = len;
+    dp->rxBatchOff = 0;
+    return DP_NO_ERROR;
+}
+
+static int dpbatchpop(dp_connp dp, void *buff, int buff_sz){
+    unsigned short len;
+
+    if (dp->rxBatchOff + DP_BATCH_LEN_SZ > dp->rxBatchLen) {
+        dp->rxBatchLen = dp->rxBatchOff = 0;
+        return DP_ERROR_BAD_DGRAM;
+    }
+    memcpy(&len, dp->rxBatch + dp->rxBatchOff, DP_BATCH_LEN_SZ);
+    if (dp->rxBatchOff + DP_BATCH_LEN_SZ + len > dp->rxBatchLen) {
+        dp->rxBatchLen = dp->rxBatchOff = 0;
+        return DP_ERROR_BAD_DGRAM;
+    }
+    //like a normal dprecv() the message is lost if it does not fit
+    dp->rxBatchOff += DP_BATCH_LEN_SZ + len;
+    if (len > buff_sz)
+        return DP_BUFF_UNDERSIZED;
+    memcpy(buff, dp->rxBatch + dp->rxBatchOff - len, len);
+
+    dp->stats->msgsIn++;
+    dp->stats->bytesIn += len;
+    dp->stats->rxCrc = dpcrc32c(dp->stats->rxCrc, buff, len);
+    return len;
+}
+
+
+//// RPC
+typedef struct dp_rpc_call {
+    unsigned int    callId;             //0 = slot free
+    bool            isDone;
+    uint64_t        startNs;
+    char            *rsp;               //response that came in early
+    int             rspLen;
+} dp_rpc_call;
+
+static dp_rpc_call *dprpcfind(dp_connp dp, unsigned int callId){
+    if (dp->rpcCalls == NULL || callId == 0)
+        return NULL;
+    for (int i = 0; i < DP_RPC_MAX_INFLIGHT; i++)
+        if (dp->rpcCalls[i].callId == callId)
+            return &dp->rpcCalls[i];
+    return NULL;
+}
+
+static void dprpcfree(dp_connp dp){
+    if (dp->rpcCalls == NULL)
+        return;
+    for (int i = 0; i < DP_RPC_MAX_INFLIGHT; i++)
+        free(dp->rpcCalls[i].rsp);
+    free(dp->rpcCalls);
+    dp->rpcCalls = NULL;
+}
+
+//Sends one RPC datagram, nothing is waited for
+static int dprpcsend(dp_connp dp, int mtype, unsigned int callId, 
+                        void *sbuff, int sbuff_sz){
+    dp_rpc_hdr hdr = { .call_id = callId, .flags = 0 };
+    int totalSz = sizeof(dp_pdu) + sizeof(hdr) + sbuff_sz;
+
+    if (sizeof(hdr) + sbuff_sz > dp->maxBuffSz)
+        return DP_BUFF_OVERSIZED;
+
+    dp_pdu *outPdu = (dp_pdu *)dp->dgramBuff;
+    outPdu->proto_ver = DP_PROTO_VER_1;
+    outPdu->mtype = mtype;
+    outPdu->dgram_sz = sizeof(hdr) + sbuff_sz;
+    outPdu->seqnum = dp->seqNum;
+    outPdu->err_num = DP_NO_ERROR;
+    memcpy(dp->dgramBuff + sizeof(dp_pdu), &hdr, sizeof(hdr));
+    memcpy(dp->dgramBuff + sizeof(dp_pdu) + sizeof(hdr), sbuff, sbuff_sz);
+
+    if (dpsendraw(dp, dp->dgramBuff, totalSz) != totalSz)
+        return DP_ERROR_PROTOCOL;
+    dp->seqNum += outPdu->dgram_sz;
+    dp->stats->bytesOut += sbuff_sz;
+    return sbuff_sz;
+}
+
+/*
+ *  Starts a call and returns its id without waiting.  Up to
+ *  DP_RPC_MAX_INFLIGHT calls can be outstanding, the request has to fit
+ *  in one datagram.  There is no separate ACK, the response is the ACK.
+ */
+int dprpc_call_async(dp_connp dp, void *req, int req_sz){
+    dp_rpc_call *call = NULL;
+    int rc;
+
+    if ((rc = dpflush(dp)) < 0)
+        return rc;
+    if (dp->rpcCalls == NULL) {
+        dp->rpcCalls = calloc(DP_RPC_MAX_INFLIGHT, sizeof(dp_rpc_call));
+        if (dp->rpcCalls == NULL)
+            return DP_ERROR_GENERAL;
+    }
+    for (int i = 0; i < DP_RPC_MAX_INFLIGHT && call == NULL; i++)
+        if (dp->rpcCalls[i].callId == 0)
+            call = &dp->rpcCalls[i];
+    if (call == NULL)
+        return DP_ERROR_BUSY;
+
+    if (++dp->rpcNextId == 0 || dp->rpcNextId > INT32_MAX)
+        dp->rpcNextId = 1;
+
+    rc = dprpcsend(dp, DP_MT_RPC | DP_MT_SND, dp->rpcNextId, req, req_sz);
+    if (rc < 0)
+        return rc;
+
+    call->callId = dp->rpcNextId;
+    call->isDone = false;
+    call->startNs = dpnow(dp);
+    call->rsp = NULL;
+    dp->stats->msgsOut++;
+    return call->callId;
+}
+
+/*
+ *  Waits for the response to callId.  Responses to other outstanding calls
+ *  that show up in the meantime are kept for their own dprpc_wait().  On
+ *  timeout the call is abandoned and a late response is dropped.
+ */
+int dprpc_wait(dp_connp dp, int callId, void *rsp, int rsp_sz, int timeoutMs){
+    dp_rpc_call *call = dprpcfind(dp, callId);
+    uint64_t deadline;
+    int rc = DP_NO_ERROR;
+
+    if (call == NULL)
+        return DP_ERROR_GENERAL;
+    deadline = call->startNs + (uint64_t)timeoutMs * 1000000;
+
+    while (!call->isDone) {
+        uint64_t now = dpnow(dp);
+        if (now >= deadline) {
+            rc = DP_ERROR_TIMEOUT;
+            break;
+        }
+
+        int ready = dp->xport->wait(dp, (int)((deadline - now + 999999) / 1000000));
+        if (ready < 0) {
+            rc = DP_ERROR_GENERAL;
+            break;
+        }
+        if (ready == 0)
+            continue;
+
+        int rcvLen = dprecvdgram(dp, dp->dgramBuff, 
+                            dp->maxBuffSz + sizeof(dp_pdu));
+        if (rcvLen == DP_CONNECTION_CLOSED)
+            return DP_CONNECTION_CLOSED;
+        if (rcvLen < 0) {
+            rc = rcvLen;                //the call is abandoned as on timeout
+            break;
+        }
+        if (rcvLen < (int)(sizeof(dp_pdu) + sizeof(dp_rpc_hdr)))
+            continue;
+
+        dp_pdu *inPdu = (dp_pdu *)dp->dgramBuff;
+        if (inPdu->mtype != (DP_MT_RPC | DP_MT_ACK)) {
+            printf("RPC: ignoring unexpected mtype %d\n", inPdu->mtype);
+            continue;
+        }
+        dp_rpc_hdr *hdr = (dp_rpc_hdr *)(dp->dgramBuff + sizeof(dp_pdu));
+        dp_rpc_call *c = dprpcfind(dp, hdr->call_id);
+        if (c == NULL || c->isDone)
+            continue;                   //late answer to an abandoned call
+
+        c->rspLen = inPdu->dgram_sz - sizeof(dp_rpc_hdr);
+        c->rsp = malloc(c->rspLen > 0 ? c->rspLen : 1);
+        if (c->rsp == NULL) {
+            rc = DP_ERROR_GENERAL;
+            break;
+        }
+        memcpy(c->rsp, dp->dgramBuff + sizeof(dp_pdu) + sizeof(dp_rpc_hdr), c->rspLen);
+        c->isDone = true;
+        dphist_record(&dp->stats->rpcLat, dprxsince(dp, c->startNs));
+        dp->stats->msgsIn++;
+        dp->stats->bytesIn += c->rspLen;
+    }
+
+    if (rc == DP_NO_ERROR) {
+        if (call->rspLen > rsp_sz)
+            rc = DP_BUFF_UNDERSIZED;
+        else {
+            memcpy(rsp, call->rsp, call->rspLen);
+            rc = call->rspLen;
+        }
+    }
+    free(call->rsp);
+    call->rsp = NULL;
+    call->callId = 0;
+    return rc;
+}
+
+int dprpc_call(dp_connp dp, void *req, int req_sz, void *rsp, int rsp_sz,
+                int timeoutMs){
+    int callId = dprpc_call_async(dp, req, req_sz);
+    if (callId < 0)
+        return callId;
+    return dprpc_wait(dp, callId, rsp, rsp_sz, timeoutMs);
+}
+
+/*
+ *  Server side: returns the next request and its call id.  Requests are
+ *  not ACKed, dprpc_reply() answers them.
+ */
+int dprpc_recv(dp_connp dp, int *callId, void *req, int req_sz){
+    while (1) {
+        int rcvLen = dprecvdgram(dp, dp->dgramBuff, 
+                            dp->maxBuffSz + sizeof(dp_pdu));
+        if (rcvLen < 0)
+            return rcvLen;
+        if (rcvLen < (int)sizeof(dp_pdu))
+            return DP_ERROR_BAD_DGRAM;
+
+        dp_pdu *inPdu = (dp_pdu *)dp->dgramBuff;
+        if (inPdu->mtype != (DP_MT_RPC | DP_MT_SND)) {
+            printf("RPC: ignoring non RPC message, mtype %d\n", inPdu->mtype);
+            continue;
+        }
+        if (inPdu->dgram_sz < (int)sizeof(dp_rpc_hdr))
+            return DP_ERROR_BAD_DGRAM;
+
+        dp_rpc_hdr *hdr = (dp_rpc_hdr *)(dp->dgramBuff + sizeof(dp_pdu));
+        int len = inPdu->dgram_sz - sizeof(dp_rpc_hdr);
+        if (len > req_sz)
+            return DP_BUFF_UNDERSIZED;
+        memcpy(req, dp->dgramBuff + sizeof(dp_pdu) + sizeof(dp_rpc_hdr), len);
+        *callId = hdr->call_id;
+        dp->stats->msgsIn++;
+        dp->stats->bytesIn += len;
+        return len;
+    }
+}
+
+int dprpc_reply(dp_connp dp, int callId, void *rsp, int rsp_sz){
+    int rc = dprpcsend(dp, DP_MT_RPC | DP_MT_ACK, callId, rsp, rsp_sz);
+    if (rc >= 0)
+        dp->stats->msgsOut++;
+    return rc;
+}
+
+
+//// STREAMS
+typedef struct dp_stream_msg {
+    struct dp_stream_msg    *next;
+    char                    *buff;          //owned by the caller until sent
+    int                     sz;
+    int                     sent;
+    uint64_t                queuedNs;
+} dp_stream_msg;
+
+typedef struct dp_stream {
+    unsigned int    txSeq;
+    unsigned int    rxSeq;
+    dp_stream_msg   *head;
+    dp_stream_msg   *tail;
+    char            *rBuff;                 //reassembly of the current message
+    int             rLen;
+    int             rCap;
+} dp_stream;
+
+static dp_stream *dpgetstream(dp_connp dp, int streamId){
+    if (streamId < 0 || streamId >= DP_MAX_STREAMS)
+        return NULL;
+    if (dp->streams == NULL) {
+        dp->streams = calloc(DP_MAX_STREAMS, sizeof(dp_stream));
+        if (dp->streams == NULL)
+            return NULL;
+    }
+    return &dp->streams[streamId];
+}
+
+static void dpstreamfree(dp_connp dp){
+    if (dp->streams == NULL)
+        return;
+    for (int i = 0; i < DP_MAX_STREAMS; i++) {
+        dp_stream_msg *m = dp->streams[i].head;
+        while (m != NULL) {
+            dp_stream_msg *next = m->next;
+            free(m);
+            m = next;
+        }
+        free(dp->streams[i].rBuff);
+    }
+    free(dp->streams);
+    dp->streams = NULL;
+}
+
+/*
+ *  Queues a message on a stream.  Nothing is sent until dpstream_pump()
+ *  or dpstream_flush() is called, and the buffer has to stay valid until
+ *  dpstream_pending() says the stream is drained.
+ */
+int dpstream_send(dp_connp dp, int streamId, void *sbuff, int sbuff_sz){
+    dp_stream *st = dpgetstream(dp, streamId);
+    if (st == NULL || sbuff_sz <= 0)
+        return DP_ERROR_GENERAL;
+
+    dp_stream_msg *m = malloc(sizeof(dp_stream_msg));
+    if (m == NULL)
+        return DP_ERROR_GENERAL;
+    m->next = NULL;
+    m->buff = sbuff;
+    m->sz = sbuff_sz;
+    m->sent = 0;
+    m->queuedNs = dpnow(dp);
+
+    if (st->tail == NULL)
+        st->head = m;
+    else
+        st->tail->next = m;
+    st->tail = m;
+    return sbuff_sz;
+}
+
+//bytes still queued on a stream
+int dpstream_pending(dp_connp dp, int streamId){
+    dp_stream *st = dpgetstream(dp, streamId);
+    int pending = 0;
+
+    if (st == NULL)
+        return DP_ERROR_GENERAL;
+    for (dp_stream_msg *m = st->head; m != NULL; m = m->next)
+        pending += m->sz - m->sent;
+    return pending;
+}
+
+/*
+ *  Sends up to maxDgrams datagrams, taking one fragment from each stream
+ *  that has data in turn.  Returns the number of streams that still have
+ *  data queued (0 when everything is out) or an error.
+ */
+int dpstream_pump(dp_connp dp, int maxDgrams){
+    int maxChunk = dp->maxBuffSz - sizeof(dp_stream_hdr);
+    int sent = 0, busy;
+
+    if (dp->streams == NULL)
+        return 0;
+
+    while (sent < maxDgrams) {
+        dp_stream *st = NULL;
+        int sid;
+
+        //next stream after the last one served that has something queued
+        for (int i = 0; i < DP_MAX_STREAMS; i++) {
+            sid = (dp->nextStream + i) % DP_MAX_STREAMS;
+            if (dp->streams[sid].head != NULL) {
+                st = &dp->streams[sid];
+                break;
+            }
+        }
+        if (st == NULL)
+            break;
+        dp->nextStream = (sid + 1) % DP_MAX_STREAMS;
+
+        dp_stream_msg *m = st->head;
+        int chunk = m->sz - m->sent;
+        bool isLast = true;
+        if (chunk > maxChunk) {
+            chunk = maxChunk;
+            isLast = false;
+        }
+
+        dp_stream_hdr hdr = {
+            .stream_id = sid,
+            .flags = 0,
+            .stream_seq = st->txSeq,
+        };
+        int mtype = DP_MT_STREAM | (isLast ? DP_MT_SND : DP_MT_FRAGMENT);
+        int sndSz = dpsendpdu(dp, mtype, &hdr, sizeof(hdr), m->buff + m->sent, chunk);
+        if (sndSz < 0)
+            return sndSz;
+
+        st->txSeq += sndSz;
+        m->sent += sndSz;
+        sent++;
+        if (isLast) {
+            dphist_record(&dp->stats->sendLat, dpnow(dp) - m->queuedNs);
+            dp->stats->msgsOut++;
+            dp->stats->bytesOut += m->sz;
+            st->head = m->next;
+            if (st->head == NULL)
+                st->tail = NULL;
+            free(m);
+        }
+    }
+
+    busy = 0;
+    for (int i = 0; i < DP_MAX_STREAMS; i++)
+        if (dp->streams[i].head != NULL)
+            busy++;
+    return busy;
+}
+
+int dpstream_flush(dp_connp dp){
+    int rc;
+
+    while ((rc = dpstream_pump(dp, DP_MAX_STREAMS)) > 0)
+        ;
+    return rc;
+}
+
+static int dpstreamappend(dp_stream *st, char *data, int len){
+    if (st->rLen + len > st->rCap) {
+        int newCap = st->rCap ? st->rCap : 4096;
+        while (newCap < st->rLen + len)
+            newCap *= 2;
+        char *nb = realloc(st->rBuff, newCap);
+        if (nb == NULL)
+            return DP_ERROR_GENERAL;
+        st->rBuff = nb;
+        st->rCap = newCap;
+    }
+    memcpy(st->rBuff + st->rLen, data, len);
+    st->rLen += len;
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Receives the next complete message from any stream.  Fragments are
+ *  reassembled per stream, so messages come back in the order their last
+ *  fragment arrived.  Plain dpsend() messages are returned as stream 0.
+ */
+int dprecvstream(dp_connp dp, int *streamId, void *buff, int buff_sz){
+    uint64_t startNs = dpnow(dp);
+    int rc;
+
+    if ((rc = dpflush(dp)) < 0)
+        return rc;
+    if (dp->rxBatchOff < dp->rxBatchLen) {
+        *streamId = 0;
+        return dpbatchpop(dp, buff, buff_sz);
+    }
+
+    while (1) {
+        int rcvLen = dprecvdgram(dp, dp->dgramBuff, 
+                            dp->maxBuffSz + sizeof(dp_pdu));
+        if (rcvLen < 0)
+            return rcvLen;
+        if (rcvLen < (int)sizeof(dp_pdu))
+            return DP_ERROR_BAD_DGRAM;
+
+        dp_pdu *inPdu = (dp_pdu *)dp->dgramBuff;
+        char *data = dp->dgramBuff + sizeof(dp_pdu);
+        int len = inPdu->dgram_sz;
+        int sid = 0;
+        dp_stream *st;
+
+        if (inPdu->mtype & DP_MT_STREAM) {
+            dp_stream_hdr *hdr = (dp_stream_hdr *)data;
+            if (len < (int)sizeof(dp_stream_hdr))
+                return DP_ERROR_BAD_DGRAM;
+            sid = hdr->stream_id;
+            st = dpgetstream(dp, sid);
+            if (st == NULL)
+                return DP_ERROR_PROTOCOL;
+            if (hdr->stream_seq != st->rxSeq) {
+                printf("Stream %d expected seq %u but got %u\n", sid, 
+                    st->rxSeq, hdr->stream_seq);
+                return DP_ERROR_PROTOCOL;
+            }
+            data += sizeof(dp_stream_hdr);
+            len -= sizeof(dp_stream_hdr);
+        } else if (inPdu->mtype & DP_MT_BATCH) {
+            if ((rc = dpbatchload(dp, data, len)) < 0)
+                return rc;
+            *streamId = 0;
+            return dpbatchpop(dp, buff, buff_sz);
+        } else {
+            st = dpgetstream(dp, 0);
+            if (st == NULL)
+                return DP_ERROR_GENERAL;
+        }
+
+        if (dpstreamappend(st, data, len) != DP_NO_ERROR)
+            return DP_ERROR_GENERAL;
+        if (inPdu->mtype & DP_MT_STREAM)
+            st->rxSeq += len;
+
+        if (inPdu->mtype & DP_MT_SND) {
+            int msgLen = st->rLen;
+            st->rLen = 0;
+            if (msgLen > buff_sz)
+                return DP_BUFF_UNDERSIZED;
+            memcpy(buff, st->rBuff, msgLen);
+            *streamId = sid;
+
+            dphist_record(&dp->stats->recvWait, dprxsince(dp, startNs));
+            dp->stats->msgsIn++;
+            dp->stats->bytesIn += msgLen;
+            //plain dpsend() traffic counts towards the integrity check
+            if (!(inPdu->mtype & DP_MT_STREAM))
+                dp->stats->rxCrc = dpcrc32c(dp->stats->rxCrc, buff, msgLen);
+            return msgLen;
+        }
+    }
+}
+
+
+//A CONNECT with its optional dp_connect_opts
+typedef struct dp_connect_msg {
+    dp_pdu          pdu;
+    dp_connect_opts opts;
+} dp_connect_msg;
+
+static void dpconnectopts(dp_connp dp, dp_connect_msg *msg, int len){
+    if (len == sizeof(*msg) && msg->pdu.dgram_sz == sizeof(dp_connect_opts))
+        dp->trafficClass = msg->opts.trafficClass;
+}
 
 int dplisten(dp_connp dp) {
     int sndSz, rcvSz;
@@ -397,13 +1504,17 @@ int dplisten(dp_connp dp) {
     }
 
     dp_pdu pdu = {0};
+    dp_connect_msg msg;
 
-    printf("Waiting for a connection...\n");
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(pdu)) {
+    if (_debugMode == 1)
+        printf("Waiting for a connection...\n");
+    rcvSz = dprecvraw(dp, &msg, sizeof(msg));
+    if (rcvSz != sizeof(pdu) && rcvSz != sizeof(msg)) {
         perror("dplisten:The wrong number of bytes were received");
         return DP_ERROR_GENERAL;
     }
+    pdu = msg.pdu;
+    dpconnectopts(dp, &msg, rcvSz);
 
     pdu.mtype = DP_MT_CNTACK;
     dp->seqNum = pdu.seqnum + 1;
@@ -417,11 +1528,75 @@ int dplisten(dp_connp dp) {
     }
     dp->isConnected = true; 
     //For non data transmissions, ACK of just control data increase seq # by one
-    printf("Connection established OK!\n");
+    if (_debugMode == 1)
+        printf("Connection established OK!\n");
 
     return true;
 }
 
+/*
+ *  Takes the next CONNECT off a listening server connection.  The session
+ *  gets its own socket on an ephemeral port and the CNTACK goes out from
+ *  there; dpconnect() takes the reply address as the server's, so the
+ *  rest of the session never touches the listening socket and many
+ *  sessions can run at once.  With busy set the client is turned away
+ *  with a CONNECT|NACK and DP_ERROR_BUSY comes back.
+ */
+int dpaccept(dp_connp listener, dp_connp *session, bool busy) {
+    dp_pdu pdu = {0};
+    dp_connect_msg msg;
+    int rcvSz;
+
+    *session = NULL;
+    if (listener->family != AF_INET || !listener->isServer)
+        return DP_ERROR_GENERAL;
+    //anything else on the listening socket is a leftover, drop it
+    do {
+        rcvSz = dprecvraw(listener, &msg, sizeof(msg));
+        if (rcvSz < 0)
+            return DP_ERROR_GENERAL;
+        pdu = msg.pdu;
+    } while ((rcvSz != sizeof(pdu) && rcvSz != sizeof(msg)) || pdu.mtype != DP_MT_CONNECT);
+
+    if (busy) {
+        pdu.mtype = DP_MT_CONNECT | DP_MT_NACK;
+        pdu.err_num = DP_ERROR_BUSY;
+        dpsendraw(listener, &pdu, sizeof(pdu));
+        return DP_ERROR_BUSY;
+    }
+
+    dp_connp dpc = dpinit(AF_INET, listener->maxBuffSz);
+    if (dpc == NULL)
+        return DP_ERROR_GENERAL;
+    struct sockaddr_in *addr = &(dpc->inSockAddr.addr);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = INADDR_ANY;
+    addr->sin_port = 0;
+    if ((dpc->udp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        bind(dpc->udp_sock, (const struct sockaddr *)addr, dpc->inSockAddr.len) < 0) {
+        perror("dpaccept: session socket failed");
+        dpclose(dpc);
+        return DP_ERROR_GENERAL;
+    }
+    dpsockstamps(dpc);
+    dpc->inSockAddr.isAddrInit = true;
+    dpc->outSockAddr = listener->outSockAddr;
+    dpc->isServer = true;
+    dpconnectopts(dpc, &msg, rcvSz);
+
+    pdu.mtype = DP_MT_CNTACK;
+    dpc->seqNum = pdu.seqnum + 1;
+    pdu.seqnum = dpc->seqNum;
+    if (dpsendraw(dpc, &pdu, sizeof(pdu)) != sizeof(pdu)) {
+        perror("dpaccept:The wrong number of bytes were sent");
+        dpclose(dpc);
+        return DP_ERROR_GENERAL;
+    }
+    dpc->isConnected = true;
+    *session = dpc;
+    return DP_NO_ERROR;
+}
+
 int dpconnect(dp_connp dp) {
 
     int sndSz, rcvSz;
@@ -432,12 +1607,14 @@ int dpconnect(dp_connp dp) {
     }
 
     dp_pdu pdu = {0};
-    pdu.mtype = DP_MT_CONNECT;
-    pdu.seqnum = dp->seqNum;
-    pdu.dgram_sz = 0;
-
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    if (sndSz != sizeof(dp_pdu)) {
+    dp_connect_msg msg = {0};
+    msg.pdu.mtype = DP_MT_CONNECT;
+    msg.pdu.seqnum = dp->seqNum;
+    msg.pdu.dgram_sz = sizeof(dp_connect_opts);
+    msg.opts.trafficClass = dp->trafficClass;
+
+    sndSz = dpsendraw(dp, &msg, sizeof(msg));
+    if (sndSz != sizeof(msg)) {
         perror("dpconnect:Wrong about of connection data sent");
         return -1;
     }
@@ -447,6 +1624,10 @@ int dpconnect(dp_connp dp) {
         perror("dpconnect:Wrong about of connection data received");
         return -1;
     }
+    if (pdu.mtype == (DP_MT_CONNECT | DP_MT_NACK)) {
+        printf("dpconnect: server is busy, try again later\n");
+        return DP_ERROR_BUSY;
+    }
     if (pdu.mtype != DP_MT_CNTACK) {
         perror("dpconnect:Expected CNTACT Message but didnt get it");
         return -1;
@@ -455,7 +1636,8 @@ int dpconnect(dp_connp dp) {
     //For non data transmissions, ACK of just control data increase seq # by one
     dp->seqNum++;
     dp->isConnected = true;
-    printf("Connection established OK!\n");
+    if (_debugMode == 1)
+        printf("Connection established OK!\n");
 
     return true;
 }
@@ -464,14 +1646,24 @@ int dpdisconnect(dp_connp dp) {
 
     int sndSz, rcvSz;
 
-    dp_pdu pdu = {0};
-    pdu.proto_ver = DP_PROTO_VER_1;
-    pdu.mtype = DP_MT_CLOSE;
-    pdu.seqnum = dp->seqNum;
-    pdu.dgram_sz = 0;
+    if (dpflush(dp) < 0)
+        return DP_ERROR_GENERAL;
 
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    if (sndSz != sizeof(dp_pdu)) {
+    //the CLOSE carries our CRCs for the peer to check
+    struct {
+        dp_pdu          pdu;
+        dp_close_digest digest;
+    } msg = {0};
+    dp_pdu pdu = {0};
+    msg.pdu.proto_ver = DP_PROTO_VER_1;
+    msg.pdu.mtype = DP_MT_CLOSE;
+    msg.pdu.seqnum = dp->seqNum;
+    msg.pdu.dgram_sz = sizeof(dp_close_digest);
+    msg.digest.txCrc = dp->stats->txCrc;
+    msg.digest.rxCrc = dp->stats->rxCrc;
+
+    sndSz = dpsendraw(dp, &msg, sizeof(msg));
+    if (sndSz != sizeof(msg)) {
         perror("dpdisconnect:Wrong about of connection data sent");
         return DP_ERROR_GENERAL;
     }
@@ -485,10 +1677,20 @@ int dpdisconnect(dp_connp dp) {
         perror("dpdisconnect:Expected CNTACT Message but didnt get it"); 
         return DP_ERROR_GENERAL;
     }
+    if (pdu.err_num == DP_ERROR_INTEGRITY) {
+        dp->stats->integrity = DP_INTEGRITY_MISMATCH;
+        printf("ERROR: peer reports an integrity mismatch, we sent crc32c %08x "
+            "and got %08x\n", dp->stats->txCrc, dp->stats->rxCrc);
+    } else {
+        dp->stats->integrity = DP_INTEGRITY_OK;
+        if (_debugMode == 1)
+            printf("Integrity: crc32c %08x out, %08x in, matches the peer (%s)\n",
+                dp->stats->txCrc, dp->stats->rxCrc, dpcrc32c_impl());
+    }
     //For non data transmissions, ACK of just control data increase seq # by one
     dpclose(dp);
 
-    return DP_CONNECTION_CLOSED;
+    return pdu.err_num == DP_ERROR_INTEGRITY ? DP_ERROR_INTEGRITY : DP_CONNECTION_CLOSED;
 }
 
 void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
@@ -547,6 +1749,16 @@ static char * pdu_msg_to_string(dp_pdu *pdu) {
             return "FRAG/ACK";
         case DP_MT_FRAGMENT:
             return "FRAGMENT";
+        case DP_MT_STREAM | DP_MT_SND:
+            return "STREAM/SEND";
+        case DP_MT_STREAM | DP_MT_FRAGMENT:
+            return "STREAM/FRAGMENT";
+        case DP_MT_BATCH | DP_MT_SND:
+            return "BATCH/SEND";
+        case DP_MT_RPC | DP_MT_SND:
+            return "RPC/REQUEST";
+        case DP_MT_RPC | DP_MT_ACK:
+            return "RPC/RESPONSE";
         default:
             return "***UNKNOWN***";  
     }
@@ -1,22 +1,97 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
+#include "du-stats.h"
 
+
+//The address is either an IPv4 address or, for same host transfers, a
+//unix domain socket path.  sockaddr_in and sockaddr_un both start with the
+//family so the union can be handed to sendto()/recvfrom() as is
 struct dp_sock{
     socklen_t          len;
     _Bool              isAddrInit;
-    struct sockaddr_in addr;
+    union {
+        struct sockaddr_in addr;
+        struct sockaddr_un unAddr;
+    };
 };
 
+struct dp_connection;
+struct dp_pcap;
+
+/*
+ *  The transport moves raw datagrams for dpsendraw()/dprecvraw().  The
+ *  default one is the UDP/unix socket, the in memory loopback channel in
+ *  du-loop.c plugs in here as well.  send/recv follow sendto()/recvfrom()
+ *  return conventions, close releases whatever the transport owns and wait
+ *  returns 1 once a datagram can be received, 0 on timeout, -1 on error.
+ *  sendv is optional: it sends one datagram gathered from iov without
+ *  copying it, transports that leave it NULL get a copy through send.
+ */
+typedef struct dp_transport {
+    const char  *name;
+    int         (*send)(struct dp_connection *dp, void *sbuff, int sbuff_sz);
+    int         (*recv)(struct dp_connection *dp, void *buff, int buff_sz);
+    void        (*close)(struct dp_connection *dp);
+    int         (*wait)(struct dp_connection *dp, int timeoutMs);
+    int         (*sendv)(struct dp_connection *dp, struct iovec *iov, int iovcnt);
+} dp_transport;
+
+/*
+ *  A virtual clock, in nanoseconds.  When a connection has one attached
+ *  dpnow() reads it instead of CLOCK_MONOTONIC so simulated runs do not
+ *  depend on wall clock time.  Transports advance it as datagrams move.
+ */
+typedef struct dp_clock {
+    uint64_t    nowNs;
+} dp_clock;
+
 typedef struct dp_connection{
     unsigned int       seqNum;
     int                udp_sock;
+    int                family;          //AF_INET or AF_UNIX
+    int                maxBuffSz;       //max payload per datagram
+    char               *dgramBuff;      //holds one full datagram
     _Bool              isConnected;
+    _Bool              isServer;
     struct dp_sock     outSockAddr;
     struct dp_sock     inSockAddr;
     int                dbgMode;
+    const dp_transport *xport;
+    void               *xportCtx;       //private state of the transport
+    dp_clock           *clock;          //NULL means real time
+    dp_stats           *stats;
+    _Bool              statsOwned;      //false once the app detached them
+    struct dp_pcap     *pcap;           //NULL unless capturing
+    uint32_t           pcapLocalIp;     //for the capture headers, network order,
+    uint16_t           pcapLocalPort;   //port 0 until the socket has one
+    struct dp_stream   *streams;        //allocated on first stream use
+    int                nextStream;      //round robin position for pumping
+    uint64_t           coalesceNs;      //0 = every dpsend() goes out now
+    char               *txBatch;
+    int                txBatchLen;
+    int                txBatchMsgs;
+    uint64_t           txBatchStartNs;
+    char               *rxBatch;
+    int                rxBatchLen;
+    int                rxBatchOff;
+    struct dp_rpc_call *rpcCalls;       //allocated on first call
+    unsigned int       rpcNextId;
+    int                busyPollUs;      //spin this long before blocking, 0 = off
+    _Bool              rxStamps;        //socket has SO_TIMESTAMPNS on
+    uint64_t           rxNs;            //arrival of the last datagram, dpnow() time
+    uint64_t           srttNs;          //RTT estimator, 0 until the first sample
+    uint64_t           rttvarNs;
+    uint64_t           rtoNs;
+    struct dp_flow     *flow;           //NULL = no bandwidth control, see du-rate.h
+    int                trafficClass;    //DP_CLASS_xxx, sent in the CONNECT
+    char               unixPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
 } dp_connection;
 
 typedef struct dp_connection *dp_connp;
@@ -44,6 +119,9 @@ typedef struct dp_connection *dp_connp;
 #define DP_MT_NACK       16             //NEG ACK
 #define DP_MT_FRAGMENT   32             //DGRAM IS A FRAGMENT
 #define DP_MT_ERROR      64             //SIMULATE ERROR
+#define DP_MT_STREAM     128            //PAYLOAD STARTS WITH dp_stream_hdr
+#define DP_MT_BATCH      256            //PAYLOAD IS COALESCED MESSAGES
+#define DP_MT_RPC        512            //PAYLOAD STARTS WITH dp_rpc_hdr
     
 
 //Message ACKS, ACK OR'ed with Message Type
@@ -60,9 +138,83 @@ typedef struct dp_pdu {
     int     err_num;
 } dp_pdu;
 
+/*
+ *  CONNECT payload.  dpconnect() always sends it so the server can put
+ *  the session in the client's rate class (see du-rate.h); a server that
+ *  does not know it just drops it.
+ */
+typedef struct dp_connect_opts {
+    int32_t         trafficClass;       //DP_CLASS_xxx of the client's transfer
+} dp_connect_opts;
+
+/*
+ *  RTT estimation, RFC 6298 style, from the ACK round trips.  The minimum
+ *  RTO is far below the RFC's 1s so it stays useful on a LAN.
+ */
+#define     DP_RTO_INIT_NS          1000000000ull
+#define     DP_RTO_MIN_NS           1000000ull
+#define     DP_RTO_MAX_NS           60000000000ull
+
 #define     DP_MAX_BUFF_SZ          512
 #define     DP_MAX_DGRAM_SZ         (DP_MAX_BUFF_SZ + sizeof(dp_pdu))
 
+//Unix domain datagrams never touch the IP stack, so we can go much bigger
+#define     DP_UNIX_MAX_BUFF_SZ     (60 * 1024)
+#define     DP_UNIX_SOCK_BUFF_SZ    (4 * DP_UNIX_MAX_BUFF_SZ)
+
+/*
+ *  Multiplexed streams.  A datagram with DP_MT_STREAM set carries this
+ *  header at the start of its payload (dgram_sz includes it).  Every
+ *  stream has its own byte sequence and its own reassembly buffer, so
+ *  fragments of different streams can be interleaved on the connection
+ *  and a small message on one stream is delivered without waiting for a
+ *  large message on another.  Plain dpsend() traffic is stream 0.
+ */
+#define     DP_MAX_STREAMS          16
+
+typedef struct dp_stream_hdr {
+    unsigned short  stream_id;
+    unsigned short  flags;              //reserved, 0
+    unsigned int    stream_seq;         //byte offset in the stream
+} dp_stream_hdr;
+
+struct dp_stream;
+
+/*
+ *  Coalescing.  With dpsetcoalesce() small dpsend() messages are packed
+ *  into one DP_MT_BATCH datagram, each one framed by a DP_BATCH_LEN_SZ
+ *  byte length, and dprecv() hands them back one at a time.
+ */
+#define     DP_BATCH_LEN_SZ         2
+
+/*
+ *  RPC.  A request is DP_MT_RPC|DP_MT_SND and is not ACKed, the response
+ *  (DP_MT_RPC|DP_MT_ACK) carries the same call id and is the ACK.  Many
+ *  calls can be in flight, so a call costs one round trip.
+ */
+#define     DP_RPC_MAX_INFLIGHT     64
+
+typedef struct dp_rpc_hdr {
+    unsigned int    call_id;
+    unsigned int    flags;              //reserved, 0
+} dp_rpc_hdr;
+
+struct dp_rpc_call;
+
+/*
+ *  End to end integrity.  Both ends keep a CRC32C of the bytes of every
+ *  message that goes through dpsend() and comes out of dprecv(), or out
+ *  of dprecvstream() as stream 0 (other streams and RPC are not covered).
+ *  dpdisconnect() sends its two CRCs as the CLOSE payload, the other end
+ *  checks them against its own and answers with err_num
+ *  DP_ERROR_INTEGRITY in the CLOSE/ACK if either differs.  The result
+ *  ends up in dp_stats.integrity on both sides.
+ */
+typedef struct dp_close_digest {
+    uint32_t        txCrc;              //of what the closing side sent
+    uint32_t        rxCrc;              //of what it received
+} dp_close_digest;
+
 #define     DP_NO_ERROR             0
 #define     DP_ERROR_GENERAL        -1
 #define     DP_ERROR_PROTOCOL       -2
@@ -70,12 +222,18 @@ typedef struct dp_pdu {
 #define     DP_BUFF_OVERSIZED       -8
 #define     DP_CONNECTION_CLOSED    -16
 #define     DP_ERROR_BAD_DGRAM      -32
+#define     DP_ERROR_TIMEOUT        -64
+#define     DP_ERROR_BUSY           -128
+#define     DP_ERROR_INTEGRITY      -256
 
 //PROTOTYPES - INTERNAL HELPERS
-static dp_connp dpinit();
+dp_connp dpinit(int family, int maxBuffSz);
+void dpsockclose(dp_connp dp);
 
 dp_connp dpServerInit(int port);
 dp_connp dpClientInit(char *addr, int port);
+dp_connp dpServerInitUnix(char *path);
+dp_connp dpClientInitUnix(char *path);
 static char * pdu_msg_to_string(dp_pdu *pdu);
 
 //API Interface
@@ -86,12 +244,50 @@ int dplisten(dp_connp dp);
 int dpconnect(dp_connp dp);
 int dpdisconnect(dp_connp dp);
 
+//Multi-session server API, UDP only
+int dpaccept(dp_connp listener, dp_connp *session, bool busy);
+
+//Coalescing API
+int dpsetcoalesce(dp_connp dp, int maxDelayUs);
+int dpflush(dp_connp dp);
+
+//RTT estimate, the current retransmit timeout
+uint64_t dprto(dp_connp dp);
+
+//Busy poll API
+int dpsetbusypoll(dp_connp dp, int spinUs);
+
+//RPC API
+int dprpc_call(dp_connp dp, void *req, int req_sz, void *rsp, int rsp_sz,
+                int timeoutMs);
+int dprpc_call_async(dp_connp dp, void *req, int req_sz);
+int dprpc_wait(dp_connp dp, int callId, void *rsp, int rsp_sz, int timeoutMs);
+int dprpc_recv(dp_connp dp, int *callId, void *req, int req_sz);
+int dprpc_reply(dp_connp dp, int callId, void *rsp, int rsp_sz);
+
+//Stream API
+int dpstream_send(dp_connp dp, int streamId, void *sbuff, int sbuff_sz);
+int dpstream_pump(dp_connp dp, int maxDgrams);
+int dpstream_flush(dp_connp dp);
+int dpstream_pending(dp_connp dp, int streamId);
+int dprecvstream(dp_connp dp, int *streamId, void *buff, int buff_sz);
+
 void dpclose(dp_connp dpsession);
 void print_out_pdu(dp_pdu *pdu);
 void print_in_pdu(dp_pdu *pdu);
 int  dpmaxdgram();
+int  dpmaxpayload(dp_connp dp);
+void dpsetdebug(int on);
+void dpinfo(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+uint64_t dpnow(dp_connp dp);
+dp_stats *dpstats(dp_connp dp);
+dp_stats *dpstats_detach(dp_connp dp);
+void dpclock_advance(dp_clock *clk, uint64_t ns);
 static void print_pdu_details(dp_pdu *pdu);
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz);
+static int dpsendrawv(dp_connp dp, struct iovec *iov, int iovcnt);
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz);
 static int dprecvdgram(dp_connp dp, void *buff, int buff_sz);
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, bool frag);
\ No newline at end of file
+static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, bool frag);
+static int dpsendpdu(dp_connp dp, int mtype, void *prefix, int prefix_sz,
+                        void *sbuff, int sbuff_sz);
\ No newline at end of file
@@ -0,0 +1,183 @@
+-- Wireshark dissector for the Drexel Protocol (du-proto)
+--
+-- Load with:  wireshark -X lua_script:du-proto.lua capture.pcap
+--        or:  copy into your Wireshark personal plugins folder
+--
+-- A du-proto datagram is a dp_pdu header followed by dgram_sz bytes of
+-- payload.  The header is five C ints written in host byte order, which
+-- is little endian on every machine we run on:
+--
+--   offset  size  field
+--   0       4     proto_ver   DP_PROTO_VER_1
+--   4       4     mtype       bit field, see DP_MT_xxx in du-proto.h
+--   8       4     seqnum      byte sequence number
+--   12      4     dgram_sz    payload bytes after the header
+--   16      4     err_num     DP_ERROR_xxx, 0 when no error
+--   20      ...   payload
+--
+-- When mtype has DP_MT_STREAM (128) set the payload starts with a
+-- dp_stream_hdr, also little endian, and dgram_sz includes it:
+--
+--   0       2     stream_id
+--   2       2     flags       reserved
+--   4       4     stream_seq  byte offset within the stream
+--
+-- When mtype has DP_MT_BATCH (256) set the payload is a run of coalesced
+-- messages, each one a 2 byte little endian length and then the bytes.
+--
+-- When mtype has DP_MT_RPC (512) set the payload starts with a
+-- dp_rpc_hdr; SND is a request and ACK the response to the same call:
+--
+--   0       4     call_id
+--   4       4     flags       reserved
+--
+-- The dissector is bound to UDP port 2080 (the du-ftp default, and the
+-- server port du-pcap.c uses for unix/loopback captures) and also
+-- registered as a heuristic so other ports are picked up.
+
+local dp = Proto("duproto", "Drexel Protocol")
+
+local HDR_SZ = 20
+
+local mtype_bits = {
+    [1]  = "ACK",
+    [2]  = "SND",
+    [4]  = "CONNECT",
+    [8]  = "CLOSE",
+    [16] = "NACK",
+    [32] = "FRAGMENT",
+    [64] = "ERROR",
+    [128] = "STREAM",
+    [256] = "BATCH",
+    [512] = "RPC",
+}
+
+local STREAM_HDR_SZ = 8
+local RPC_HDR_SZ = 8
+
+local errors = {
+    [0]   = "DP_NO_ERROR",
+    [-1]  = "DP_ERROR_GENERAL",
+    [-2]  = "DP_ERROR_PROTOCOL",
+    [-4]  = "DP_BUFF_UNDERSIZED",
+    [-8]  = "DP_BUFF_OVERSIZED",
+    [-16] = "DP_CONNECTION_CLOSED",
+    [-32] = "DP_ERROR_BAD_DGRAM",
+    [-64] = "DP_ERROR_TIMEOUT",
+    [-128] = "DP_ERROR_BUSY",
+    [-256] = "DP_ERROR_INTEGRITY",
+}
+
+local f = dp.fields
+f.ver      = ProtoField.int32("duproto.ver", "Version")
+f.mtype    = ProtoField.uint32("duproto.mtype", "Msg Type", base.HEX)
+f.ack      = ProtoField.bool("duproto.mtype.ack", "ACK", 32, nil, 0x01)
+f.snd      = ProtoField.bool("duproto.mtype.snd", "SND", 32, nil, 0x02)
+f.connect  = ProtoField.bool("duproto.mtype.connect", "CONNECT", 32, nil, 0x04)
+f.close    = ProtoField.bool("duproto.mtype.close", "CLOSE", 32, nil, 0x08)
+f.nack     = ProtoField.bool("duproto.mtype.nack", "NACK", 32, nil, 0x10)
+f.frag     = ProtoField.bool("duproto.mtype.frag", "FRAGMENT", 32, nil, 0x20)
+f.err      = ProtoField.bool("duproto.mtype.error", "ERROR", 32, nil, 0x40)
+f.stream   = ProtoField.bool("duproto.mtype.stream", "STREAM", 32, nil, 0x80)
+f.batch    = ProtoField.bool("duproto.mtype.batch", "BATCH", 32, nil, 0x100)
+f.rpc      = ProtoField.bool("duproto.mtype.rpc", "RPC", 32, nil, 0x200)
+f.seq      = ProtoField.int32("duproto.seq", "Seq Numb")
+f.size     = ProtoField.int32("duproto.size", "Msg Size")
+f.errnum   = ProtoField.int32("duproto.err", "Error", base.DEC, errors)
+f.sid      = ProtoField.uint16("duproto.stream.id", "Stream ID")
+f.sflags   = ProtoField.uint16("duproto.stream.flags", "Stream Flags", base.HEX)
+f.sseq     = ProtoField.uint32("duproto.stream.seq", "Stream Seq")
+f.callid   = ProtoField.uint32("duproto.rpc.call_id", "Call ID")
+f.rflags   = ProtoField.uint32("duproto.rpc.flags", "RPC Flags", base.HEX)
+f.payload  = ProtoField.bytes("duproto.payload", "Payload")
+f.msglen   = ProtoField.uint16("duproto.batch.len", "Message Length")
+f.msg      = ProtoField.bytes("duproto.batch.msg", "Message")
+
+local function mtype_name(mt)
+    local names = {}
+    for bit = 0, 9 do
+        local v = 2 ^ bit
+        if math.floor(mt / v) % 2 == 1 then
+            names[#names + 1] = mtype_bits[v]
+        end
+    end
+    if #names == 0 then return "UNKNOWN" end
+    return table.concat(names, "/")
+end
+
+function dp.dissector(buf, pinfo, tree)
+    if buf:len() < HDR_SZ then return 0 end
+
+    local mt = buf(4, 4):le_uint()
+    local sz = buf(12, 4):le_int()
+
+    pinfo.cols.protocol = "DU-PROTO"
+    pinfo.cols.info = string.format("%s seq=%d len=%d", mtype_name(mt),
+        buf(8, 4):le_int(), sz)
+
+    local t = tree:add(dp, buf(0, HDR_SZ), "Drexel Protocol, " .. mtype_name(mt))
+    t:add_le(f.ver, buf(0, 4))
+    local mtree = t:add_le(f.mtype, buf(4, 4))
+    mtree:append_text(" (" .. mtype_name(mt) .. ")")
+    for _, fld in ipairs({f.ack, f.snd, f.connect, f.close, f.nack, f.frag, f.err, f.stream, f.batch, f.rpc}) do
+        mtree:add_le(fld, buf(4, 4))
+    end
+    t:add_le(f.seq, buf(8, 4))
+    t:add_le(f.size, buf(12, 4))
+    t:add_le(f.errnum, buf(16, 4))
+
+    local off = HDR_SZ
+    if math.floor(mt / 128) % 2 == 1 and buf:len() >= HDR_SZ + STREAM_HDR_SZ then
+        local st = t:add(buf(HDR_SZ, STREAM_HDR_SZ), "Stream Header")
+        st:add_le(f.sid, buf(HDR_SZ, 2))
+        st:add_le(f.sflags, buf(HDR_SZ + 2, 2))
+        st:add_le(f.sseq, buf(HDR_SZ + 4, 4))
+        pinfo.cols.info:append(string.format(" stream=%d", buf(HDR_SZ, 2):le_uint()))
+        off = off + STREAM_HDR_SZ
+        sz = sz - STREAM_HDR_SZ
+    end
+
+    if math.floor(mt / 512) % 2 == 1 and buf:len() >= HDR_SZ + RPC_HDR_SZ then
+        local rt = t:add(buf(HDR_SZ, RPC_HDR_SZ), "RPC Header")
+        rt:add_le(f.callid, buf(HDR_SZ, 4))
+        rt:add_le(f.rflags, buf(HDR_SZ + 4, 4))
+        pinfo.cols.info:append(string.format(" call=%d", buf(HDR_SZ, 4):le_uint()))
+        off = off + RPC_HDR_SZ
+        sz = sz - RPC_HDR_SZ
+    end
+
+    if math.floor(mt / 256) % 2 == 1 then
+        local last = off + math.min(sz, buf:len() - off)
+        local count = 0
+        while off + 2 <= last do
+            local len = buf(off, 2):le_uint()
+            if off + 2 + len > last then break end
+            local mtree = tree:add(buf(off, 2 + len), "Coalesced Message")
+            mtree:add_le(f.msglen, buf(off, 2))
+            if len > 0 then mtree:add(f.msg, buf(off + 2, len)) end
+            off = off + 2 + len
+            count = count + 1
+        end
+        pinfo.cols.info:append(string.format(" msgs=%d", count))
+    elseif sz > 0 and buf:len() > off then
+        local n = math.min(sz, buf:len() - off)
+        tree:add(f.payload, buf(off, n))
+    end
+    return buf:len()
+end
+
+local function heuristic(buf, pinfo, tree)
+    if buf:len() < HDR_SZ then return false end
+    -- dpconnect() leaves proto_ver at 0, everything else sends 1
+    local ver = buf(0, 4):le_int()
+    if ver ~= 0 and ver ~= 1 then return false end
+    local mt = buf(4, 4):le_uint()
+    if mt == 0 or mt > 1023 then return false end
+    local sz = buf(12, 4):le_int()
+    if sz < 0 or HDR_SZ + sz > buf:len() then return false end
+    dp.dissector(buf, pinfo, tree)
+    return true
+end
+
+DissectorTable.get("udp.port"):add(2080, dp)
+dp:register_heuristic("udp", heuristic)
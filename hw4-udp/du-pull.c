@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "du-pull.h"
+#include "du-batch.h"
+
+/*
+ *  Client side.  Sends the request and returns DP_NO_ERROR with the size
+ *  that is coming, or DP_ERROR_GENERAL if the server has no such file.
+ */
+int dppull_request(dp_connp dpc, const char *path, uint64_t *size){
+    dp_pull_req req = { .magic = DP_PULL_MAGIC };
+    dp_pull_rsp rsp;
+    int rc;
+
+    int len = strlen(path) + 1;
+    if (len > DP_PULL_PATH_SZ)
+        return DP_ERROR_GENERAL;
+    memcpy(req.path, path, len);
+    if ((rc = dpsend(dpc, &req, offsetof(dp_pull_req, path) + len)) < 0)
+        return rc;
+    if ((rc = dprecv(dpc, &rsp, sizeof(rsp))) != sizeof(rsp) || rsp.magic != DP_PULL_MAGIC)
+        return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+    if (rsp.status != DP_PULL_OK) {
+        printf("ERROR: server %s %s\n",
+            rsp.status == DP_PULL_BAD_PATH ? "refused the path" : "has no file", path);
+        return DP_ERROR_GENERAL;
+    }
+    *size = rsp.size;
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Takes the size bytes dppull_request() announced.  A file that cannot
+ *  be written, or has no writer at all, is still read to its end so the
+ *  session can go on with the next one, and gives DP_ERROR_GENERAL.
+ */
+int dppull_recv(dp_connp dpc, dp_writer *w, uint64_t size, dp_progress *p){
+    static char buff[DP_PULL_CHUNK];
+    uint64_t got = 0;
+    bool failed = w == NULL;
+
+    while (got < size) {
+        int rc = dprecv(dpc, buff, sizeof(buff));
+        if (rc < 0)
+            return rc;
+        if (rc == 0 || rc > size - got)
+            return DP_ERROR_PROTOCOL;
+        if (!failed && dpwriter_write(w, buff, rc) < 0)
+            failed = true;
+        got += rc;
+        dpprogress_add(p, rc);
+    }
+    return failed ? DP_ERROR_GENERAL : DP_NO_ERROR;
+}
+
+/*
+ *  Answers one request, from the cache or, for a file too big for it,
+ *  with pread()s.  Returns 1 if there is no such file, which the client
+ *  has been told, or < 0 if the session cannot go on; DP_CONNECTION_CLOSED
+ *  if it hung up because the file shrank mid transfer.
+ */
+static int send_file(dp_connp dpc, const char *path, dp_cache *cache){
+    static __thread char buff[DP_PULL_CHUNK];       //pooled sessions run at once
+    dp_pull_rsp rsp = { .magic = DP_PULL_MAGIC, .status = DP_PULL_OK };
+    const void *data = NULL;
+    dp_cache_ent *e = NULL;
+    struct stat st;
+    int rc;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0)
+            close(fd);
+        rsp.status = DP_PULL_NOT_FOUND;
+        rc = dpsend(dpc, &rsp, sizeof(rsp));
+        return rc < 0 ? rc : 1;
+    }
+    rsp.size = st.st_size;
+    e = dpcache_get(cache, path, fd, &st, &data);
+    rc = dpsend(dpc, &rsp, sizeof(rsp));
+    for (uint64_t off = 0; rc >= 0 && off < rsp.size; off += rc) {
+        int n = rsp.size - off < DP_PULL_CHUNK ? rsp.size - off : DP_PULL_CHUNK;
+        if (e != NULL) {
+            //dpsend() only reads the buffer, so this is the cached copy itself
+            rc = dpsend(dpc, (char *)data + off, n);
+            continue;
+        }
+        if (pread(fd, buff, n, off) != n) {
+            //shrank after we announced its size, all we can do is hang up
+            printf("ERROR: %s changed while it was being served, closing\n", path);
+            dpdisconnect(dpc);
+            rc = DP_CONNECTION_CLOSED;
+            break;
+        }
+        rc = dpsend(dpc, buff, n);
+    }
+    dpcache_put(cache, e);
+    close(fd);
+    return rc < 0 ? rc : DP_NO_ERROR;
+}
+
+/*
+ *  Server side.  Answers requests for files under root until the client
+ *  closes the connection, or the server has to, which also frees dpc.
+ *  served counts the files sent in full.
+ */
+int dppull_serve(dp_connp dpc, const char *root, dp_cache *cache, uint32_t *served){
+    dp_pull_req req;
+    char path[DP_PULL_PATH_SZ + 256];
+    int rc;
+
+    *served = 0;
+    while ((rc = dprecv(dpc, &req, sizeof(req))) >= 0) {
+        int len = rc - (int)offsetof(dp_pull_req, path);
+        if (len < 0 || req.magic != DP_PULL_MAGIC)
+            return DP_ERROR_PROTOCOL;
+        if (!dpbatch_path_ok(req.path, len)) {
+            dp_pull_rsp rsp = { .magic = DP_PULL_MAGIC, .status = DP_PULL_BAD_PATH };
+            printf("ERROR: refused to serve a path outside %s\n", root);
+            if ((rc = dpsend(dpc, &rsp, sizeof(rsp))) < 0)
+                return rc;
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", root, req.path);
+        rc = send_file(dpc, path, cache);
+        if (rc < 0)
+            return rc;
+        if (rc == 1)
+            printf("ERROR: no file %s to serve\n", path);
+        else
+            (*served)++;
+    }
+    return rc;
+}
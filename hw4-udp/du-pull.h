@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "du-proto.h"
+#include "du-write.h"
+#include "du-cache.h"
+#include "du-progress.h"
+
+/*
+ *  Pull (-F) sessions, the client fetches files from the server instead
+ *  of pushing one to it.  Each fetch is a dp_pull_req naming a path
+ *  relative to the server's root, answered by a dp_pull_rsp and, when
+ *  its status is DP_PULL_OK, exactly size bytes of file in messages of
+ *  up to DP_PULL_CHUNK.  The client may ask again on the same connection
+ *  and closes it when done; that close also runs the end to end CRC, so
+ *  the client keeps what it got only if dpdisconnect() says so.
+ *
+ *  The server sends straight out of its dp_cache, see du-cache.h.
+ */
+#define DP_PULL_MAGIC       0x4c4c5044      //"DPLL"
+#define DP_PULL_CHUNK       (60 * 1024)
+#define DP_PULL_PATH_SZ     1024            //same limit as batch paths
+
+#define DP_PULL_OK          0
+#define DP_PULL_NOT_FOUND   1
+#define DP_PULL_BAD_PATH    2
+
+typedef struct dp_pull_req {
+    uint32_t    magic;
+    uint32_t    pad;
+    char        path[DP_PULL_PATH_SZ];  //NUL terminated, only this much is sent
+} dp_pull_req;
+
+typedef struct dp_pull_rsp {
+    uint32_t    magic;
+    uint32_t    status;                 //DP_PULL_xxx
+    uint64_t    size;                   //bytes that follow
+} dp_pull_rsp;
+
+int dppull_request(dp_connp dpc, const char *path, uint64_t *size);
+int dppull_recv(dp_connp dpc, dp_writer *w, uint64_t size, dp_progress *p);
+int dppull_serve(dp_connp dpc, const char *root, dp_cache *cache, uint32_t *served);
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "du-rate.h"
+
+#define WEIGHT_SCALE    64              //virtual time per byte at weight 1
+
+typedef struct dp_bucket {
+    uint64_t        rate;               //bytes per second, 0 = no limit
+    double          burst;
+    double          tokens;             //negative while paying off a datagram
+    uint64_t        lastNs;
+} dp_bucket;
+
+struct dp_sched {
+    pthread_mutex_t lock;
+    pthread_cond_t  turn;               //the head of the line changed
+    dp_bucket       bucket;
+    uint64_t        vclock;             //start tag of the last datagram let out
+    dp_flow         *flows;
+};
+
+struct dp_flow {
+    dp_sched        *s;
+    dp_flow         *next;
+    pthread_mutex_t lock;               //the connections of a transfer take turns
+    dp_bucket       bucket;
+    int             weight;
+    uint64_t        vtime;              //finish tag of its last datagram
+    uint64_t        tag;                //start tag of the one waiting
+    bool            waiting;
+};
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bucket_init(dp_bucket *b, uint64_t rate){
+    b->rate = rate;
+    b->burst = rate / 20 > DP_RATE_MIN_BURST ? rate / 20 : DP_RATE_MIN_BURST;
+    b->tokens = b->burst;
+    b->lastNs = now_ns();
+}
+
+static void bucket_refill(dp_bucket *b, uint64_t now){
+    b->tokens += (now - b->lastNs) * (double)b->rate / 1e9;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->lastNs = now;
+}
+
+//ns until the bucket holds bytes, 0 if it already does
+static uint64_t bucket_wait(dp_bucket *b, int bytes){
+    if (b->tokens >= bytes)
+        return 0;
+    return (uint64_t)((bytes - b->tokens) * 1e9 / b->rate) + 1;
+}
+
+dp_sched *dpsched_new(uint64_t rate){
+    pthread_condattr_t ca;
+    dp_sched *s = calloc(1, sizeof(dp_sched));
+
+    if (s == NULL)
+        return NULL;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->turn, &ca);
+    pthread_condattr_destroy(&ca);
+    bucket_init(&s->bucket, rate);
+    return s;
+}
+
+//s may be NULL and rate 0, a flow with neither never waits
+dp_flow *dpflow_new(dp_sched *s, uint64_t rate, int trafficClass){
+    dp_flow *f = calloc(1, sizeof(dp_flow));
+
+    if (f == NULL)
+        return NULL;
+    f->s = s;
+    f->weight = trafficClass == DP_CLASS_BACKGROUND ?
+                DP_WEIGHT_BACKGROUND : DP_WEIGHT_INTERACTIVE;
+    pthread_mutex_init(&f->lock, NULL);
+    bucket_init(&f->bucket, rate);
+    if (s != NULL) {
+        pthread_mutex_lock(&s->lock);
+        f->vtime = s->vclock;
+        f->next = s->flows;
+        s->flows = f;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return f;
+}
+
+//Only once no connection uses it any more
+void dpflow_free(dp_flow *f){
+    if (f == NULL)
+        return;
+    if (f->s != NULL) {
+        pthread_mutex_lock(&f->s->lock);
+        for (dp_flow **p = &f->s->flows; *p != NULL; p = &(*p)->next)
+            if (*p == f) {
+                *p = f->next;
+                break;
+            }
+        pthread_mutex_unlock(&f->s->lock);
+    }
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+void dpflow_attach(dp_connp dp, dp_flow *f){
+    dp->flow = f;
+}
+
+static bool sched_first(dp_sched *s, dp_flow *f){
+    for (dp_flow *g = s->flows; g != NULL; g = g->next)
+        if (g != f && g->waiting && (g->tag < f->tag || (g->tag == f->tag && g < f)))
+            return false;
+    return true;
+}
+
+//Waits for the flow's turn and for the shared bucket to cover bytes
+static void sched_take(dp_sched *s, dp_flow *f, int bytes){
+    pthread_mutex_lock(&s->lock);
+    f->tag = f->vtime > s->vclock ? f->vtime : s->vclock;
+    f->waiting = true;
+    pthread_cond_broadcast(&s->turn);
+
+    for (;;) {
+        if (!sched_first(s, f)) {
+            pthread_cond_wait(&s->turn, &s->lock);
+            continue;
+        }
+        uint64_t now = now_ns();
+        bucket_refill(&s->bucket, now);
+        uint64_t waitNs = bucket_wait(&s->bucket, bytes);
+        if (waitNs == 0)
+            break;
+        //a newcomer with an earlier tag wakes us to go back in line
+        uint64_t until = now + waitNs;
+        struct timespec ts = { .tv_sec = until / 1000000000, .tv_nsec = until % 1000000000 };
+        pthread_cond_timedwait(&s->turn, &s->lock, &ts);
+    }
+    s->bucket.tokens -= bytes;
+    s->vclock = f->tag;
+    f->vtime = f->tag + (uint64_t)bytes * WEIGHT_SCALE / f->weight;
+    f->waiting = false;
+    pthread_cond_broadcast(&s->turn);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void dpflow_acquire(dp_flow *f, int bytes){
+    if (f == NULL || bytes <= 0)
+        return;
+    pthread_mutex_lock(&f->lock);
+    if (f->bucket.rate > 0) {
+        bucket_refill(&f->bucket, now_ns());
+        uint64_t waitNs = bucket_wait(&f->bucket, bytes);
+        if (waitNs > 0) {
+            struct timespec ts = { .tv_sec = waitNs / 1000000000,
+                                   .tv_nsec = waitNs % 1000000000 };
+            nanosleep(&ts, NULL);
+            bucket_refill(&f->bucket, now_ns());
+        }
+        f->bucket.tokens -= bytes;
+    }
+    if (f->s != NULL && f->s->bucket.rate > 0)
+        sched_take(f->s, f, bytes);
+    pthread_mutex_unlock(&f->lock);
+}
+
+//Bytes per second with an optional K, M or G, 0 on success
+int dprate_parse(const char *s, uint64_t *rate){
+    char *end;
+    double v = strtod(s, &end);
+
+    if (end == s || v <= 0)
+        return DP_ERROR_GENERAL;
+    switch (*end) {
+        case 'G': case 'g': v *= 1024; //fall through
+        case 'M': case 'm': v *= 1024; //fall through
+        case 'K': case 'k': v *= 1024; end++; break;
+        case '\0': break;
+        default: return DP_ERROR_GENERAL;
+    }
+    if (*end != '\0')
+        return DP_ERROR_GENERAL;
+    *rate = (uint64_t)v;
+    return DP_NO_ERROR;
+}
+
+//"interactive" or "background", -1 for anything else
+int dprate_parse_class(const char *name){
+    if (strcmp(name, "interactive") == 0)
+        return DP_CLASS_INTERACTIVE;
+    if (strcmp(name, "background") == 0)
+        return DP_CLASS_BACKGROUND;
+    return -1;
+}
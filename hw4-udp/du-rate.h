@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "du-proto.h"
+
+/*
+ *  Bandwidth control.  A dp_flow is one transfer: it may have its own
+ *  cap (a token bucket) and belong to a dp_sched, a cap shared by every
+ *  transfer in the process.  Under the shared cap datagrams go out in
+ *  weighted fair order (start time fair queuing): each flow's virtual
+ *  time advances by bytes / weight, and whoever waits with the smallest
+ *  one goes next.  An interactive flow counts as DP_WEIGHT_INTERACTIVE
+ *  background ones, so while both are busy they split the cap 8:1 and a
+ *  background sync still gets about a ninth of it.  This is a weighted
+ *  share, not strict priority.  A flow running alone takes the whole cap.
+ *
+ *  du-proto calls dpflow_acquire() for the payload of every datagram it
+ *  sends, and for every one it receives before it ACKs it, so a receiver
+ *  can slow a sender down too.  The traffic class of a client travels in
+ *  its CONNECT (see dp_connect_opts) and lands in the server session's
+ *  trafficClass.
+ */
+#define DP_CLASS_INTERACTIVE    0
+#define DP_CLASS_BACKGROUND     1
+
+#define DP_WEIGHT_INTERACTIVE   8
+#define DP_WEIGHT_BACKGROUND    1
+
+#define DP_RATE_MIN_BURST       (128 * 1024)    //more than the largest datagram
+
+typedef struct dp_sched dp_sched;
+typedef struct dp_flow dp_flow;
+
+dp_sched *dpsched_new(uint64_t rate);
+dp_flow  *dpflow_new(dp_sched *s, uint64_t rate, int trafficClass);
+void      dpflow_free(dp_flow *f);
+void      dpflow_attach(dp_connp dp, dp_flow *f);
+void      dpflow_acquire(dp_flow *f, int bytes);
+
+int dprate_parse(const char *s, uint64_t *rate);
+int dprate_parse_class(const char *name);
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "du-resume.h"
+
+#define RESUME_MSG_SZ       (64 * 1024)     //hash lists and bitmaps go in pieces
+
+//Start of the sidecar, followed by the bitmap and then the chunk hashes
+typedef struct resume_sidecar {
+    uint32_t    magic;
+    uint32_t    chunk_sz;
+    uint64_t    file_size;
+    uint32_t    chunk_count;
+    uint32_t    pad;
+} resume_sidecar;
+
+//64 bit FNV-1a, update() continues a hash started at DP_RESUME_HASH_INIT
+uint64_t dpresume_hash_update(uint64_t h, const void *data, int len){
+    const unsigned char *p = data;
+
+    for (int i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+uint64_t dpresume_hash(const void *data, int len){
+    return dpresume_hash_update(DP_RESUME_HASH_INIT, data, len);
+}
+
+static int send_all(dp_connp dpc, void *buff, uint64_t len){
+    char *p = buff;
+
+    while (len > 0) {
+        int n = len < RESUME_MSG_SZ ? len : RESUME_MSG_SZ;
+        int rc = dpsend(dpc, p, n);
+        if (rc < 0)
+            return rc;
+        p += n;
+        len -= n;
+    }
+    return DP_NO_ERROR;
+}
+
+static int recv_all(dp_connp dpc, void *buff, uint64_t len){
+    char *p = buff;
+
+    while (len > 0) {
+        int want = len < RESUME_MSG_SZ ? len : RESUME_MSG_SZ;
+        int rc = dprecv(dpc, p, want);
+        if (rc < 0)
+            return rc;
+        if (rc == 0)
+            return DP_ERROR_PROTOCOL;
+        p += rc;
+        len -= rc;
+    }
+    return DP_NO_ERROR;
+}
+
+static int chunk_len(uint64_t fileSz, uint32_t idx){
+    uint64_t off = (uint64_t)idx * DP_RESUME_CHUNK_SZ;
+    return fileSz - off < DP_RESUME_CHUNK_SZ ? fileSz - off : DP_RESUME_CHUNK_SZ;
+}
+
+/*
+ *  Client side.  Hashes the whole file, asks the server what it is missing
+ *  and sends only that.  The caller still owns and disconnects dpc.
+ */
+int dpresume_send(dp_connp dpc, const char *path, dp_progress *p){
+    struct stat st;
+    dp_resume_req req;
+    dp_resume_rsp rsp;
+    uint64_t *hashes = NULL;
+    unsigned char *need = NULL;
+    char *buff = NULL;
+    uint64_t bytesSent = 0;
+    int rc = DP_ERROR_GENERAL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("ERROR:  Cannot open file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return DP_ERROR_GENERAL;
+    }
+    req.file_size = st.st_size;
+    req.chunk_sz = DP_RESUME_CHUNK_SZ;
+    req.chunk_count = (st.st_size + DP_RESUME_CHUNK_SZ - 1) / DP_RESUME_CHUNK_SZ;
+
+    hashes = malloc((uint64_t)req.chunk_count * sizeof(uint64_t) + 1);
+    need = malloc((req.chunk_count + 7) / 8 + 1);
+    buff = malloc(sizeof(dp_resume_chunk) + DP_RESUME_CHUNK_SZ);
+    if (hashes == NULL || need == NULL || buff == NULL)
+        goto done;
+
+    char *data = buff + sizeof(dp_resume_chunk);
+    for (uint32_t i = 0; i < req.chunk_count; i++) {
+        int len = chunk_len(req.file_size, i);
+        if (pread(fd, data, len, (off_t)i * DP_RESUME_CHUNK_SZ) != len) {
+            perror("resume: reading file to hash it failed");
+            goto done;
+        }
+        hashes[i] = dpresume_hash(data, len);
+    }
+
+    if ((rc = dpsend(dpc, &req, sizeof(req))) < 0 ||
+        (rc = send_all(dpc, hashes, (uint64_t)req.chunk_count * sizeof(uint64_t))) < 0)
+        goto done;
+    if ((rc = dprecv(dpc, &rsp, sizeof(rsp))) != sizeof(rsp)) {
+        rc = rc < 0 ? rc : DP_ERROR_PROTOCOL;
+        goto done;
+    }
+    if ((rc = recv_all(dpc, need, (req.chunk_count + 7) / 8)) < 0)
+        goto done;
+    dpinfo("Resume: server needs %u of %u chunks\n", rsp.missing, req.chunk_count);
+
+    for (uint32_t i = 0; i < req.chunk_count; i++) {
+        if (!(need[i / 8] & (1 << (i % 8))))
+            continue;
+        dp_resume_chunk *hdr = (dp_resume_chunk *)buff;
+        hdr->idx = i;
+        hdr->len = chunk_len(req.file_size, i);
+        if (pread(fd, data, hdr->len, (off_t)i * DP_RESUME_CHUNK_SZ) != hdr->len) {
+            perror("resume: reading chunk failed");
+            rc = DP_ERROR_GENERAL;
+            goto done;
+        }
+        if ((rc = dpsend(dpc, buff, sizeof(dp_resume_chunk) + hdr->len)) < 0)
+            goto done;
+        bytesSent += hdr->len;
+        dpprogress_add(p, hdr->len);
+    }
+    dpinfo("Summary: Bytes Sent: %llu of %llu\n", (unsigned long long)bytesSent,
+        (unsigned long long)req.file_size);
+    rc = DP_NO_ERROR;
+
+done:
+    free(hashes);
+    free(need);
+    free(buff);
+    close(fd);
+    return rc;
+}
+
+//Loads the sidecar if it describes this same transfer, else starts a new one
+static int sidecar_open(const char *path, dp_resume_req *req, unsigned char *have,
+                        uint64_t *haveHash, bool *isNew){
+    resume_sidecar hdr;
+    int bitmapSz = (req->chunk_count + 7) / 8;
+    uint64_t hashSz = (uint64_t)req->chunk_count * sizeof(uint64_t);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+
+    *isNew = true;
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic == DP_RESUME_MAGIC && hdr.chunk_sz == req->chunk_sz &&
+        hdr.file_size == req->file_size && hdr.chunk_count == req->chunk_count &&
+        pread(fd, have, bitmapSz, sizeof(hdr)) == bitmapSz &&
+        pread(fd, haveHash, hashSz, sizeof(hdr) + bitmapSz) == hashSz) {
+        *isNew = false;
+        return fd;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = DP_RESUME_MAGIC;
+    hdr.chunk_sz = req->chunk_sz;
+    hdr.file_size = req->file_size;
+    hdr.chunk_count = req->chunk_count;
+    memset(have, 0, bitmapSz);
+    if (ftruncate(fd, 0) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        ftruncate(fd, sizeof(hdr) + bitmapSz + hashSz) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ *  Server side.  Runs until the client closes the connection, which also
+ *  frees dpc.  The file is complete when this prints so and the sidecar
+ *  is gone, otherwise running the transfer again picks up from here.
+ */
+int dpresume_recv(dp_connp dpc, const char *path, dp_progress *p){
+    char scPath[256];
+    dp_resume_req req;
+    dp_resume_rsp rsp = {0};
+    uint64_t *hashes = NULL, *haveHash = NULL;
+    unsigned char *have = NULL, *need = NULL;
+    char *buff = NULL;
+    int fd = -1, sc = -1;
+    bool isNew;
+    int rc;
+
+    if ((rc = dprecv(dpc, &req, sizeof(req))) != sizeof(req))
+        return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+    if (req.chunk_sz != DP_RESUME_CHUNK_SZ ||
+        req.chunk_count != (req.file_size + DP_RESUME_CHUNK_SZ - 1) / DP_RESUME_CHUNK_SZ) {
+        printf("ERROR: resume request for %u chunks of %u bytes does not add up\n",
+            req.chunk_count, req.chunk_sz);
+        return DP_ERROR_PROTOCOL;
+    }
+    int bitmapSz = (req.chunk_count + 7) / 8;
+    uint64_t hashSz = (uint64_t)req.chunk_count * sizeof(uint64_t);
+
+    rc = DP_ERROR_GENERAL;
+    hashes = malloc(hashSz + 1);
+    haveHash = malloc(hashSz + 1);
+    have = malloc(bitmapSz + 1);
+    need = calloc(1, bitmapSz + 1);
+    buff = malloc(sizeof(dp_resume_chunk) + DP_RESUME_CHUNK_SZ);
+    if (hashes == NULL || haveHash == NULL || have == NULL || need == NULL || buff == NULL)
+        goto done;
+    if ((rc = recv_all(dpc, hashes, hashSz)) < 0)
+        goto done;
+
+    snprintf(scPath, sizeof(scPath), "%s%s", path, DP_RESUME_SUFFIX);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    sc = fd < 0 ? -1 : sidecar_open(scPath, &req, have, haveHash, &isNew);
+    if (fd < 0 || sc < 0) {
+        printf("ERROR:  Cannot open file %s or %s\n", path, scPath);
+        rc = DP_ERROR_GENERAL;
+        goto done;
+    }
+    if (isNew && ftruncate(fd, req.file_size) < 0) {
+        perror("resume: sizing the file failed");
+        rc = DP_ERROR_GENERAL;
+        goto done;
+    }
+
+    //a chunk we have counts only if it is still what the client has
+    char *data = buff + sizeof(dp_resume_chunk);
+    for (uint32_t i = 0; i < req.chunk_count; i++) {
+        bool ok = false;
+        if ((have[i / 8] & (1 << (i % 8))) && haveHash[i] == hashes[i]) {
+            int len = chunk_len(req.file_size, i);
+            ok = pread(fd, data, len, (off_t)i * DP_RESUME_CHUNK_SZ) == len &&
+                 dpresume_hash(data, len) == hashes[i];
+        }
+        if (!ok) {
+            need[i / 8] |= 1 << (i % 8);
+            rsp.missing++;
+        }
+    }
+    dpinfo("Resume: %s, need %u of %u chunks\n", isNew ? "new transfer" : "resuming",
+        rsp.missing, req.chunk_count);
+    if ((rc = dpsend(dpc, &rsp, sizeof(rsp))) < 0 ||
+        (rc = send_all(dpc, need, bitmapSz)) < 0)
+        goto done;
+
+    while (1) {
+        rc = dprecv(dpc, buff, sizeof(dp_resume_chunk) + DP_RESUME_CHUNK_SZ);
+        if (rc == DP_CONNECTION_CLOSED)
+            break;
+        if (rc < (int)sizeof(dp_resume_chunk))
+            goto done;
+
+        dp_resume_chunk *hdr = (dp_resume_chunk *)buff;
+        uint32_t i = hdr->idx;
+        if (i >= req.chunk_count || hdr->len != chunk_len(req.file_size, i) ||
+            rc != sizeof(dp_resume_chunk) + hdr->len) {
+            printf("ERROR: bad resume chunk %u\n", i);
+            rc = DP_ERROR_PROTOCOL;
+            goto done;
+        }
+        if (pwrite(fd, data, hdr->len, (off_t)i * DP_RESUME_CHUNK_SZ) != hdr->len) {
+            perror("resume: writing chunk failed");
+            rc = DP_ERROR_GENERAL;
+            goto done;
+        }
+        dpprogress_add(p, hdr->len);
+        uint64_t h = dpresume_hash(data, hdr->len);
+        if (h != hashes[i]) {
+            printf("Resume: chunk %u does not match its hash, not marking it\n", i);
+            continue;
+        }
+
+        //no fsync per chunk, a bit that outlived its data fails the disk
+        //hash check on the next resume and the chunk is sent again
+        have[i / 8] |= 1 << (i % 8);
+        off_t bitOff = sizeof(resume_sidecar) + i / 8;
+        off_t hashOff = sizeof(resume_sidecar) + bitmapSz + (off_t)i * sizeof(uint64_t);
+        if (pwrite(sc, &h, sizeof(h), hashOff) != sizeof(h) ||
+            pwrite(sc, &have[i / 8], 1, bitOff) != 1) {
+            perror("resume: updating sidecar failed");
+            rc = DP_ERROR_GENERAL;
+            goto done;
+        }
+        if (need[i / 8] & (1 << (i % 8))) {
+            need[i / 8] &= ~(1 << (i % 8));
+            rsp.missing--;
+        }
+    }
+
+    if (rsp.missing == 0) {
+        fsync(fd);
+        unlink(scPath);
+        dpinfo("Resume: file complete\n");
+    } else {
+        fsync(fd);
+        fsync(sc);
+        dpinfo("Resume: %u chunks still missing, run the transfer again to finish\n",
+            rsp.missing);
+    }
+    rc = DP_CONNECTION_CLOSED;
+
+done:
+    if (fd >= 0)
+        close(fd);
+    if (sc >= 0)
+        close(sc);
+    free(hashes);
+    free(haveHash);
+    free(have);
+    free(need);
+    free(buff);
+    return rc;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "du-proto.h"
+#include "du-progress.h"
+
+/*
+ *  Resumable file transfers for du-ftp.  The file is split into
+ *  DP_RESUME_CHUNK_SZ chunks.  The receiver keeps a sidecar next to the
+ *  file (<file>DP_RESUME_SUFFIX) with a bitmap of the chunks it has and a
+ *  hash of each, updated as chunks land, so a transfer that dies can be
+ *  picked up again.
+ *
+ *  Exchange, all over one du-proto connection:
+ *      client -> dp_resume_req, then chunk_count hashes of its file
+ *      server -> dp_resume_rsp, then a bitmap of the chunks it still needs
+ *      client -> dp_resume_chunk + data, for each needed chunk
+ *      client closes the connection
+ *
+ *  A chunk the server has only counts if its sidecar hash and the hash of
+ *  what is on disk both match the client's, so a changed source file or a
+ *  chunk torn by a crash is just sent again.  The sidecar is removed once
+ *  every chunk is in.
+ */
+#define DP_RESUME_CHUNK_SZ      (32 * 1024)
+#define DP_RESUME_SUFFIX        ".dpresume"
+#define DP_RESUME_MAGIC         0x53525044      //"DPRS"
+#define DP_RESUME_HASH_INIT     0xcbf29ce484222325ull
+
+typedef struct dp_resume_req {
+    uint64_t    file_size;
+    uint32_t    chunk_sz;
+    uint32_t    chunk_count;
+} dp_resume_req;
+
+typedef struct dp_resume_rsp {
+    uint32_t    missing;            //chunks the server still needs
+    uint32_t    flags;              //reserved, 0
+} dp_resume_rsp;
+
+typedef struct dp_resume_chunk {
+    uint32_t    idx;
+    uint32_t    len;
+} dp_resume_chunk;
+
+uint64_t dpresume_hash(const void *data, int len);
+uint64_t dpresume_hash_update(uint64_t h, const void *data, int len);
+int dpresume_send(dp_connp dpc, const char *path, dp_progress *p);
+int dpresume_recv(dp_connp dpc, const char *path, dp_progress *p);
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <unistd.h> 
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "du-proto.h"
+#include "du-loop.h"
+
+/*
+ *  du-sim runs du-proto transfers over the in memory loopback transport
+ *  and reports protocol performance in virtual time.  Nothing touches the
+ *  network or sleeps, so thousands of transfers run per second and the
+ *  same parameters always give the same numbers.
+ */
+
+#define SIM_DEF_XFERS       100
+#define SIM_DEF_XFER_SZ     (256 * 1024)
+#define SIM_DEF_MSG_SZ      5000
+#define SIM_MAX_MSG_SZ      (64 * 1024)
+
+typedef struct sim_config {
+    int         xfers;
+    int         xferSz;
+    int         msgSz;
+    int         coalesceUs;
+    int         rpcDepth;               //0 = plain dpsend() stream
+    bool        streams;                //bulk on one stream, a small message on another
+    dp_loop_cfg link;
+} sim_config;
+
+typedef struct sim_server {
+    dp_connp    dpc;
+    bool        rpc;
+    bool        streams;
+    long        bytesIn;
+    int         bulkSeen;               //stream messages, in the order they came
+    int         ctlAfter;               //bulk messages ahead of the small one, -1 = none
+    bool        outOfOrder;
+    int         rc;
+} sim_server;
+
+#define SIM_STREAM_BULK     1
+#define SIM_STREAM_CTL      2
+#define SIM_CTL_MSG_SZ      64
+
+static int maxCtlAfter;                 //worst case over all transfers
+
+#define SIM_RPC_TIMEOUT_MS  1000
+
+//Sends the transfer as RPCs, keeping up to rpcDepth calls in flight
+static int rpc_xfer(sim_config *cfg, dp_connp cli, char *sBuff){
+    int calls[DP_RPC_MAX_INFLIGHT];
+    int head = 0, inFlight = 0, sent = 0;
+
+    while (sent < cfg->xferSz || inFlight > 0) {
+        if (sent < cfg->xferSz && inFlight < cfg->rpcDepth) {
+            int sz = cfg->xferSz - sent < cfg->msgSz ? cfg->xferSz - sent : cfg->msgSz;
+            int id = dprpc_call_async(cli, sBuff, sz);
+            if (id < 0) {
+                printf("ERROR: simulated dprpc_call_async failed with %d\n", id);
+                exit(-1);
+            }
+            calls[(head + inFlight++) % cfg->rpcDepth] = id;
+            sent += sz;
+            continue;
+        }
+        int got, rc = dprpc_wait(cli, calls[head], &got, sizeof(got), 
+                            SIM_RPC_TIMEOUT_MS);
+        if (rc != sizeof(got)) {
+            printf("ERROR: simulated dprpc_wait failed with %d\n", rc);
+            exit(-1);
+        }
+        head = (head + 1) % cfg->rpcDepth;
+        inFlight--;
+    }
+    return sent;
+}
+
+/*
+ *  Queues the transfer on the bulk stream as numbered messages, lets one
+ *  datagram of it out and only then queues a small message on the control
+ *  stream.  bulkBefore is how many bulk messages were already complete at
+ *  that point; the receiver should not see more than that ahead of the
+ *  small one.
+ */
+static int stream_xfer(sim_config *cfg, dp_connp cli, int *bulkBefore){
+    static char ctl[SIM_CTL_MSG_SZ];
+    int msgs = (cfg->xferSz + cfg->msgSz - 1) / cfg->msgSz;
+    char *bulk = malloc(cfg->xferSz);
+    int rc;
+
+    if (bulk == NULL) {
+        perror("stream transfer");
+        exit(-1);
+    }
+    for (int i = 0; i < msgs; i++) {
+        int off = i * cfg->msgSz;
+        int sz = cfg->xferSz - off < cfg->msgSz ? cfg->xferSz - off : cfg->msgSz;
+        memset(bulk + off, 'x', sz);
+        memcpy(bulk + off, &i, sizeof(i));
+        if ((rc = dpstream_send(cli, SIM_STREAM_BULK, bulk + off, sz)) < 0)
+            break;
+    }
+    if (rc >= 0)
+        rc = dpstream_pump(cli, 1);
+    *bulkBefore = (cfg->xferSz - dpstream_pending(cli, SIM_STREAM_BULK)) / cfg->msgSz;
+    if (rc >= 0)
+        rc = dpstream_send(cli, SIM_STREAM_CTL, ctl, sizeof(ctl));
+    if (rc >= 0)
+        rc = dpstream_flush(cli);
+    if (rc < 0) {
+        printf("ERROR: simulated stream send failed with %d\n", rc);
+        exit(-1);
+    }
+    free(bulk);
+    return cfg->xferSz + SIM_CTL_MSG_SZ;
+}
+
+static void usage(char *prog, sim_config *cfg){
+    printf("USAGE: %s [-n xfers] [-b bytes] [-m msg_sz] [-l latency_us] [-r rate_mbps] [-d dgram_sz] [-c delay_us] [-R depth] [-s] [-h]\n", prog);
+    printf("WHERE:\n\t[-n xfers] number of transfers to simulate; DEFAULT = %d\n", cfg->xfers);
+    printf("\t[-b bytes] bytes sent per transfer; DEFAULT = %d\n", cfg->xferSz);
+    printf("\t[-m msg_sz] bytes per dpsend() call; DEFAULT = %d\n", cfg->msgSz);
+    printf("\t[-l latency_us] one way link latency; DEFAULT = %lu\n", 
+        (unsigned long)(cfg->link.latencyNs / 1000));
+    printf("\t[-r rate_mbps] link rate, 0 is unlimited; DEFAULT = %lu\n", 
+        (unsigned long)(cfg->link.bytesPerSec * 8 / 1000000));
+    printf("\t[-d dgram_sz] max payload per datagram; DEFAULT = %d\n", DP_MAX_BUFF_SZ);
+    printf("\t[-c delay_us] coalesce small messages for up to delay_us; DEFAULT = off\n");
+    printf("\t[-R depth] send each message as an RPC, up to depth in flight, msg_sz must fit in a datagram; DEFAULT = off\n");
+    printf("\t[-s] streams, msg_sz messages on one stream and a small one on another, checks the\n");
+    printf("\t     small one is not held up behind them; not with -c or -R\n");
+    printf("\t[-h] displays what you are looking at now - the help\n\n");
+}
+
+static void initParams(int argc, char *argv[], sim_config *cfg){
+    int option;
+
+    cfg->xfers = SIM_DEF_XFERS;
+    cfg->xferSz = SIM_DEF_XFER_SZ;
+    cfg->msgSz = SIM_DEF_MSG_SZ;
+    cfg->coalesceUs = 0;
+    cfg->rpcDepth = 0;
+    cfg->streams = false;
+    cfg->link.latencyNs = DP_LOOP_DEF_LATENCY_NS;
+    cfg->link.bytesPerSec = DP_LOOP_DEF_BYTES_PER_SEC;
+    cfg->link.maxBuffSz = DP_MAX_BUFF_SZ;
+
+    while ((option = getopt(argc, argv, ":n:b:m:l:r:d:c:R:sh")) != -1){
+        switch(option) {
+            case 'n':
+                cfg->xfers = atoi(optarg);
+                break;
+            case 'b':
+                cfg->xferSz = atoi(optarg);
+                break;
+            case 'm':
+                cfg->msgSz = atoi(optarg);
+                break;
+            case 'l':
+                cfg->link.latencyNs = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 'r':
+                cfg->link.bytesPerSec = strtoull(optarg, NULL, 10) * 1000000 / 8;
+                break;
+            case 'd':
+                cfg->link.maxBuffSz = atoi(optarg);
+                break;
+            case 'c':
+                cfg->coalesceUs = atoi(optarg);
+                break;
+            case 'R':
+                cfg->rpcDepth = atoi(optarg);
+                break;
+            case 's':
+                cfg->streams = true;
+                break;
+            case 'h':
+                usage(argv[0], cfg);
+                exit(0);
+            case ':':
+                perror ("Option missing value");
+                exit(-1);
+            default:
+            case '?':
+                perror ("Unknown option");
+                exit(-1);
+        }
+    }
+    if (cfg->msgSz <= 0 || cfg->msgSz > SIM_MAX_MSG_SZ || cfg->xferSz <= 0 ||
+        cfg->link.maxBuffSz <= 0 || cfg->rpcDepth < 0 ||
+        cfg->rpcDepth > DP_RPC_MAX_INFLIGHT ||
+        (cfg->streams && (cfg->rpcDepth > 0 || cfg->coalesceUs > 0 || cfg->msgSz < (int)sizeof(int)))) {
+        usage(argv[0], cfg);
+        exit(-1);
+    }
+    //an RPC request has to fit in one datagram
+    if (cfg->rpcDepth > 0 && cfg->msgSz + (int)sizeof(dp_rpc_hdr) > cfg->link.maxBuffSz) {
+        printf("ERROR: with -R, msg_sz can be at most %d for %d byte datagrams\n",
+            cfg->link.maxBuffSz - (int)sizeof(dp_rpc_hdr), cfg->link.maxBuffSz);
+        exit(-1);
+    }
+}
+
+static void *server_thread(void *arg){
+    static __thread char rBuff[SIM_MAX_MSG_SZ];
+    sim_server *svr = arg;
+    int rcvSz, callId;
+
+    if (dplisten(svr->dpc) < 0) {
+        svr->rc = DP_ERROR_GENERAL;
+        return NULL;
+    }
+    if (svr->rpc) {
+        //answer every request with how many bytes it carried
+        while ((rcvSz = dprpc_recv(svr->dpc, &callId, rBuff, sizeof(rBuff))) >= 0) {
+            svr->bytesIn += rcvSz;
+            if (dprpc_reply(svr->dpc, callId, &rcvSz, sizeof(rcvSz)) < 0)
+                break;
+        }
+    } else if (svr->streams) {
+        int sid;
+        while ((rcvSz = dprecvstream(svr->dpc, &sid, rBuff, sizeof(rBuff))) >= 0) {
+            svr->bytesIn += rcvSz;
+            if (sid == SIM_STREAM_CTL) {
+                svr->ctlAfter = svr->bulkSeen;
+                continue;
+            }
+            //each bulk message starts with its number
+            if (memcmp(rBuff, &svr->bulkSeen, sizeof(int)) != 0)
+                svr->outOfOrder = true;
+            svr->bulkSeen++;
+        }
+    } else {
+        while ((rcvSz = dprecv(svr->dpc, rBuff, sizeof(rBuff))) >= 0)
+            svr->bytesIn += rcvSz;
+    }
+
+    //the connection frees itself when the close is received
+    svr->rc = (rcvSz == DP_CONNECTION_CLOSED) ? DP_NO_ERROR : rcvSz;
+    return NULL;
+}
+
+//Runs one transfer and returns how long it took in virtual time
+static int run_xfer(sim_config *cfg, char *sBuff, uint64_t *elapsedNs, 
+                    dp_stats *allStats){
+    dp_connp cli, svrConn;
+    sim_server svr = {0};
+    dp_stats *cliStats;
+    pthread_t tid;
+    int sent = 0, bulkBefore = 0;
+
+    if (dpLoopbackPair(&cfg->link, &cli, &svrConn) != DP_NO_ERROR)
+        return DP_ERROR_GENERAL;
+
+    svr.dpc = svrConn;
+    svr.rpc = cfg->rpcDepth > 0;
+    svr.streams = cfg->streams;
+    svr.ctlAfter = -1;
+    pthread_create(&tid, NULL, server_thread, &svr);
+
+    cliStats = dpstats_detach(cli);
+    uint64_t start = dpnow(cli);
+    if (dpconnect(cli) < 0) {
+        printf("ERROR: simulated connect failed\n");
+        exit(-1);
+    }
+    if (cfg->coalesceUs > 0)
+        dpsetcoalesce(cli, cfg->coalesceUs);
+    if (cfg->rpcDepth > 0)
+        sent = rpc_xfer(cfg, cli, sBuff);
+    if (cfg->streams)
+        sent = stream_xfer(cfg, cli, &bulkBefore);
+    while (sent < cfg->xferSz) {
+        int sz = cfg->xferSz - sent < cfg->msgSz ? cfg->xferSz - sent : cfg->msgSz;
+        int rc = dpsend(cli, sBuff, sz);
+        if (rc < 0) {
+            printf("ERROR: simulated dpsend failed with %d\n", rc);
+            exit(-1);
+        }
+        sent += rc;
+    }
+    if (dpflush(cli) < 0) {
+        printf("ERROR: simulated dpflush failed\n");
+        exit(-1);
+    }
+    *elapsedNs = dpnow(cli) - start;
+    dpdisconnect(cli);
+    pthread_join(tid, NULL);
+    dpstats_merge(allStats, cliStats);
+    free(cliStats);
+
+    if (svr.rc != DP_NO_ERROR || svr.bytesIn != sent) {
+        printf("ERROR: server got %ld of %d bytes, rc %d\n", svr.bytesIn, sent, svr.rc);
+        return DP_ERROR_PROTOCOL;
+    }
+    if (cfg->streams) {
+        if (svr.outOfOrder) {
+            printf("ERROR: stream %d messages came out of order\n", SIM_STREAM_BULK);
+            return DP_ERROR_PROTOCOL;
+        }
+        if (svr.ctlAfter < 0 || svr.ctlAfter > bulkBefore) {
+            printf("ERROR: stream %d message came after %d stream %d messages, expected at most %d\n",
+                SIM_STREAM_CTL, svr.ctlAfter, SIM_STREAM_BULK, bulkBefore);
+            return DP_ERROR_PROTOCOL;
+        }
+        if (svr.ctlAfter > maxCtlAfter)
+            maxCtlAfter = svr.ctlAfter;
+    }
+    return DP_NO_ERROR;
+}
+
+int main(int argc, char *argv[])
+{
+    static char sBuff[SIM_MAX_MSG_SZ];
+    static dp_stats allStats;
+    sim_config cfg;
+    struct timespec t0, t1;
+    uint64_t totalNs = 0, minNs = UINT64_MAX, maxNs = 0;
+
+    initParams(argc, argv, &cfg);
+    dpsetdebug(0);
+    memset(sBuff, 'x', sizeof(sBuff));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < cfg.xfers; i++) {
+        uint64_t ns;
+        if (run_xfer(&cfg, sBuff, &ns, &allStats) != DP_NO_ERROR)
+            exit(-1);
+        totalNs += ns;
+        if (ns < minNs) minNs = ns;
+        if (ns > maxNs) maxNs = ns;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double realSec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double avgNs = (double)totalNs / cfg.xfers;
+
+    printf("Simulated %d transfers of %d bytes (%d byte messages, %d byte datagrams)\n",
+        cfg.xfers, cfg.xferSz, cfg.msgSz, cfg.link.maxBuffSz);
+    printf("Link: latency %.1f us, rate %.1f Mbps\n", cfg.link.latencyNs / 1e3,
+        cfg.link.bytesPerSec * 8 / 1e6);
+    printf("Virtual time per transfer: avg %.3f ms, min %.3f ms, max %.3f ms\n",
+        avgNs / 1e6, minNs / 1e6, maxNs / 1e6);
+    printf("Virtual goodput: %.2f Mbps\n", cfg.xferSz * 8 / (avgNs / 1e9) / 1e6);
+    printf("Real time: %.3f s, %.0f transfers/s\n", realSec, cfg.xfers / realSec);
+    if (cfg.streams)
+        printf("Streams: stream %d in order, the stream %d message after at most %d of its messages\n",
+            SIM_STREAM_BULK, SIM_STREAM_CTL, maxCtlAfter);
+    printf("Client side, virtual time:\n");
+    dpstats_print(&allStats, stdout);
+    return 0;
+}
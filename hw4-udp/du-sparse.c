@@ -0,0 +1,138 @@
+#define _GNU_SOURCE                     //SEEK_DATA and SEEK_HOLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "du-sparse.h"
+
+static int send_rec(dp_connp dpc, char *msg, uint64_t off, uint64_t len, uint32_t kind){
+    dp_sparse_rec rec = { .offset = off, .len = len, .kind = kind };
+    int payload = kind == DP_SPARSE_DATA ? (int)len : 0;
+
+    memcpy(msg, &rec, sizeof(rec));
+    int rc = dpsend(dpc, msg, sizeof(rec) + payload);
+    return rc < 0 ? rc : DP_NO_ERROR;
+}
+
+/*
+ *  Client side.  Holes are found as we go, so a file that changes under
+ *  us still arrives the size it was at the start.
+ */
+int dpsparse_send(dp_connp dpc, const char *path, dp_progress *p){
+    static char msg[sizeof(dp_sparse_rec) + DP_SPARSE_CHUNK];
+    dp_sparse_hello hello = { .magic = DP_SPARSE_MAGIC };
+    uint64_t dataBytes = 0, holeBytes = 0, extents = 0;
+    struct stat st;
+    int rc;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("ERROR:  Cannot open file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return DP_ERROR_GENERAL;
+    }
+    uint64_t size = st.st_size;
+    hello.size = size;
+    if ((rc = dpsend(dpc, &hello, sizeof(hello))) < 0 ||
+        (rc = dprecv(dpc, &hello, sizeof(hello))) != sizeof(hello) ||
+        hello.magic != DP_SPARSE_MAGIC) {
+        close(fd);
+        return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+    }
+
+    uint64_t off = 0;
+    rc = DP_NO_ERROR;
+    while (off < size && rc == DP_NO_ERROR) {
+        off_t data = lseek(fd, off, SEEK_DATA);
+        if (data < 0)
+            data = errno == ENXIO ? size : off;     //ENXIO: only hole left
+        if (data > size)
+            data = size;
+        off_t hole = data < size ? lseek(fd, data, SEEK_HOLE) : size;
+        if (hole < 0 || hole > size)
+            hole = size;                            //no hole support, all data
+
+        if (data > off) {
+            if ((rc = send_rec(dpc, msg, off, data - off, DP_SPARSE_HOLE)) < 0)
+                break;
+            holeBytes += data - off;
+            dpprogress_add(p, data - off);
+        }
+        if (hole > data)
+            extents++;
+        for (off = data; off < hole; ) {
+            int n = hole - off < DP_SPARSE_CHUNK ? hole - off : DP_SPARSE_CHUNK;
+            n = pread(fd, msg + sizeof(dp_sparse_rec), n, off);
+            if (n <= 0) {
+                perror("sparse: read failed");
+                rc = DP_ERROR_GENERAL;
+                break;
+            }
+            if ((rc = send_rec(dpc, msg, off, n, DP_SPARSE_DATA)) < 0)
+                break;
+            off += n;
+            dataBytes += n;
+            dpprogress_add(p, n);
+        }
+    }
+    close(fd);
+    if (rc == DP_NO_ERROR)
+        rc = send_rec(dpc, msg, size, 0, DP_SPARSE_END);
+    if (rc == DP_NO_ERROR)
+        dpinfo("Sparse: sent %llu bytes of data in %llu extents, %llu bytes of holes skipped\n",
+            (unsigned long long)dataBytes, (unsigned long long)extents,
+            (unsigned long long)holeBytes);
+    return rc;
+}
+
+/*
+ *  Server side.  Writes through w and runs until the client closes the
+ *  connection, which also frees dpc.  The caller commits w only if that
+ *  happened after the END.
+ */
+int dpsparse_recv(dp_connp dpc, dp_writer *w, dp_progress *p){
+    static char msg[sizeof(dp_sparse_rec) + DP_SPARSE_CHUNK];
+    dp_sparse_hello hello;
+    dp_sparse_rec rec;
+    uint64_t pos = 0;
+    bool ended = false;
+    int rc;
+
+    if ((rc = dprecv(dpc, &hello, sizeof(hello))) != sizeof(hello) ||
+        hello.magic != DP_SPARSE_MAGIC)
+        return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+    if ((rc = dpsend(dpc, &hello, sizeof(hello))) < 0)
+        return rc;
+
+    while ((rc = dprecv(dpc, msg, sizeof(msg))) >= 0) {
+        int len = rc - (int)sizeof(rec);
+        memcpy(&rec, msg, sizeof(rec));
+        //everything comes in file order, nothing past the announced size
+        if (len < 0 || ended || rec.offset != pos || rec.len > hello.size - pos) {
+            rc = DP_ERROR_PROTOCOL;
+            break;
+        }
+        if (rec.kind == DP_SPARSE_DATA && rec.len == len)
+            rc = dpwriter_write(w, msg + sizeof(rec), len);
+        else if (rec.kind == DP_SPARSE_HOLE && len == 0)
+            rc = dpwriter_skip(w, rec.len);
+        else if (rec.kind == DP_SPARSE_END && len == 0 && pos == hello.size)
+            ended = true;
+        else
+            rc = DP_ERROR_PROTOCOL;
+        if (rc < 0)
+            break;
+        pos += rec.len;
+        dpprogress_add(p, rec.len);
+    }
+    if (rc == DP_CONNECTION_CLOSED && !ended) {
+        printf("ERROR: client closed before the end of the sparse file\n");
+        rc = DP_ERROR_PROTOCOL;
+    }
+    return rc;
+}
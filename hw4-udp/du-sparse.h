@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "du-proto.h"
+#include "du-write.h"
+#include "du-progress.h"
+
+/*
+ *  Sparse file transfers for du-ftp.  The client finds the data extents
+ *  of the file with lseek(SEEK_DATA/SEEK_HOLE) and only reads and sends
+ *  those; every hole goes as a single dp_sparse_rec, so a mostly empty
+ *  VM image costs about what its data does.  The server leaves the holes
+ *  in its copy (see dpwriter_skip()).  A file system that cannot tell
+ *  where the holes are makes the whole file one data extent.
+ *
+ *  After a dp_sparse_hello each way, every message is a dp_sparse_rec
+ *  with DATA bytes behind it, or a HOLE, in file order, and an END whose
+ *  offset is the file size.  Progress counts holes as done like data.
+ */
+#define DP_SPARSE_MAGIC     0x52505344      //"DSPR"
+#define DP_SPARSE_CHUNK     (60 * 1024)     //data bytes per message
+
+typedef struct dp_sparse_hello {
+    uint32_t    magic;
+    uint32_t    pad;
+    uint64_t    size;                   //of the whole file
+} dp_sparse_hello;
+
+#define DP_SPARSE_DATA      0
+#define DP_SPARSE_HOLE      1
+#define DP_SPARSE_END       2
+
+typedef struct dp_sparse_rec {
+    uint64_t    offset;
+    uint64_t    len;                    //data bytes that follow, or of hole
+    uint32_t    kind;                   //DP_SPARSE_xxx
+    uint32_t    pad;
+} dp_sparse_rec;
+
+int dpsparse_send(dp_connp dpc, const char *path, dp_progress *p);
+int dpsparse_recv(dp_connp dpc, dp_writer *w, dp_progress *p);
@@ -0,0 +1,159 @@
+#include <stdio.h> 
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "du-stats.h"
+
+static inline int hist_index(uint64_t v){
+    if (v < DP_HIST_SUB_COUNT)
+        return (int)v;
+
+    //the exponent picks the power of two range, the next SUB_BITS bits
+    //below the leading one pick the sub-bucket inside it
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - DP_HIST_SUB_BITS;
+    return ((shift + 1) << DP_HIST_SUB_BITS) + 
+            (int)((v >> shift) - DP_HIST_SUB_COUNT);
+}
+
+//highest value that lands in bucket idx
+static uint64_t hist_bucket_top(int idx){
+    if (idx < DP_HIST_SUB_COUNT)
+        return idx;
+
+    int shift = (idx >> DP_HIST_SUB_BITS) - 1;
+    uint64_t mant = DP_HIST_SUB_COUNT + (idx & (DP_HIST_SUB_COUNT - 1));
+    return ((mant + 1) << shift) - 1;
+}
+
+void dphist_record(dp_hist *h, uint64_t v){
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+    h->buckets[hist_index(v)]++;
+}
+
+uint64_t dphist_percentile(dp_hist *h, double pct){
+    uint64_t target, seen = 0;
+
+    if (h->count == 0)
+        return 0;
+    if (pct >= 100.0)
+        return h->max;
+
+    //the smallest rank with at least pct of the samples at or below it,
+    //rounding down would let p99 of a few samples skip the one stall
+    target = (uint64_t)ceil(pct / 100.0 * h->count);
+    if (target == 0)
+        target = 1;
+    if (target > h->count)
+        target = h->count;
+    for (int i = 0; i < DP_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t top = hist_bucket_top(i);
+            return top > h->max ? h->max : top;
+        }
+    }
+    return h->max;
+}
+
+void dphist_merge(dp_hist *dst, dp_hist *src){
+    if (src->count == 0)
+        return;
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (int i = 0; i < DP_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+void dpstats_merge(dp_stats *dst, dp_stats *src){
+    dphist_merge(&dst->sendLat, &src->sendLat);
+    dphist_merge(&dst->ackRtt, &src->ackRtt);
+    dphist_merge(&dst->recvWait, &src->recvWait);
+    dphist_merge(&dst->rpcLat, &src->rpcLat);
+    dst->msgsOut += src->msgsOut;
+    dst->msgsIn += src->msgsIn;
+    dst->dgramsOut += src->dgramsOut;
+    dst->dgramsIn += src->dgramsIn;
+    dst->bytesOut += src->bytesOut;
+    dst->bytesIn += src->bytesIn;
+    dst->pollHits += src->pollHits;
+    dst->pollMisses += src->pollMisses;
+    dst->pollSpinNs += src->pollSpinNs;
+    if (src->integrity > dst->integrity)
+        dst->integrity = src->integrity;
+    dst->merged = true;
+}
+
+static void hist_print(FILE *f, const char *name, dp_hist *h){
+    if (h->count == 0) {
+        fprintf(f, "  %-12s %10s\n", name, "-");
+        return;
+    }
+    fprintf(f, "  %-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+        (unsigned long long)h->count,
+        dphist_percentile(h, 50.0) / 1e3, dphist_percentile(h, 90.0) / 1e3,
+        dphist_percentile(h, 99.0) / 1e3, dphist_percentile(h, 99.9) / 1e3,
+        h->max / 1e3);
+}
+
+void dpstats_print(dp_stats *st, FILE *f){
+    fprintf(f, "du-proto stats: msgs out %llu in %llu, dgrams out %llu in %llu, "
+        "bytes out %llu in %llu\n",
+        (unsigned long long)st->msgsOut, (unsigned long long)st->msgsIn,
+        (unsigned long long)st->dgramsOut, (unsigned long long)st->dgramsIn,
+        (unsigned long long)st->bytesOut, (unsigned long long)st->bytesIn);
+    fprintf(f, "  %-12s %10s %10s %10s %10s %10s %10s\n", "latency(us)", 
+        "count", "p50", "p90", "p99", "p99.9", "max");
+    hist_print(f, "dpsend", &st->sendLat);
+    hist_print(f, "ack rtt", &st->ackRtt);
+    hist_print(f, "dprecv wait", &st->recvWait);
+    if (st->rpcLat.count > 0)
+        hist_print(f, "rpc call", &st->rpcLat);
+    if (st->pollHits + st->pollMisses > 0)
+        fprintf(f, "  busy poll: %llu hits, %llu fell back to blocking, "
+            "%.3f ms spinning\n",
+            (unsigned long long)st->pollHits, (unsigned long long)st->pollMisses,
+            st->pollSpinNs / 1e6);
+    if (st->integrity != DP_INTEGRITY_UNCHECKED && st->merged)
+        fprintf(f, "  integrity: crc32c %s\n", st->integrity == DP_INTEGRITY_OK ?
+            "matches the peer on every connection" : "MISMATCH on a connection");
+    else if (st->integrity != DP_INTEGRITY_UNCHECKED)
+        fprintf(f, "  integrity: crc32c out %08x in %08x, %s\n", st->txCrc, st->rxCrc,
+            st->integrity == DP_INTEGRITY_OK ? "matches the peer" : "MISMATCH");
+}
+
+static void hist_json(FILE *f, const char *name, dp_hist *h, const char *sep){
+    fprintf(f, "\"%s\": {\"count\": %llu, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+        "\"p99_9\": %.1f, \"max\": %.1f}%s", name, (unsigned long long)h->count,
+        dphist_percentile(h, 50.0) / 1e3, dphist_percentile(h, 90.0) / 1e3,
+        dphist_percentile(h, 99.0) / 1e3, dphist_percentile(h, 99.9) / 1e3,
+        h->max / 1e3, sep);
+}
+
+//One JSON object, latencies in microseconds like dpstats_print()
+void dpstats_json(dp_stats *st, FILE *f){
+    static const char *integrity[] = { "unchecked", "ok", "mismatch" };
+
+    fprintf(f, "{\"msgs_out\": %llu, \"msgs_in\": %llu, \"dgrams_out\": %llu, "
+        "\"dgrams_in\": %llu, \"bytes_out\": %llu, \"bytes_in\": %llu, ",
+        (unsigned long long)st->msgsOut, (unsigned long long)st->msgsIn,
+        (unsigned long long)st->dgramsOut, (unsigned long long)st->dgramsIn,
+        (unsigned long long)st->bytesOut, (unsigned long long)st->bytesIn);
+    fprintf(f, "\"poll_hits\": %llu, \"poll_misses\": %llu, \"integrity\": \"%s\", ",
+        (unsigned long long)st->pollHits, (unsigned long long)st->pollMisses,
+        integrity[st->integrity]);
+    hist_json(f, "dpsend_us", &st->sendLat, ", ");
+    hist_json(f, "ack_rtt_us", &st->ackRtt, ", ");
+    hist_json(f, "dprecv_wait_us", &st->recvWait, ", ");
+    hist_json(f, "rpc_call_us", &st->rpcLat, "}");
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ *  Log bucketed (HDR style) latency histograms.  Values are nanoseconds.
+ *  Every power of two range is split into 2^DP_HIST_SUB_BITS linear
+ *  sub-buckets, so any recorded value is off by at most ~3% and recording
+ *  is a count-leading-zeros plus an increment - cheap enough to leave on.
+ */
+#define DP_HIST_SUB_BITS    5
+#define DP_HIST_SUB_COUNT   (1 << DP_HIST_SUB_BITS)
+#define DP_HIST_BUCKETS     ((64 - DP_HIST_SUB_BITS + 1) * DP_HIST_SUB_COUNT)
+
+typedef struct dp_hist {
+    uint64_t    count;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    sum;
+    uint64_t    buckets[DP_HIST_BUCKETS];
+} dp_hist;
+
+//Per connection statistics, recorded by du-proto as it runs
+typedef struct dp_stats {
+    dp_hist     sendLat;        //dpsend() call to last fragment ACKed
+    dp_hist     ackRtt;         //datagram sent to its ACK received
+    dp_hist     recvWait;       //dprecv() call to full message received
+    dp_hist     rpcLat;         //RPC call started to response received
+    uint64_t    msgsOut;
+    uint64_t    msgsIn;
+    uint64_t    dgramsOut;
+    uint64_t    dgramsIn;
+    uint64_t    bytesOut;
+    uint64_t    bytesIn;
+    uint64_t    pollHits;       //busy poll found a datagram while spinning
+    uint64_t    pollMisses;     //spin budget ran out, fell back to blocking
+    uint64_t    pollSpinNs;     //time burned spinning, the CPU cost
+    int         integrity;      //DP_INTEGRITY_xxx, set by the close handshake
+    uint32_t    txCrc;          //CRC32C of every message sent and received
+    uint32_t    rxCrc;
+    bool        merged;         //adds up several connections, CRCs mean nothing
+} dp_stats;
+
+//ordered so merging keeps the worst
+#define DP_INTEGRITY_UNCHECKED  0
+#define DP_INTEGRITY_OK         1
+#define DP_INTEGRITY_MISMATCH   2
+
+void     dphist_record(dp_hist *h, uint64_t v);
+uint64_t dphist_percentile(dp_hist *h, double pct);
+void     dphist_merge(dp_hist *dst, dp_hist *src);
+void     dpstats_merge(dp_stats *dst, dp_stats *src);
+void     dpstats_print(dp_stats *st, FILE *f);
+void     dpstats_json(dp_stats *st, FILE *f);
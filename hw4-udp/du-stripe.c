@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "du-stripe.h"
+
+//One unit of the transfer, data starts with its dp_stripe_hdr
+typedef struct stripe_unit {
+    int             len;                //payload bytes after the header
+    char            data[];
+} stripe_unit;
+
+typedef struct stripe_flow {
+    struct dp_stripe    *s;
+    dp_connp            dpc;            //freed by du-proto once closed
+    dp_stats            *stats;         //detached, outlives dpc
+    pthread_t           tid;
+    stripe_unit         *q[DP_STRIPE_QDEPTH];
+    int                 qHead;
+    int                 qLen;
+} stripe_flow;
+
+struct dp_stripe {
+    bool                isSender;
+    int                 n;
+    int                 unitSz;         //payload bytes per unit
+    pthread_mutex_t     lock;
+    pthread_cond_t      changed;
+    int                 err;            //first error of any subflow
+    stripe_flow         flows[DP_STRIPE_MAX_SUBFLOWS];
+
+    //sending side
+    unsigned int        txSeq;
+    int                 nextFlow;
+    bool                closing;
+
+    //receiving side
+    stripe_unit         *win[DP_STRIPE_WINDOW];
+    unsigned int        rxSeq;          //next unit to hand to the app
+    int                 rxOff;          //bytes of it already handed out
+    int                 flowsDone;
+};
+
+static void stripe_fail(dp_stripe *s, int rc){
+    pthread_mutex_lock(&s->lock);
+    if (s->err == DP_NO_ERROR)
+        s->err = rc;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *stripe_sender(void *arg){
+    stripe_flow *fl = arg;
+    dp_stripe *s = fl->s;
+    bool failed = false;
+
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        while (fl->qLen == 0 && !s->closing && s->err == DP_NO_ERROR)
+            pthread_cond_wait(&s->changed, &s->lock);
+        if (fl->qLen == 0 || s->err != DP_NO_ERROR) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        stripe_unit *u = fl->q[fl->qHead];
+        fl->qHead = (fl->qHead + 1) % DP_STRIPE_QDEPTH;
+        fl->qLen--;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+
+        int rc = dpsend(fl->dpc, u->data, sizeof(dp_stripe_hdr) + u->len);
+        free(u);
+        if (rc < 0) {
+            stripe_fail(s, rc);
+            failed = true;
+            break;
+        }
+    }
+
+    //healthy subflows still close properly so the receiver is not left hanging
+    if (!failed)
+        dpdisconnect(fl->dpc);
+    else
+        dpclose(fl->dpc);
+    fl->dpc = NULL;
+    return NULL;
+}
+
+static void *stripe_receiver(void *arg){
+    stripe_flow *fl = arg;
+    dp_stripe *s = fl->s;
+    int maxSz = dpmaxpayload(fl->dpc);
+
+    while (1) {
+        stripe_unit *u = malloc(sizeof(stripe_unit) + maxSz);
+        if (u == NULL) {
+            stripe_fail(s, DP_ERROR_GENERAL);
+            break;
+        }
+        int rc = dprecv(fl->dpc, u->data, maxSz);
+        if (rc == DP_CONNECTION_CLOSED) {
+            //du-proto freed the connection when the close came in
+            fl->dpc = NULL;
+            free(u);
+            pthread_mutex_lock(&s->lock);
+            s->flowsDone++;
+            pthread_cond_broadcast(&s->changed);
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        if (rc < (int)sizeof(dp_stripe_hdr)) {
+            free(u);
+            stripe_fail(s, rc < 0 ? rc : DP_ERROR_BAD_DGRAM);
+            break;
+        }
+        u->len = rc - sizeof(dp_stripe_hdr);
+        unsigned int seq = ((dp_stripe_hdr *)u->data)->unit_seq;
+
+        //park it, waiting if it is too far ahead of what the app has read
+        pthread_mutex_lock(&s->lock);
+        while (seq - s->rxSeq >= DP_STRIPE_WINDOW && (int)(seq - s->rxSeq) > 0 &&
+                s->err == DP_NO_ERROR)
+            pthread_cond_wait(&s->changed, &s->lock);
+        if ((int)(seq - s->rxSeq) < 0 || s->win[seq % DP_STRIPE_WINDOW] != NULL) {
+            if (s->err == DP_NO_ERROR)
+                s->err = DP_ERROR_PROTOCOL;     //duplicate unit
+        }
+        if (s->err != DP_NO_ERROR) {
+            pthread_cond_broadcast(&s->changed);
+            pthread_mutex_unlock(&s->lock);
+            free(u);
+            break;
+        }
+        s->win[seq % DP_STRIPE_WINDOW] = u;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+/*
+ *  Takes over subflows that are already connected.  Their stats are
+ *  detached so they can still be reported after the subflows close.
+ */
+dp_stripe *dpstripe_open(dp_connp *subs, int subflows, bool isSender){
+    dp_stripe *s;
+
+    if (subflows <= 0 || subflows > DP_STRIPE_MAX_SUBFLOWS)
+        return NULL;
+    s = calloc(1, sizeof(dp_stripe));
+    if (s == NULL)
+        return NULL;
+    s->isSender = isSender;
+    s->n = subflows;
+    s->unitSz = dpmaxpayload(subs[0]);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, NULL);
+
+    for (int i = 0; i < subflows; i++) {
+        stripe_flow *fl = &s->flows[i];
+        fl->s = s;
+        fl->dpc = subs[i];
+        fl->stats = dpstats_detach(subs[i]);
+        if (dpmaxpayload(subs[i]) < s->unitSz)
+            s->unitSz = dpmaxpayload(subs[i]);
+    }
+    s->unitSz -= sizeof(dp_stripe_hdr);
+
+    for (int i = 0; i < subflows; i++)
+        pthread_create(&s->flows[i].tid, NULL,
+                isSender ? stripe_sender : stripe_receiver, &s->flows[i]);
+    return s;
+}
+
+//Subflow i goes to basePort + i
+dp_stripe *dpstripe_client(char *addr, int basePort, int subflows){
+    dp_connp subs[DP_STRIPE_MAX_SUBFLOWS];
+    int i;
+
+    if (subflows <= 0 || subflows > DP_STRIPE_MAX_SUBFLOWS)
+        return NULL;
+    for (i = 0; i < subflows; i++) {
+        subs[i] = dpClientInit(addr, basePort + i);
+        if (subs[i] == NULL || dpconnect(subs[i]) < 0) {
+            printf("ERROR: stripe subflow %d to port %d failed\n", i, basePort + i);
+            if (subs[i] != NULL)
+                dpclose(subs[i]);
+            break;
+        }
+    }
+    if (i < subflows) {
+        while (--i >= 0)
+            dpdisconnect(subs[i]);
+        return NULL;
+    }
+    return dpstripe_open(subs, subflows, true);
+}
+
+/*
+ *  All the ports are bound before the first listen, so the client can
+ *  connect the subflows one after another while we accept them in order.
+ */
+dp_stripe *dpstripe_server(int basePort, int subflows){
+    dp_connp subs[DP_STRIPE_MAX_SUBFLOWS];
+    int i, rc = DP_NO_ERROR;
+
+    if (subflows <= 0 || subflows > DP_STRIPE_MAX_SUBFLOWS)
+        return NULL;
+    for (i = 0; i < subflows; i++) {
+        subs[i] = dpServerInit(basePort + i);
+        if (subs[i] == NULL) {
+            rc = DP_ERROR_GENERAL;
+            break;
+        }
+    }
+    for (int j = 0; j < i && rc == DP_NO_ERROR; j++)
+        rc = dplisten(subs[j]) < 0 ? DP_ERROR_GENERAL : DP_NO_ERROR;
+    if (rc != DP_NO_ERROR) {
+        printf("ERROR: stripe subflows on ports %d-%d failed\n",
+            basePort, basePort + subflows - 1);
+        while (--i >= 0)
+            dpclose(subs[i]);
+        return NULL;
+    }
+    return dpstripe_open(subs, subflows, false);
+}
+
+/*
+ *  Queues the data on the subflows and returns, the subflow threads send
+ *  it.  Each unit goes to the subflow with the shortest queue so a slow
+ *  one does not hold up the others.
+ */
+int dpstripe_send(dp_stripe *s, void *sbuff, int sbuff_sz){
+    char *p = sbuff;
+    int left = sbuff_sz;
+
+    if (!s->isSender)
+        return DP_ERROR_GENERAL;
+
+    while (left > 0) {
+        int len = left < s->unitSz ? left : s->unitSz;
+        stripe_unit *u = malloc(sizeof(stripe_unit) + sizeof(dp_stripe_hdr) + len);
+        if (u == NULL)
+            return DP_ERROR_GENERAL;
+        u->len = len;
+        memcpy(u->data + sizeof(dp_stripe_hdr), p, len);
+
+        pthread_mutex_lock(&s->lock);
+        stripe_flow *fl;
+        while (1) {
+            fl = NULL;
+            for (int i = 0; i < s->n; i++) {
+                stripe_flow *f = &s->flows[(s->nextFlow + i) % s->n];
+                if (f->qLen < DP_STRIPE_QDEPTH && (fl == NULL || f->qLen < fl->qLen))
+                    fl = f;
+            }
+            if (fl != NULL || s->err != DP_NO_ERROR)
+                break;
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+        if (s->err != DP_NO_ERROR) {
+            int rc = s->err;
+            pthread_mutex_unlock(&s->lock);
+            free(u);
+            return rc;
+        }
+        dp_stripe_hdr *hdr = (dp_stripe_hdr *)u->data;
+        hdr->unit_seq = s->txSeq++;
+        hdr->flags = 0;
+        fl->q[(fl->qHead + fl->qLen) % DP_STRIPE_QDEPTH] = u;
+        fl->qLen++;
+        s->nextFlow = (s->nextFlow + 1) % s->n;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+
+        p += len;
+        left -= len;
+    }
+    return sbuff_sz;
+}
+
+/*
+ *  Returns up to buff_sz bytes in transfer order, blocking until the next
+ *  unit is in.  DP_CONNECTION_CLOSED once every subflow has closed and
+ *  everything was read.
+ */
+int dpstripe_recv(dp_stripe *s, void *buff, int buff_sz){
+    char *p = buff;
+    int got = 0;
+
+    if (s->isSender)
+        return DP_ERROR_GENERAL;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->win[s->rxSeq % DP_STRIPE_WINDOW] == NULL) {
+        if (s->err != DP_NO_ERROR || s->flowsDone == s->n) {
+            int rc = s->err;
+            if (rc == DP_NO_ERROR) {
+                //a hole that can never be filled means a subflow lost data
+                rc = DP_CONNECTION_CLOSED;
+                for (int i = 0; i < DP_STRIPE_WINDOW; i++)
+                    if (s->win[i] != NULL)
+                        rc = DP_ERROR_PROTOCOL;
+            }
+            pthread_mutex_unlock(&s->lock);
+            return rc;
+        }
+        pthread_cond_wait(&s->changed, &s->lock);
+    }
+
+    //hand out as many in order units as fit
+    stripe_unit *u;
+    while (got < buff_sz && (u = s->win[s->rxSeq % DP_STRIPE_WINDOW]) != NULL) {
+        int n = u->len - s->rxOff;
+        if (n > buff_sz - got)
+            n = buff_sz - got;
+        memcpy(p + got, u->data + sizeof(dp_stripe_hdr) + s->rxOff, n);
+        got += n;
+        s->rxOff += n;
+        if (s->rxOff == u->len) {
+            s->win[s->rxSeq % DP_STRIPE_WINDOW] = NULL;
+            s->rxSeq++;
+            s->rxOff = 0;
+            free(u);
+        }
+    }
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    return got;
+}
+
+/*
+ *  Sender: waits for the queued data to go out and closes the subflows.
+ *  Receiver: call once dpstripe_recv() returned DP_CONNECTION_CLOSED or
+ *  an error.  Frees the stripe either way.
+ */
+/*
+ *  Waits for the subflows to finish, which on the sending side runs their
+ *  close handshakes, then adds up their stats into out (unless NULL) and
+ *  frees s.
+ */
+int dpstripe_close(dp_stripe *s, dp_stats *out){
+    int rc;
+
+    pthread_mutex_lock(&s->lock);
+    s->closing = true;
+    if (!s->isSender && s->flowsDone < s->n && s->err == DP_NO_ERROR)
+        s->err = DP_ERROR_GENERAL;      //stop receivers parked on the window
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < s->n; i++)
+        pthread_join(s->flows[i].tid, NULL);
+    rc = s->err;
+    for (int i = 0; i < s->n && out != NULL; i++)
+        dpstats_merge(out, s->flows[i].stats);
+
+    for (int i = 0; i < s->n; i++) {
+        stripe_flow *fl = &s->flows[i];
+        if (fl->dpc != NULL)
+            dpclose(fl->dpc);
+        while (fl->qLen > 0) {
+            free(fl->q[fl->qHead]);
+            fl->qHead = (fl->qHead + 1) % DP_STRIPE_QDEPTH;
+            fl->qLen--;
+        }
+        free(fl->stats);
+    }
+    for (int i = 0; i < DP_STRIPE_WINDOW; i++)
+        free(s->win[i]);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->changed);
+    free(s);
+    return rc;
+}
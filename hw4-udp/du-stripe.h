@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "du-proto.h"
+
+/*
+ *  Striping of one transfer over several du-proto connections (subflows).
+ *  With RSS each UDP 4-tuple is hashed to one RX queue and so one core;
+ *  spreading a transfer over N source ports, each with its own thread on
+ *  both ends, lets a big transfer use N cores and keeps N datagrams in
+ *  flight instead of one.
+ *
+ *  The data is cut into units that fit one datagram.  Each unit carries a
+ *  dp_stripe_hdr with its position in the transfer, units are dealt round
+ *  robin to the subflows, and the receiver puts them back in order.  A
+ *  stripe is one way: the side that opens it with isSender sends, the
+ *  other side receives, and the sender ends it by closing every subflow.
+ *
+ *  Subflow i of a UDP stripe connects to basePort + i, both ends have to
+ *  be given the same N.
+ */
+#define DP_STRIPE_MAX_SUBFLOWS  16
+#define DP_STRIPE_QDEPTH        32      //units queued per sending subflow
+#define DP_STRIPE_WINDOW        1024    //units the receiver can hold out of order
+
+typedef struct dp_stripe_hdr {
+    unsigned int    unit_seq;           //position of the unit in the transfer
+    unsigned int    flags;              //reserved, 0
+} dp_stripe_hdr;
+
+typedef struct dp_stripe dp_stripe;
+
+dp_stripe *dpstripe_client(char *addr, int basePort, int subflows);
+dp_stripe *dpstripe_server(int basePort, int subflows);
+dp_stripe *dpstripe_open(dp_connp *subs, int subflows, bool isSender);
+int  dpstripe_send(dp_stripe *s, void *sbuff, int sbuff_sz);
+int  dpstripe_recv(dp_stripe *s, void *buff, int buff_sz);
+int  dpstripe_close(dp_stripe *s, dp_stats *out);
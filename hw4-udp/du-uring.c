@@ -0,0 +1,568 @@
+#include <stdio.h> 
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "du-uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES       64
+#define URING_SEND_SLOTS    16
+#define URING_RECV_BUFS     64          //must be a power of 2
+#define URING_BGID          1
+#define URING_RECV_TAG      (1ull << 63)
+#define URING_TIMEOUT_TAG   (1ull << 62)
+#define URING_SQPOLL_IDLE   50          //ms before the poll thread sleeps
+
+typedef struct uring_slot {
+    struct msghdr           msg;
+    struct iovec            iov;
+    struct sockaddr_storage name;
+    bool                    busy;
+} uring_slot;
+
+typedef struct dp_uring {
+    int                     ringFd;
+    int                     flags;
+    unsigned                entries;
+    bool                    hasExtArg;      //io_uring_enter() takes a timeout
+    struct __kernel_timespec waitTs;
+
+    //submission ring
+    void                    *sqPtr;
+    size_t                  sqSz;
+    unsigned                *sqHead, *sqTail, *sqMask, *sqArray, *sqFlags;
+    struct io_uring_sqe     *sqes;
+    size_t                  sqesSz;
+    unsigned                toSubmit;
+
+    //completion ring, may share the sq mapping
+    void                    *cqPtr;
+    size_t                  cqSz;
+    unsigned                *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe     *cqes;
+
+    //receive side
+    bool                    multishot;
+    bool                    recvArmed;
+    struct io_uring_buf_ring *bufRing;
+    char                    *recvArea;
+    int                     recvBufSz;
+    struct msghdr           recvMsg;
+    struct iovec            recvIov;
+    struct sockaddr_storage recvName;
+    int                     readyBid[URING_RECV_BUFS];
+    int                     readyLen[URING_RECV_BUFS];
+    int                     readyHead;
+    int                     readyCount;
+    int                     recvErr;
+
+    //send side
+    uring_slot              slots[URING_SEND_SLOTS];
+    char                    *sendArea;
+    int                     sendBufSz;
+    int                     slotsBusy;
+} dp_uring;
+
+static int  uringsend(dp_connp dp, void *sbuff, int sbuff_sz);
+static int  uringrecv(dp_connp dp, void *buff, int buff_sz);
+static void uringclose(dp_connp dp);
+static int  uringwait(dp_connp dp, int timeoutMs);
+
+static const dp_transport _uringTransport = {
+    .name  = "io_uring",
+    .send  = uringsend,
+    .recv  = uringrecv,
+    .close = uringclose,
+    .wait  = uringwait,
+};
+
+static int uring_enter(dp_uring *u, unsigned toSubmit, unsigned minComplete, 
+                        unsigned flags, void *arg, size_t argSz){
+    int rc;
+    do {
+        rc = syscall(__NR_io_uring_enter, u->ringFd, toSubmit, minComplete, 
+                        flags, arg, argSz);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+static struct io_uring_sqe *uring_getsqe(dp_uring *u){
+    unsigned tail = *u->sqTail;
+    unsigned head = __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= u->entries)
+        return NULL;
+    struct io_uring_sqe *sqe = &u->sqes[tail & *u->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_commitsqe(dp_uring *u){
+    unsigned tail = *u->sqTail;
+    unsigned idx = tail & *u->sqMask;
+
+    u->sqArray[idx] = idx;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+    u->toSubmit++;
+}
+
+/*
+ *  Hands queued SQEs to the kernel, optionally waiting for a completion.
+ *  In SQPOLL mode the poll thread takes the SQEs by itself, so we only
+ *  enter the kernel to wake it up or to sleep for a completion.
+ */
+static int uring_submitwait(dp_uring *u, unsigned minComplete, 
+                            struct __kernel_timespec *ts){
+    unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+    unsigned toSubmit = u->toSubmit;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argSz = 0;
+
+    if (ts != NULL) {
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long)ts;
+        argp = &arg;
+        argSz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    if (u->flags & DP_URING_SQPOLL) {
+        //order the tail store before the flags load, as liburing does, or
+        //we can read the flags from before the poller went to sleep and
+        //leave the new entries sitting in the ring
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (u->toSubmit && 
+            (__atomic_load_n(u->sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP))
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        u->toSubmit = 0;
+        if (flags == 0)
+            return 0;
+    } else if (toSubmit == 0 && minComplete == 0) {
+        return 0;
+    }
+
+    int rc = uring_enter(u, toSubmit, minComplete, flags, argp, argSz);
+    if (rc < 0 && errno == ETIME)
+        return 0;
+    if (rc < 0)
+        return -1;
+    if (!(u->flags & DP_URING_SQPOLL))
+        u->toSubmit -= (unsigned)rc < toSubmit ? (unsigned)rc : toSubmit;
+    return 0;
+}
+
+static int uring_submit(dp_uring *u, unsigned minComplete){
+    return uring_submitwait(u, minComplete, NULL);
+}
+
+static int uring_armrecv(dp_uring *u){
+    struct io_uring_sqe *sqe = uring_getsqe(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = 0;                            //index into registered files
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)&u->recvMsg;
+    sqe->user_data = URING_RECV_TAG;
+    if (u->multishot) {
+        //the kernel picks a buffer from the ring for every datagram
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    } else {
+        u->recvIov.iov_base = u->recvArea;
+        u->recvIov.iov_len = u->recvBufSz;
+        u->recvMsg.msg_iov = &u->recvIov;
+        u->recvMsg.msg_iovlen = 1;
+        u->recvMsg.msg_name = &u->recvName;
+        u->recvMsg.msg_namelen = sizeof(u->recvName);
+    }
+    uring_commitsqe(u);
+    u->recvArmed = true;
+    return 0;
+}
+
+static void uring_recyclebuf(dp_uring *u, int bid){
+    struct io_uring_buf_ring *br = u->bufRing;
+    unsigned short tail = br->tail;
+    struct io_uring_buf *buf = &br->bufs[tail & (URING_RECV_BUFS - 1)];
+
+    buf->addr = (unsigned long)(u->recvArea + (size_t)bid * u->recvBufSz);
+    buf->len = u->recvBufSz;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+//Drain the completion ring without blocking
+static void uring_reap(dp_uring *u){
+    unsigned head = *u->cqHead;
+
+    while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cqMask];
+
+        if (cqe->user_data & URING_TIMEOUT_TAG) {
+            //only there to end a wait, nothing to do
+        } else if (cqe->user_data & URING_RECV_TAG) {
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                u->recvArmed = false;
+
+            if (cqe->res >= 0) {
+                int slot = (u->readyHead + u->readyCount) % URING_RECV_BUFS;
+                u->readyBid[slot] = u->multishot ? 
+                        (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : 0;
+                u->readyLen[slot] = cqe->res;
+                u->readyCount++;
+            } else if (cqe->res == -EINVAL && u->multishot) {
+                //provided buffers but no multishot recvmsg, older kernel
+                u->multishot = false;
+            } else if (cqe->res != -ENOBUFS) {
+                u->recvErr = -cqe->res;
+            }
+        } else {
+            uring_slot *s = &u->slots[cqe->user_data];
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                perror("dpsend: io_uring sendmsg failed");
+            }
+            s->busy = false;
+            u->slotsBusy--;
+        }
+        head++;
+        __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+static int uringsend(dp_connp dp, void *sbuff, int sbuff_sz){
+    dp_uring *u = dp->xportCtx;
+    struct io_uring_sqe *sqe;
+    int i;
+
+    if (sbuff_sz > u->sendBufSz) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    //find a free send slot, waiting for an older send if they are all busy
+    uring_reap(u);
+    while (u->slotsBusy == URING_SEND_SLOTS) {
+        if (uring_submit(u, 1) < 0)
+            return -1;
+        uring_reap(u);
+    }
+    for (i = 0; u->slots[i].busy; i++)
+        ;
+
+    uring_slot *s = &u->slots[i];
+    memcpy(s->iov.iov_base, sbuff, sbuff_sz);
+    s->iov.iov_len = sbuff_sz;
+    memcpy(&s->name, &dp->outSockAddr.addr, dp->outSockAddr.len);
+    s->msg.msg_namelen = dp->outSockAddr.len;
+
+    while ((sqe = uring_getsqe(u)) == NULL) {
+        if (uring_submit(u, 0) < 0)
+            return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)&s->msg;
+    sqe->user_data = i;
+    uring_commitsqe(u);
+    s->busy = true;
+    u->slotsBusy++;
+
+    //submit now rather than with the next receive, the datagram may be an
+    //ACK and the peer is waiting for it
+    if (uring_submit(u, 0) < 0)
+        return -1;
+    return sbuff_sz;
+}
+
+static int uringrecv(dp_connp dp, void *buff, int buff_sz){
+    dp_uring *u = dp->xportCtx;
+    char *data;
+    int len;
+
+    uring_reap(u);
+    while (u->readyCount == 0) {
+        if (u->recvErr) {
+            errno = u->recvErr;
+            u->recvErr = 0;
+            return -1;
+        }
+        if (!u->recvArmed && uring_armrecv(u) < 0)
+            return -1;
+        if (uring_submit(u, 1) < 0)
+            return -1;
+        uring_reap(u);
+    }
+
+    int bid = u->readyBid[u->readyHead];
+    int res = u->readyLen[u->readyHead];
+    u->readyHead = (u->readyHead + 1) % URING_RECV_BUFS;
+    u->readyCount--;
+
+    if (u->multishot) {
+        //buffer layout: recvmsg_out header, name, control, payload
+        char *base = u->recvArea + (size_t)bid * u->recvBufSz;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)base;
+        socklen_t nameLen = out->namelen < u->recvMsg.msg_namelen ? 
+                            out->namelen : u->recvMsg.msg_namelen;
+
+        memcpy(&dp->outSockAddr.addr, base + sizeof(*out), nameLen);
+        dp->outSockAddr.len = nameLen;
+        data = base + sizeof(*out) + u->recvMsg.msg_namelen + 
+                u->recvMsg.msg_controllen;
+        len = out->payloadlen;
+        if (data + len > base + res)
+            len = base + res - data;
+    } else {
+        memcpy(&dp->outSockAddr.addr, &u->recvName, u->recvMsg.msg_namelen);
+        dp->outSockAddr.len = u->recvMsg.msg_namelen;
+        data = u->recvArea;
+        len = res;
+    }
+
+    //like recvfrom(), anything that does not fit is dropped
+    if (len > buff_sz)
+        len = buff_sz;
+    memcpy(buff, data, len);
+
+    if (u->multishot)
+        uring_recyclebuf(u, bid);
+    return len;
+}
+
+static int uringwait(dp_connp dp, int timeoutMs){
+    dp_uring *u = dp->xportCtx;
+
+    uring_reap(u);
+    if (u->readyCount > 0 || u->recvErr)
+        return 1;
+    if (!u->recvArmed && uring_armrecv(u) < 0)
+        return -1;
+
+    u->waitTs.tv_sec = timeoutMs / 1000;
+    u->waitTs.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+    if (u->hasExtArg) {
+        if (uring_submitwait(u, 1, &u->waitTs) < 0)
+            return -1;
+    } else {
+        //older kernels: a timeout op that completes when time is up
+        struct io_uring_sqe *sqe = uring_getsqe(u);
+        if (sqe == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long)&u->waitTs;
+        sqe->len = 1;
+        sqe->off = 1;
+        sqe->user_data = URING_TIMEOUT_TAG;
+        uring_commitsqe(u);
+        if (uring_submit(u, 1) < 0)
+            return -1;
+    }
+    uring_reap(u);
+    return (u->readyCount > 0 || u->recvErr) ? 1 : 0;
+}
+
+static void uringfree(dp_uring *u){
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqesSz);
+    if (u->cqPtr != NULL && u->cqPtr != MAP_FAILED && u->cqPtr != u->sqPtr)
+        munmap(u->cqPtr, u->cqSz);
+    if (u->sqPtr != NULL && u->sqPtr != MAP_FAILED)
+        munmap(u->sqPtr, u->sqSz);
+    if (u->ringFd >= 0)
+        close(u->ringFd);
+    free(u->bufRing);
+    free(u->recvArea);
+    free(u->sendArea);
+    free(u);
+}
+
+static void uringclose(dp_connp dp){
+    dp_uring *u = dp->xportCtx;
+
+    //let queued sends (usually the CLOSE/ACK) reach the socket first
+    uring_reap(u);
+    while (u->slotsBusy > 0) {
+        if (uring_submit(u, 1) < 0)
+            break;
+        uring_reap(u);
+    }
+    uringfree(u);
+    dpsockclose(dp);
+}
+
+static int uring_setupring(dp_uring *u){
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    if (u->flags & DP_URING_SQPOLL) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = URING_SQPOLL_IDLE;
+    }
+    u->ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->ringFd < 0 && (u->flags & DP_URING_SQPOLL)) {
+        //SQPOLL can need privileges, plain submission still beats sendto()
+        u->flags &= ~DP_URING_SQPOLL;
+        memset(&p, 0, sizeof(p));
+        u->ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (u->ringFd < 0)
+        return -1;
+    u->entries = p.sq_entries;
+    u->hasExtArg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+
+    u->sqSz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqSz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cqSz > u->sqSz)
+            u->sqSz = u->cqSz;
+        u->cqSz = u->sqSz;
+    }
+    u->sqPtr = mmap(NULL, u->sqSz, PROT_READ | PROT_WRITE, 
+                    MAP_SHARED | MAP_POPULATE, u->ringFd, IORING_OFF_SQ_RING);
+    if (u->sqPtr == MAP_FAILED)
+        return -1;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cqPtr = u->sqPtr;
+    } else {
+        u->cqPtr = mmap(NULL, u->cqSz, PROT_READ | PROT_WRITE, 
+                    MAP_SHARED | MAP_POPULATE, u->ringFd, IORING_OFF_CQ_RING);
+        if (u->cqPtr == MAP_FAILED)
+            return -1;
+    }
+    u->sqesSz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesSz, PROT_READ | PROT_WRITE, 
+                    MAP_SHARED | MAP_POPULATE, u->ringFd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        return -1;
+
+    char *sq = u->sqPtr, *cq = u->cqPtr;
+    u->sqHead = (unsigned *)(sq + p.sq_off.head);
+    u->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    u->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(sq + p.sq_off.array);
+    u->sqFlags = (unsigned *)(sq + p.sq_off.flags);
+    u->cqHead = (unsigned *)(cq + p.cq_off.head);
+    u->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    u->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static bool uring_opsupported(dp_uring *u){
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, sz);
+    bool ok = false;
+
+    if (probe == NULL)
+        return false;
+    if (syscall(__NR_io_uring_register, u->ringFd, IORING_REGISTER_PROBE, 
+                probe, 256) == 0) {
+        ok = probe->last_op >= IORING_OP_RECVMSG &&
+             (probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_RECVMSG].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static int uring_setupbuffers(dp_uring *u, dp_connp dp){
+    int dgramSz = dp->maxBuffSz + sizeof(dp_pdu);
+    socklen_t nameLen = (dp->family == AF_UNIX) ? 
+            sizeof(struct sockaddr_un) : sizeof(struct sockaddr_in);
+
+    u->sendBufSz = dgramSz;
+    u->sendArea = malloc((size_t)URING_SEND_SLOTS * dgramSz);
+    if (u->sendArea == NULL)
+        return -1;
+    for (int i = 0; i < URING_SEND_SLOTS; i++) {
+        uring_slot *s = &u->slots[i];
+        s->iov.iov_base = u->sendArea + (size_t)i * dgramSz;
+        s->msg.msg_name = &s->name;
+        s->msg.msg_iov = &s->iov;
+        s->msg.msg_iovlen = 1;
+    }
+
+    //multishot template: the kernel only looks at the name/control sizes
+    u->recvMsg.msg_namelen = nameLen;
+    u->recvBufSz = sizeof(struct io_uring_recvmsg_out) + nameLen + dgramSz;
+    u->recvArea = malloc((size_t)URING_RECV_BUFS * u->recvBufSz);
+    if (u->recvArea == NULL)
+        return -1;
+
+    if (posix_memalign((void **)&u->bufRing, sysconf(_SC_PAGESIZE), 
+            URING_RECV_BUFS * sizeof(struct io_uring_buf)) != 0) {
+        u->bufRing = NULL;
+        return -1;
+    }
+    memset(u->bufRing, 0, URING_RECV_BUFS * sizeof(struct io_uring_buf));
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->bufRing;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->ringFd, IORING_REGISTER_PBUF_RING, 
+                &reg, 1) == 0) {
+        u->multishot = true;
+        for (int i = 0; i < URING_RECV_BUFS; i++)
+            uring_recyclebuf(u, i);
+    } else {
+        u->multishot = false;
+    }
+    return 0;
+}
+
+int dpuringenable(dp_connp dp, int flags){
+    if (dp->udp_sock < 0) {
+        printf("dpuringenable: only socket based connections can use io_uring\n");
+        return DP_ERROR_GENERAL;
+    }
+
+    dp_uring *u = calloc(1, sizeof(dp_uring));
+    if (u == NULL)
+        return DP_ERROR_GENERAL;
+    u->ringFd = -1;
+    u->flags = flags;
+
+    if (uring_setupring(u) < 0 || !uring_opsupported(u)) {
+        uringfree(u);
+        return DP_ERROR_GENERAL;
+    }
+    if (syscall(__NR_io_uring_register, u->ringFd, IORING_REGISTER_FILES, 
+                &dp->udp_sock, 1) < 0) {
+        uringfree(u);
+        return DP_ERROR_GENERAL;
+    }
+    if (uring_setupbuffers(u, dp) < 0) {
+        uringfree(u);
+        return DP_ERROR_GENERAL;
+    }
+
+    dp->xport = &_uringTransport;
+    dp->xportCtx = u;
+    dp->rxStamps = false;               //completions dont carry SO_TIMESTAMPNS
+    return DP_NO_ERROR;
+}
+
+#else
+
+//No io_uring on this platform, callers stay on the socket transport
+int dpuringenable(dp_connp dp, int flags){
+    return DP_ERROR_GENERAL;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "du-proto.h"
+
+/*
+ *  Optional io_uring I/O engine for du-proto.  dpuringenable() swaps the
+ *  socket transport of a UDP or unix connection for one that submits
+ *  sendmsg/recvmsg through an io_uring.  The socket is registered as a
+ *  fixed file, receives are served from a provided buffer ring by a
+ *  multishot recvmsg that stays armed across datagrams, and sends are
+ *  queued from a pre-allocated slot pool.  With DP_URING_SQPOLL a kernel
+ *  thread picks up submissions, so a datagram normally costs no syscall
+ *  at all unless the receiver has to sleep.
+ *
+ *  Anything the running kernel does not support is detected at setup:
+ *  no multishot means single shot recvmsg, no io_uring at all means the
+ *  call fails and the connection keeps using sendto()/recvfrom().
+ */
+#define DP_URING_SQPOLL     1
+
+int  dpuringenable(dp_connp dp, int flags);
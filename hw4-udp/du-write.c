@@ -0,0 +1,235 @@
+#define _GNU_SOURCE                     //O_DIRECT and fallocate()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+
+#include "du-write.h"
+#include "du-proto.h"
+
+struct dp_writer {
+    int             fd;
+    dp_write_cfg    cfg;
+    char            *buff;              //DP_WRITE_ALIGN aligned
+    int             buffLen;
+    uint64_t        fileOff;            //bytes already written out
+    uint64_t        allocated;          //end of the preallocated space
+    bool            canAlloc;
+    uint64_t        lastSync;
+    dp_write_stats  stats;
+    char            path[1024];
+    char            tmpPath[1024 + sizeof(DP_WRITE_SUFFIX)];
+};
+
+//"none", "close" or "periodic", -1 for anything else
+int dpwriter_parse_durability(const char *name){
+    if (strcmp(name, "none") == 0)
+        return DP_DURABLE_NONE;
+    if (strcmp(name, "close") == 0)
+        return DP_DURABLE_CLOSE;
+    if (strcmp(name, "periodic") == 0)
+        return DP_DURABLE_PERIODIC;
+    return -1;
+}
+
+static void prealloc(dp_writer *w, uint64_t upTo){
+    if (!w->canAlloc || upTo <= w->allocated)
+        return;
+    if (fallocate(w->fd, 0, w->allocated, upTo - w->allocated) < 0) {
+        //not every file system can, the writes still work
+        w->canAlloc = false;
+        return;
+    }
+    w->stats.preallocated += upTo - w->allocated;
+    w->allocated = upTo;
+}
+
+//Writes the buffer out, the last one padded to the alignment for O_DIRECT
+static int flush(dp_writer *w, bool last){
+    int len = w->buffLen;
+
+    if (len == 0)
+        return DP_NO_ERROR;
+    if (last && w->stats.direct && len % DP_WRITE_ALIGN != 0) {
+        int padded = (len + DP_WRITE_ALIGN - 1) / DP_WRITE_ALIGN * DP_WRITE_ALIGN;
+        memset(w->buff + len, 0, padded - len);
+        len = padded;
+    }
+    if (w->fileOff + len > w->allocated)
+        prealloc(w, w->fileOff + len + DP_WRITE_PREALLOC);
+
+    for (int off = 0; off < len; ) {
+        ssize_t n = pwrite(w->fd, w->buff + off, len - off, w->fileOff + off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("write engine: write failed");
+            return DP_ERROR_GENERAL;
+        }
+        off += n;
+        w->stats.writes++;
+    }
+    w->fileOff += w->buffLen;
+    w->buffLen = 0;
+
+    if (w->cfg.durability == DP_DURABLE_PERIODIC &&
+        w->fileOff - w->lastSync >= DP_WRITE_SYNC_EVERY) {
+        if (fdatasync(w->fd) < 0) {
+            perror("write engine: fdatasync failed");
+            return DP_ERROR_GENERAL;
+        }
+        w->stats.syncs++;
+        w->lastSync = w->fileOff;
+    }
+    return DP_NO_ERROR;
+}
+
+/*
+ *  Opens <path>DP_WRITE_SUFFIX for a new copy of path.  sizeHint is the
+ *  size the sender announced, 0 if it did not say.
+ */
+dp_writer *dpwriter_open(const char *path, int mode, uint64_t sizeHint,
+                         const dp_write_cfg *cfg){
+    dp_writer *w = calloc(1, sizeof(dp_writer));
+    if (w == NULL)
+        return NULL;
+    if (cfg != NULL)
+        w->cfg = *cfg;
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    snprintf(w->tmpPath, sizeof(w->tmpPath), "%s%s", path, DP_WRITE_SUFFIX);
+    if (posix_memalign((void **)&w->buff, DP_WRITE_ALIGN, DP_WRITE_BUFF_SZ) != 0) {
+        free(w);
+        return NULL;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    w->fd = -1;
+    if (w->cfg.direct) {
+        w->fd = open(w->tmpPath, flags | O_DIRECT, mode);
+        w->stats.direct = w->fd >= 0;
+    }
+    if (w->fd < 0)
+        w->fd = open(w->tmpPath, flags, mode);
+    if (w->fd < 0) {
+        printf("ERROR:  Cannot open file %s\n", w->tmpPath);
+        free(w->buff);
+        free(w);
+        return NULL;
+    }
+    w->canAlloc = true;
+    if (sizeHint > 0)
+        prealloc(w, sizeHint);
+    return w;
+}
+
+/*
+ *  Leaves len bytes of hole at the current position, the final
+ *  ftruncate() makes a hole at the end.  Space preallocated over it is
+ *  punched out again.  O_DIRECT cannot seek to an unaligned spot, so
+ *  there the hole is written as zeros.
+ */
+int dpwriter_skip(dp_writer *w, uint64_t len){
+    static const char zeros[DP_WRITE_ALIGN];
+    int rc;
+
+    if (w->stats.direct && (w->buffLen % DP_WRITE_ALIGN != 0 || len % DP_WRITE_ALIGN != 0)) {
+        for (; len > 0; len -= len < sizeof(zeros) ? len : sizeof(zeros))
+            if ((rc = dpwriter_write(w, zeros, len < sizeof(zeros) ? len : sizeof(zeros))) < 0)
+                return rc;
+        return DP_NO_ERROR;
+    }
+    if ((rc = flush(w, false)) < 0)
+        return rc;
+    if (w->allocated > w->fileOff) {
+        uint64_t end = w->fileOff + len < w->allocated ? w->fileOff + len : w->allocated;
+        //if this fails the space still reads back as zeros
+        fallocate(w->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, w->fileOff, end - w->fileOff);
+    }
+    w->fileOff += len;
+    if (w->allocated < w->fileOff)
+        w->allocated = w->fileOff;      //later preallocation starts past the hole
+    w->stats.holes += len;
+    return DP_NO_ERROR;
+}
+
+int dpwriter_write(dp_writer *w, const void *data, int len){
+    const char *p = data;
+    int rc;
+
+    while (len > 0) {
+        int n = DP_WRITE_BUFF_SZ - w->buffLen;
+        if (n > len)
+            n = len;
+        memcpy(w->buff + w->buffLen, p, n);
+        w->buffLen += n;
+        w->stats.bytes += n;
+        p += n;
+        len -= n;
+        if (w->buffLen == DP_WRITE_BUFF_SZ && (rc = flush(w, false)) < 0)
+            return rc;
+    }
+    return DP_NO_ERROR;
+}
+
+static void release(dp_writer *w){
+    if (w->fd >= 0)
+        close(w->fd);
+    free(w->buff);
+    free(w);
+}
+
+void dpwriter_abort(dp_writer *w){
+    if (w == NULL)
+        return;
+    unlink(w->tmpPath);
+    release(w);
+}
+
+//The rename is only durable once the directory entry is on disk too
+static int sync_dir(const char *path){
+    char dir[sizeof(((dp_writer *)0)->path)];
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return DP_ERROR_GENERAL;
+    int rc = fsync(fd);
+    close(fd);
+    return rc < 0 ? DP_ERROR_GENERAL : DP_NO_ERROR;
+}
+
+/*
+ *  Writes what is left, trims the preallocation and padding, syncs as the
+ *  durability level says and renames the file into place.  w is freed
+ *  either way, on failure the temp file is removed and path left alone.
+ */
+int dpwriter_commit(dp_writer *w, dp_write_stats *out){
+    int rc = flush(w, true);
+
+    if (rc == DP_NO_ERROR && ftruncate(w->fd, w->fileOff) < 0)
+        rc = DP_ERROR_GENERAL;
+    if (rc == DP_NO_ERROR && w->cfg.durability != DP_DURABLE_NONE) {
+        if (fsync(w->fd) < 0)
+            rc = DP_ERROR_GENERAL;
+        else
+            w->stats.syncs++;
+    }
+    if (rc == DP_NO_ERROR && rename(w->tmpPath, w->path) < 0) {
+        perror("write engine: rename failed");
+        rc = DP_ERROR_GENERAL;
+    }
+    if (rc == DP_NO_ERROR && w->cfg.durability != DP_DURABLE_NONE &&
+        sync_dir(w->path) < 0)
+        printf("WARNING: could not sync the directory of %s\n", w->path);
+    if (out != NULL)
+        *out = w->stats;
+
+    if (rc == DP_NO_ERROR)
+        release(w);
+    else
+        dpwriter_abort(w);
+    return rc;
+}
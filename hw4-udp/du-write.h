@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ *  Receiver side write engine.  Incoming messages are copied into a large
+ *  aligned buffer and written out DP_WRITE_BUFF_SZ at a time, so the disk
+ *  sees a few big aligned writes instead of one small write per message,
+ *  which is also what O_DIRECT needs.  Space is preallocated with
+ *  fallocate(), all of it up front when the sender announced the size,
+ *  else DP_WRITE_PREALLOC ahead of the writes.  dpwriter_skip() leaves
+ *  a hole instead of writing zeros, for sparse files.
+ *
+ *  The data goes to <path>DP_WRITE_SUFFIX and is renamed over path by
+ *  dpwriter_commit(), so readers never see a half written file and a
+ *  failed transfer leaves any old copy alone.  Durability levels:
+ *
+ *      DP_DURABLE_NONE      leave it to the page cache
+ *      DP_DURABLE_CLOSE     fsync the file and its directory at commit
+ *      DP_DURABLE_PERIODIC  as CLOSE, plus fdatasync every
+ *                           DP_WRITE_SYNC_EVERY bytes so little is lost
+ *                           in a crash and dirty pages never pile up
+ */
+#define DP_WRITE_ALIGN          4096
+#define DP_WRITE_BUFF_SZ        (1024 * 1024)
+#define DP_WRITE_PREALLOC       (64 * 1024 * 1024)
+#define DP_WRITE_SYNC_EVERY     (16 * 1024 * 1024)
+#define DP_WRITE_SUFFIX         ".dppart"
+
+#define DP_DURABLE_NONE         0
+#define DP_DURABLE_CLOSE        1
+#define DP_DURABLE_PERIODIC     2
+
+typedef struct dp_write_cfg {
+    int         durability;             //DP_DURABLE_xxx
+    bool        direct;                 //O_DIRECT, quietly off if the fs says no
+} dp_write_cfg;
+
+typedef struct dp_write_stats {
+    uint64_t    bytes;
+    uint64_t    writes;                 //pwrite() calls
+    uint64_t    syncs;
+    uint64_t    preallocated;           //bytes fallocate()d
+    uint64_t    holes;                  //bytes left as holes by dpwriter_skip()
+    bool        direct;                 //O_DIRECT was in use
+} dp_write_stats;
+
+typedef struct dp_writer dp_writer;
+
+dp_writer *dpwriter_open(const char *path, int mode, uint64_t sizeHint,
+                         const dp_write_cfg *cfg);
+int  dpwriter_write(dp_writer *w, const void *data, int len);
+int  dpwriter_skip(dp_writer *w, uint64_t len);
+int  dpwriter_commit(dp_writer *w, dp_write_stats *out);
+void dpwriter_abort(dp_writer *w);
+int  dpwriter_parse_durability(const char *name);